@@ -43,6 +43,9 @@
 #include "ae.h"
 #include "config.h"
 
+/* initial size of the timer heap, it grows as needed */
+#define AE_TIMERS_INITIAL 16
+
 /* Include the best multiplexing layer supported by this system.
  * The following should be ordered by performances, descending. */
 #ifdef HAVE_EVPORT
@@ -63,13 +66,17 @@ aeEventLoop *aeCreateEventLoop(int setsize) {
     aeEventLoop *eventLoop;
     int i;
 
-    if ((eventLoop = malloc(sizeof(*eventLoop))) == NULL) goto err;
+    if ((eventLoop = calloc(1,sizeof(*eventLoop))) == NULL) goto err;
     eventLoop->events = malloc(sizeof(aeFileEvent)*setsize);
     eventLoop->fired = malloc(sizeof(aeFiredEvent)*setsize);
     if (eventLoop->events == NULL || eventLoop->fired == NULL) goto err;
     eventLoop->setsize = setsize;
-    eventLoop->lastTime = time(NULL);
-    eventLoop->timeEventHead = NULL;
+    eventLoop->timers = malloc(sizeof(aeTimeEvent*)*AE_TIMERS_INITIAL);
+    if (eventLoop->timers == NULL) goto err;
+    eventLoop->ntimers = 0;
+    eventLoop->timersize = AE_TIMERS_INITIAL;
+    eventLoop->timerRunning = NULL;
+    eventLoop->timersFired = NULL;
     eventLoop->timeEventNextId = 0;
     eventLoop->stop = 0;
     eventLoop->maxfd = -1;
@@ -85,6 +92,7 @@ err:
     if (eventLoop) {
         free(eventLoop->events);
         free(eventLoop->fired);
+        free(eventLoop->timers);
         free(eventLoop);
     }
     return NULL;
@@ -121,7 +129,12 @@ int aeResizeSetSize(aeEventLoop *eventLoop, int setsize) {
 }
 
 void aeDeleteEventLoop(aeEventLoop *eventLoop) {
+    int j;
+
     aeApiFree(eventLoop);
+    for (j = 0; j < eventLoop->ntimers; j++)
+        free(eventLoop->timers[j]);
+    free(eventLoop->timers);
     free(eventLoop->events);
     free(eventLoop->fired);
     free(eventLoop);
@@ -176,27 +189,79 @@ int aeGetFileEvents(aeEventLoop *eventLoop, int fd) {
     return fe->mask;
 }
 
-static void aeGetTime(long *seconds, long *milliseconds)
+/* Time events are kept in a binary min-heap ordered on when they fire, so
+ * the nearest one is always timers[0] and adding or removing one is
+ * O(log N). Times come from the monotonic clock, so setting the system
+ * clock doesn't delay or bunch up the timers. */
+
+static long long aeGetTime(void)
 {
-    struct timeval tv;
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((long long)ts.tv_sec)*1000 + ts.tv_nsec/1000000;
+}
+
+static void aeTimerSet(aeEventLoop *eventLoop, int i, aeTimeEvent *te) {
+    eventLoop->timers[i] = te;
+    te->index = i;
+}
+
+static void aeTimerUp(aeEventLoop *eventLoop, int i) {
+    aeTimeEvent **timers = eventLoop->timers;
+    aeTimeEvent *te = timers[i];
+
+    while (i > 0) {
+        int parent = (i-1)/2;
 
-    gettimeofday(&tv, NULL);
-    *seconds = tv.tv_sec;
-    *milliseconds = tv.tv_usec/1000;
+        if (timers[parent]->when <= te->when) break;
+        aeTimerSet(eventLoop,i,timers[parent]);
+        i = parent;
+    }
+    aeTimerSet(eventLoop,i,te);
 }
 
-static void aeAddMillisecondsToNow(long long milliseconds, long *sec, long *ms) {
-    long cur_sec, cur_ms, when_sec, when_ms;
+static void aeTimerDown(aeEventLoop *eventLoop, int i) {
+    aeTimeEvent **timers = eventLoop->timers;
+    aeTimeEvent *te = timers[i];
+    int n = eventLoop->ntimers;
+
+    while (1) {
+        int child = 2*i+1;
 
-    aeGetTime(&cur_sec, &cur_ms);
-    when_sec = cur_sec + milliseconds/1000;
-    when_ms = cur_ms + milliseconds%1000;
-    if (when_ms >= 1000) {
-        when_sec ++;
-        when_ms -= 1000;
+        if (child >= n) break;
+        if (child+1 < n && timers[child+1]->when < timers[child]->when)
+            child++;
+        if (te->when <= timers[child]->when) break;
+        aeTimerSet(eventLoop,i,timers[child]);
+        i = child;
     }
-    *sec = when_sec;
-    *ms = when_ms;
+    aeTimerSet(eventLoop,i,te);
+}
+
+static int aeTimerPush(aeEventLoop *eventLoop, aeTimeEvent *te) {
+    if (eventLoop->ntimers == eventLoop->timersize) {
+        int size = eventLoop->timersize*2;
+        aeTimeEvent **timers = realloc(eventLoop->timers,sizeof(aeTimeEvent*)*size);
+
+        if (timers == NULL) return AE_ERR;
+        eventLoop->timers = timers;
+        eventLoop->timersize = size;
+    }
+    aeTimerSet(eventLoop,eventLoop->ntimers++,te);
+    aeTimerUp(eventLoop,te->index);
+    return AE_OK;
+}
+
+static aeTimeEvent *aeTimerPop(aeEventLoop *eventLoop) {
+    aeTimeEvent *te = eventLoop->timers[0];
+
+    if (--eventLoop->ntimers > 0) {
+        aeTimerSet(eventLoop,0,eventLoop->timers[eventLoop->ntimers]);
+        aeTimerDown(eventLoop,0);
+    }
+    te->index = -1;
+    return te;
 }
 
 long long aeCreateTimeEvent(aeEventLoop *eventLoop, long long milliseconds,
@@ -209,125 +274,101 @@ long long aeCreateTimeEvent(aeEventLoop *eventLoop, long long milliseconds,
     te = malloc(sizeof(*te));
     if (te == NULL) return AE_ERR;
     te->id = id;
-    aeAddMillisecondsToNow(milliseconds,&te->when_sec,&te->when_ms);
+    te->when = aeGetTime() + milliseconds;
     te->timeProc = proc;
     te->finalizerProc = finalizerProc;
     te->clientData = clientData;
-    te->next = eventLoop->timeEventHead;
-    eventLoop->timeEventHead = te;
+    te->next = NULL;
+    if (aeTimerPush(eventLoop,te) == AE_ERR) {
+        free(te);
+        return AE_ERR;
+    }
     return id;
 }
 
+/* The event isn't freed straight away, as the caller may still be using
+ * its client data. It's marked as deleted and moved to the top of the heap,
+ * and processTimeEvents() calls the finalizer and frees it. */
 int aeDeleteTimeEvent(aeEventLoop *eventLoop, long long id)
 {
-    aeTimeEvent *te = eventLoop->timeEventHead;
-    while(te) {
+    aeTimeEvent *te = eventLoop->timerRunning;
+    int j;
+
+    if (te && te->id == id) {
+        te->id = AE_DELETED_EVENT_ID;
+        return AE_OK;
+    }
+
+    for (te = eventLoop->timersFired; te; te = te->next) {
+        if (te->id == id) {
+            te->id = AE_DELETED_EVENT_ID;
+            return AE_OK;
+        }
+    }
+
+    for (j = 0; j < eventLoop->ntimers; j++) {
+        te = eventLoop->timers[j];
         if (te->id == id) {
             te->id = AE_DELETED_EVENT_ID;
+            te->when = 0;
+            aeTimerUp(eventLoop,j);
             return AE_OK;
         }
-        te = te->next;
     }
     return AE_ERR; /* NO event with the specified ID found */
 }
 
-/* Search the first timer to fire.
- * This operation is useful to know how many time the select can be
- * put in sleep without to delay any event.
- * If there are no timers NULL is returned.
- *
- * Note that's O(N) since time events are unsorted.
- * Possible optimizations (not needed by Redis so far, but...):
- * 1) Insert the event in order, so that the nearest is just the head.
- *    Much better but still insertion or deletion of timers is O(N).
- * 2) Use a skiplist to have this operation as O(1) and insertion as O(log(N)).
- */
-static aeTimeEvent *aeSearchNearestTimer(aeEventLoop *eventLoop)
-{
-    aeTimeEvent *te = eventLoop->timeEventHead;
-    aeTimeEvent *nearest = NULL;
-
-    while(te) {
-        if (!nearest || te->when_sec < nearest->when_sec ||
-                (te->when_sec == nearest->when_sec &&
-                 te->when_ms < nearest->when_ms))
-            nearest = te;
-        te = te->next;
-    }
-    return nearest;
+static void aeFreeTimeEvent(aeEventLoop *eventLoop, aeTimeEvent *te) {
+    if (te->finalizerProc)
+        te->finalizerProc(eventLoop, te->clientData);
+    free(te);
 }
 
 /* Process time events */
 static int processTimeEvents(aeEventLoop *eventLoop) {
     int processed = 0;
-    aeTimeEvent *te, *prev;
-    long long maxId;
-    time_t now = time(NULL);
-
-    /* If the system clock is moved to the future, and then set back to the
-     * right value, time events may be delayed in a random way. Often this
-     * means that scheduled operations will not be performed soon enough.
-     *
-     * Here we try to detect system clock skews, and force all the time
-     * events to be processed ASAP when this happens: the idea is that
-     * processing events earlier is less dangerous than delaying them
-     * indefinitely, and practice suggests it is. */
-    if (now < eventLoop->lastTime) {
-        te = eventLoop->timeEventHead;
-        while(te) {
-            te->when_sec = 0;
-            te = te->next;
-        }
-    }
-    eventLoop->lastTime = now;
+    aeTimeEvent *te;
+    long long maxId = eventLoop->timeEventNextId-1;
+    long long now = aeGetTime();
 
-    prev = NULL;
-    te = eventLoop->timeEventHead;
-    maxId = eventLoop->timeEventNextId-1;
-    while(te) {
-        long now_sec, now_ms;
-        long long id;
+    /* Every event which is due comes off the heap. Events which are to run
+     * again, and events created by the time events in this iteration, only
+     * go back on once we're done, so each runs at most once per call even
+     * if it asks to be run again straight away. */
+    while (eventLoop->ntimers && eventLoop->timers[0]->when <= now) {
+        te = aeTimerPop(eventLoop);
 
         /* Remove events scheduled for deletion. */
         if (te->id == AE_DELETED_EVENT_ID) {
-            aeTimeEvent *next = te->next;
-            if (prev == NULL)
-                eventLoop->timeEventHead = te->next;
-            else
-                prev->next = te->next;
-            if (te->finalizerProc)
-                te->finalizerProc(eventLoop, te->clientData);
-            free(te);
-            te = next;
+            aeFreeTimeEvent(eventLoop,te);
             continue;
         }
 
-        /* Make sure we don't process time events created by time events in
-         * this iteration. Note that this check is currently useless: we always
-         * add new timers on the head, however if we change the implementation
-         * detail, this check may be useful again: we keep it here for future
-         * defense. */
-        if (te->id > maxId) {
-            te = te->next;
-            continue;
-        }
-        aeGetTime(&now_sec, &now_ms);
-        if (now_sec > te->when_sec ||
-            (now_sec == te->when_sec && now_ms >= te->when_ms))
-        {
+        if (te->id <= maxId) {
             int retval;
 
-            id = te->id;
-            retval = te->timeProc(eventLoop, id, te->clientData);
+            eventLoop->timerRunning = te;
+            retval = te->timeProc(eventLoop, te->id, te->clientData);
+            eventLoop->timerRunning = NULL;
             processed++;
-            if (retval != AE_NOMORE) {
-                aeAddMillisecondsToNow(retval,&te->when_sec,&te->when_ms);
-            } else {
-                te->id = AE_DELETED_EVENT_ID;
+
+            if (retval == AE_NOMORE || te->id == AE_DELETED_EVENT_ID) {
+                aeFreeTimeEvent(eventLoop,te);
+                continue;
             }
+            te->when = now + retval;
         }
-        prev = te;
-        te = te->next;
+
+        te->next = eventLoop->timersFired;
+        eventLoop->timersFired = te;
+    }
+
+    while ((te = eventLoop->timersFired)) {
+        eventLoop->timersFired = te->next;
+        te->next = NULL;
+        if (te->id == AE_DELETED_EVENT_ID ||
+            aeTimerPush(eventLoop,te) == AE_ERR)
+            aeFreeTimeEvent(eventLoop,te);
     }
     return processed;
 }
@@ -362,19 +403,15 @@ int aeProcessEvents(aeEventLoop *eventLoop, int flags)
         aeTimeEvent *shortest = NULL;
         struct timeval tv, *tvp;
 
-        if (flags & AE_TIME_EVENTS && !(flags & AE_DONT_WAIT))
-            shortest = aeSearchNearestTimer(eventLoop);
+        if (flags & AE_TIME_EVENTS && !(flags & AE_DONT_WAIT) &&
+            eventLoop->ntimers)
+            shortest = eventLoop->timers[0];
         if (shortest) {
-            long now_sec, now_ms;
-
-            aeGetTime(&now_sec, &now_ms);
             tvp = &tv;
 
             /* How many milliseconds we need to wait for the next
              * time event to fire? */
-            long long ms =
-                (shortest->when_sec - now_sec)*1000 +
-                shortest->when_ms - now_ms;
+            long long ms = shortest->when - aeGetTime();
 
             if (ms > 0) {
                 tvp->tv_sec = ms/1000;
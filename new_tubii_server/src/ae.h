@@ -72,12 +72,12 @@ typedef struct aeFileEvent {
 /* Time event structure */
 typedef struct aeTimeEvent {
     long long id; /* time event identifier. */
-    long when_sec; /* seconds */
-    long when_ms; /* milliseconds */
+    long long when; /* monotonic clock, milliseconds */
     aeTimeProc *timeProc;
     aeEventFinalizerProc *finalizerProc;
     void *clientData;
-    struct aeTimeEvent *next;
+    int index; /* position in the timer heap, -1 while it's off the heap */
+    struct aeTimeEvent *next; /* fired events waiting to go back on the heap */
 } aeTimeEvent;
 
 /* A fired event */
@@ -91,10 +91,13 @@ typedef struct aeEventLoop {
     int maxfd;   /* highest file descriptor currently registered */
     int setsize; /* max number of file descriptors tracked */
     long long timeEventNextId;
-    time_t lastTime;     /* Used to detect system clock skew */
     aeFileEvent *events; /* Registered events */
     aeFiredEvent *fired; /* Fired events */
-    aeTimeEvent *timeEventHead;
+    aeTimeEvent **timers; /* Time events, a binary min-heap on when */
+    int ntimers;
+    int timersize;
+    aeTimeEvent *timerRunning; /* Time event whose proc is being called */
+    aeTimeEvent *timersFired; /* Time events waiting to go back on the heap */
     int stop;
     void *apidata; /* This is used for polling API specific data */
     aeBeforeSleepProc *beforesleep;
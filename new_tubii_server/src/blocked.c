@@ -80,6 +80,7 @@ void blockClient(client *c, blockingFreeProc *bfree, void *data) {
         c->bpop.data = NULL;
     }
 
+    c->numblocked++;
     server.bpop_blocked_clients++;
 }
 
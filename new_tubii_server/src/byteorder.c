@@ -0,0 +1,137 @@
+/* Bulk conversion of TubiiRecord arrays to big endian for the data stream.
+ *
+ * On the Zynq's Cortex-A9 this uses NEON (vrev32 swaps the bytes of four
+ * words, i.e. two records, at a time). x86 builds use SSSE3 or SSE2, and
+ * anything else falls back to a plain htonl() loop. The NEON path is only
+ * compiled in when the compiler targets NEON, which the Zynq builds in
+ * .cproject do with -mfpu=neon -mfloat-abi=softfp. */
+
+#include "byteorder.h"
+#include <stdint.h>
+#include <arpa/inet.h>
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define HAVE_NEON
+#elif defined(__SSSE3__)
+#include <tmmintrin.h>
+#define HAVE_SSSE3
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define HAVE_SSE2
+#endif
+#endif
+
+void records_to_big_endian(struct TubiiRecord *rec, int n)
+{
+    /* Convert every 32 bit word in the `n` records pointed to by `rec` to
+     * big endian in place. */
+    uint32_t *w = (uint32_t *) rec;
+    int words = n*sizeof(struct TubiiRecord)/4;
+    int i = 0;
+
+#if defined(HAVE_NEON)
+    for (; i + 4 <= words; i += 4) {
+        uint8x16_t v = vld1q_u8((uint8_t *) (w + i));
+        vst1q_u8((uint8_t *) (w + i), vrev32q_u8(v));
+    }
+#elif defined(HAVE_SSSE3)
+    const __m128i mask = _mm_set_epi8(12, 13, 14, 15, 8, 9, 10, 11,
+                                      4, 5, 6, 7, 0, 1, 2, 3);
+
+    for (; i + 4 <= words; i += 4) {
+        __m128i v = _mm_loadu_si128((__m128i *) (w + i));
+        _mm_storeu_si128((__m128i *) (w + i), _mm_shuffle_epi8(v, mask));
+    }
+#elif defined(HAVE_SSE2)
+    for (; i + 4 <= words; i += 4) {
+        __m128i v = _mm_loadu_si128((__m128i *) (w + i));
+        /* swap the bytes in each 16 bit half, then swap the halves */
+        v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+        v = _mm_shufflehi_epi16(_mm_shufflelo_epi16(v, 0xB1), 0xB1);
+        _mm_storeu_si128((__m128i *) (w + i), v);
+    }
+#endif
+
+    for (; i < words; i++) {
+        w[i] = htonl(w[i]);
+    }
+}
+
+#ifdef BYTEORDER_BENCH_MAIN
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+
+/* Micro-benchmark of records_to_big_endian() against the per-word htonl()
+ * loop the readout used to run on every record. Build with:
+ *
+ *     gcc -O2 -DBYTEORDER_BENCH_MAIN byteorder.c -o byteorder-bench
+ *
+ * (add -mfpu=neon -mfloat-abi=softfp on the Zynq). */
+
+#define BENCH_RECORDS 1000
+#define BENCH_LOOPS 20000
+
+static long long bench_ustime(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return ((long long) tv.tv_sec)*1000000 + tv.tv_usec;
+}
+
+static void per_word(struct TubiiRecord *rec, int n)
+{
+    int i, j;
+
+    for (i = 0; i < n; i++) {
+        for (j = 0; j < sizeof(struct TubiiRecord)/4; j++) {
+            ((uint32_t *) &rec[i])[j] = htonl(((uint32_t *) &rec[i])[j]);
+        }
+    }
+}
+
+int main(void)
+{
+    static struct TubiiRecord a[BENCH_RECORDS], b[BENCH_RECORDS];
+    long long start, t_word, t_bulk;
+    int i;
+
+    for (i = 0; i < BENCH_RECORDS; i++) {
+        a[i].TrigWord = i*2654435761u;
+        a[i].GTID = i;
+    }
+    memcpy(b, a, sizeof(a));
+
+    per_word(a, BENCH_RECORDS);
+    records_to_big_endian(b, BENCH_RECORDS);
+    if (memcmp(a, b, sizeof(a))) {
+        printf("records_to_big_endian() doesn't match htonl()!\n");
+        return 1;
+    }
+
+    start = bench_ustime();
+    for (i = 0; i < BENCH_LOOPS; i++) {
+        per_word(a, BENCH_RECORDS);
+        __asm__ __volatile__("" : : "r" (a) : "memory");
+    }
+    t_word = bench_ustime() - start;
+
+    start = bench_ustime();
+    for (i = 0; i < BENCH_LOOPS; i++) {
+        records_to_big_endian(b, BENCH_RECORDS);
+        __asm__ __volatile__("" : : "r" (b) : "memory");
+    }
+    t_bulk = bench_ustime() - start;
+
+    printf("%d bundles of %d records\n", BENCH_LOOPS, BENCH_RECORDS);
+    printf("per word htonl:        %.2f ns/record\n",
+           t_word*1000.0/BENCH_LOOPS/BENCH_RECORDS);
+    printf("records_to_big_endian: %.2f ns/record\n",
+           t_bulk*1000.0/BENCH_LOOPS/BENCH_RECORDS);
+
+    return 0;
+}
+#endif
@@ -0,0 +1,8 @@
+#ifndef BYTEORDER_H
+#define BYTEORDER_H
+
+#include "record_info.h"
+
+void records_to_big_endian(struct TubiiRecord *rec, int n);
+
+#endif
@@ -125,6 +125,15 @@ void write_data_buffer(aeEventLoop *el, int fd, void *data, int mask)
     }
 }
 
+static void schedule_write()
+{
+    if (aeCreateFileEvent(el, data_stream->fd, AE_WRITABLE, write_data_buffer,
+                          data_stream) != AE_OK) {
+        Log(WARNING, "failed to create write event for data stream "
+                        "connection");
+    }
+}
+
 void write_to_data_stream(struct GenericRecordHeader *header, void *record)
 {
     /* Write `len` bytes from `buf` to the data stream connection buffer. */
@@ -136,10 +145,25 @@ void write_to_data_stream(struct GenericRecordHeader *header, void *record)
         Log(WARNING, "write to data stream: %s", sock_err);
     }
 
-    if (aeCreateFileEvent(el, data_stream->fd, AE_WRITABLE, write_data_buffer,
-                          data_stream) != AE_OK) {
-        Log(WARNING, "failed to create write event for data stream "
-                        "connection");
-    }
+    schedule_write();
 }
 
+void *data_stream_reserve(int len)
+{
+    /* Reserve room for a record of up to `len` bytes directly in the data
+     * stream buffer. Returns a pointer to write the record to, or NULL if
+     * we aren't connected or there is no contiguous room, in which case use
+     * write_to_data_stream() instead. Nothing else may be written to the data
+     * stream before the record is committed with data_stream_commit(). */
+    if (data_stream == NULL) return NULL;
+
+    return sock_reserve_record(data_stream, len);
+}
+
+void data_stream_commit(uint32_t type, int len)
+{
+    /* Send `len` bytes of the record reserved with data_stream_reserve(). */
+    sock_commit_record(data_stream, type, len);
+
+    schedule_write();
+}
@@ -7,5 +7,7 @@
 int data_connect(const char *ip);
 void write_data_buffer(aeEventLoop *el, int fd, void *data, int mask);
 void write_to_data_stream(struct GenericRecordHeader *header, void *record);
+void *data_stream_reserve(int len);
+void data_stream_commit(uint32_t type, int len);
 
 #endif
@@ -4,17 +4,36 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <arpa/inet.h>
 #include "logging.h"
 #include "db.h"
 #include "sds.h"
+#include "stats.h"
 
 #define DB_CHECK_QUEUE_DELAY 100
+/* default request timeout in milliseconds */
+#define DB_DEFAULT_TIMEOUT 1000
+/* initial size of the request ring buffer, it grows as needed */
+#define DB_REQUESTS_INITIAL 16
+
+/* With libpq's pipeline mode several requests are sent without waiting for
+ * the results of the ones before. Each one is followed by a sync point so
+ * an error in one request doesn't abort the ones queued behind it. Older
+ * libpq can only have one request in flight at a time. */
+#ifdef LIBPQ_HAS_PIPELINING
+#define DB_MAX_IN_FLIGHT 16
+#else
+#define DB_MAX_IN_FLIGHT 1
+#endif
 
 static void db_write(aeEventLoop *el, int fd, void *data, int mask);
 static void db_read(aeEventLoop *el, int fd, void *data, int mask);
 static int db_connect_event(aeEventLoop *el, long long id, void *data);
-static void pop_request(database *db);
-static void send_to_db(database *db, const char *command);
+static void db_send_requests(database *db);
+static void db_reset(database *db, int delay);
+static void db_prepare_statements(database *db);
+
+#define db_request(db, i) (&(db)->requests[((db)->head + (i)) % (db)->size])
 
 static void db_connect_poll(aeEventLoop *el, int fd, void *data, int mask)
 {
@@ -44,6 +63,13 @@ static void db_connect_poll(aeEventLoop *el, int fd, void *data, int mask)
             Log(WARNING, "PQsetnonblocking");
         }
 
+#ifdef LIBPQ_HAS_PIPELINING
+        if (PQenterPipelineMode(db->conn) != 1) {
+            Log(WARNING, "PQenterPipelineMode: %s", PQerrorMessage(db->conn));
+            goto err;
+        }
+#endif
+
         aeDeleteFileEvent(el, fd, AE_WRITABLE);
         aeDeleteFileEvent(el, fd, AE_READABLE);
 
@@ -53,6 +79,13 @@ static void db_connect_poll(aeEventLoop *el, int fd, void *data, int mask)
         }
 
         db->connected = 1;
+        db->fd = fd;
+
+        /* Prepared statements only last as long as the connection, so
+         * prepare them again before any other requests. */
+        db_prepare_statements(db);
+
+        if (db->on_connect) db->on_connect(db, db->on_connect_data);
 
         break;
     case PGRES_POLLING_FAILED:
@@ -78,45 +111,103 @@ err:
     }
 }
 
-static void db_get_result(database *db)
+static void db_free_request(dbRequest *req)
 {
-    PGresult *res, *last_result;
-
-    if (!db->request_list) {
-        Log(WARNING, "Got result from database, but no active request!");
-        return;
-    }
+    free(req->command);
+    free(req->params);
+    free(req->types);
+}
 
-    last_result = PQgetResult(db->conn);
+/* Hand the result of the oldest request to its callback and drop it from
+ * the queue. */
+static void db_finish_request(database *db)
+{
+    /* Take the request off the queue before calling the callback, since
+     * the callback may queue more requests or reset the connection. */
+    dbRequest req = *db_request(db, 0);
+    PGresult *res = db->result;
 
-    while ((res = PQgetResult(db->conn))) {
-        PQclear(last_result);
+    db->result = NULL;
+    db->head = (db->head + 1) % db->size;
+    db->count--;
+    db->sent--;
 
-        last_result = res;
-    }
+    hist_record(&stat_db_rtt, stat_time() - req.us_sent);
 
     /* Call the callback with the last result. */
-    if (db->request_list->callback) {
-        db->request_list->callback(last_result, db->conn, db->request_list->data);
+    if (req.callback) {
+        req.callback(res, db->conn, req.data);
     }
 
-    PQclear(last_result);
+    PQclear(res);
+    db_free_request(&req);
+}
+
+static void db_get_results(database *db)
+{
+    PGresult *res;
+
+    /* The results for each request end with a NULL, so read until the
+     * next result isn't here yet. */
+    while (db->sent && PQisBusy(db->conn) == 0) {
+        res = PQgetResult(db->conn);
+
+        if (res == NULL) {
+            db_finish_request(db);
+            continue;
+        }
+
+#ifdef LIBPQ_HAS_PIPELINING
+        if (PQresultStatus(res) == PGRES_PIPELINE_SYNC) {
+            PQclear(res);
+            continue;
+        }
+#endif
 
-    pop_request(db);
+        PQclear(db->result);
+        db->result = res;
+    }
 }
 
 static void clear_db_requests(database *db)
 {
     dbRequest *req;
 
-    while ((req = db->request_list)) {
+    PQclear(db->result);
+    db->result = NULL;
+
+    while (db->count) {
+        req = db_request(db, 0);
         /* Call request callbacks with NULL. */
         if (req->callback) {
             req->callback(NULL, db->conn, req->data);
         }
-        db->request_list = req->next;
-        free(req->command);
-        free(req);
+        db_free_request(req);
+        db->head = (db->head + 1) % db->size;
+        db->count--;
+    }
+
+    db->head = 0;
+    db->sent = 0;
+}
+
+/* Drop the connection, fail every request and try to connect again after
+ * delay milliseconds. */
+static void db_reset(database *db, int delay)
+{
+    db->connected = 0;
+    clear_db_requests(db);
+    PQfinish(db->conn);
+    db->conn = NULL;
+
+    if (db->fd >= 0) {
+        aeDeleteFileEvent(db->el, db->fd, AE_WRITABLE);
+        aeDeleteFileEvent(db->el, db->fd, AE_READABLE);
+        db->fd = -1;
+    }
+
+    if (aeCreateTimeEvent(db->el, delay, db_connect_event, db, NULL) == AE_ERR) {
+        Log(WARNING, "failed to create db connect event");
     }
 }
 
@@ -126,28 +217,15 @@ static void db_read(aeEventLoop *el, int fd, void *data, int mask)
 
     if (PQconsumeInput(db->conn) != 1) {
         Log(WARNING, "PQconsumeInput: %s", PQerrorMessage(db->conn));
-        goto err;
-    }
-
-    if (PQisBusy(db->conn) == 0) {
-        /* A result is ready. */
-        db_get_result(db);
+        /* Try to connect again in 10 seconds. */
+        db_reset(db, 10000);
+        return;
     }
 
-    return;
-
-err:
-    clear_db_requests(db);
-    PQfinish(db->conn);
-    db->conn = NULL;
-    db->connected = 0;
-    aeDeleteFileEvent(el, fd, AE_WRITABLE);
-    aeDeleteFileEvent(el, fd, AE_READABLE);
+    db_get_results(db);
 
-    /* Try to connect again in 10 seconds. */
-    if (aeCreateTimeEvent(el, 10000, db_connect_event, db, NULL) == AE_ERR) {
-        Log(WARNING, "failed to create db connect event");
-    }
+    /* Room in the pipeline for more. */
+    db_send_requests(db);
 }
 
 static void db_write(aeEventLoop *el, int fd, void *data, int mask)
@@ -162,78 +240,101 @@ static void db_write(aeEventLoop *el, int fd, void *data, int mask)
 
     if (PQstatus(db->conn) == CONNECTION_BAD) {
         Log(WARNING, "database connection disconnected");
-        goto err;
+        /* Try to connect again in 10 seconds. */
+        db_reset(db, 10000);
     }
+}
 
-    return;
+static int db_send_request(database *db, dbRequest *req)
+{
+    const char *values[DB_MAX_PARAMS];
+    int lengths[DB_MAX_PARAMS];
+    int formats[DB_MAX_PARAMS];
+    dbStatement *stmt = req->stmt;
+    int i, ok;
+
+    switch (req->type) {
+    case DB_PREPARE:
+        ok = PQsendPrepare(db->conn, stmt->name, stmt->command,
+                           stmt->nparams, stmt->types);
+        break;
+    case DB_QUERY_PARAMS:
+    case DB_QUERY_PREPARED:
+        for (i = 0; i < req->nparams; i++) {
+            values[i] = (const char *) &req->params[i];
+            lengths[i] = sizeof(uint32_t);
+            formats[i] = 1;
+        }
+        if (req->type == DB_QUERY_PARAMS) {
+            ok = PQsendQueryParams(db->conn, req->command, req->nparams, req->types,
+                                   values, lengths, formats, 0);
+        } else {
+            ok = PQsendQueryPrepared(db->conn, stmt->name, req->nparams,
+                                     values, lengths, formats, 0);
+        }
+        break;
+    default:
+#ifdef LIBPQ_HAS_PIPELINING
+        /* Pipeline mode only speaks the extended query protocol. */
+        ok = PQsendQueryParams(db->conn, req->command, 0, NULL, NULL, NULL, NULL, 0);
+#else
+        ok = PQsendQuery(db->conn, req->command);
+#endif
+    }
 
-err:
-    clear_db_requests(db);
-    PQfinish(db->conn);
-    db->conn = NULL;
-    db->connected = 0;
-    aeDeleteFileEvent(el, fd, AE_WRITABLE);
-    aeDeleteFileEvent(el, fd, AE_READABLE);
+#ifdef LIBPQ_HAS_PIPELINING
+    if (ok) ok = PQpipelineSync(db->conn);
+#endif
 
-    /* Try to connect again in 10 seconds. */
-    if (aeCreateTimeEvent(el, 10000, db_connect_event, db, NULL) == AE_ERR) {
-        Log(WARNING, "failed to create db connect event");
-    }
+    return ok;
 }
 
-static void pop_request(database *db)
+/* Send queued requests until DB_MAX_IN_FLIGHT are waiting for results. The
+ * time each one is actually sent is what its timeout counts from. */
+static void db_send_requests(database *db)
 {
-    /* Pop a request off the head of the linked list,
-     * and send the next request. */
+    dbRequest *req;
+    int sent = db->sent;
 
-    if (db->request_list == NULL) {
-        Log(WARNING, "attempt to pop NULL request");
-        return;
-    }
+    while (db->connected && db->sent < db->count && db->sent < DB_MAX_IN_FLIGHT) {
+        req = db_request(db, db->sent);
 
-    dbRequest *req = db->request_list;
+        if (!db_send_request(db, req)) {
+            Log(WARNING, "failed to send database query: %s", PQerrorMessage(db->conn));
+            db_reset(db, 10000);
+            return;
+        }
 
-    if (req->next) {
-        db->request_list = req->next;
+        req->us_sent = stat_time();
+        db->sent++;
+    }
 
-        time(&db->request_list->time_sent);
+    if (db->sent == sent) return;
 
-        send_to_db(db, db->request_list->command);
-    } else {
-        db->request_list = NULL;
+    if (aeCreateFileEvent(db->el, db->fd, AE_WRITABLE, db_write, db) == AE_ERR) {
+        Log(WARNING, "failed to create database write event.");
+        /* Try to connect again in 10 seconds. */
+        db_reset(db, 10000);
     }
-    free(req->command);
-    free(req);
 }
 
 static int db_check_queue(struct aeEventLoop *el, long long id, void *data)
 {
-    time_t now = time(NULL);
+    long long now = stat_time();
     database *db = (database *) data;
+    int i;
+
+    for (i = 0; i < db->sent; i++) {
+        dbRequest *req = db_request(db, i);
 
-    if (db->request_list) {
-        if (now > db->request_list->time_sent + db->request_list->timeout) {
+        if (now > req->us_sent + req->timeout) {
             Log(WARNING, "database query timed out");
 
             /* Since the only way to match up queries with responses is the
              * order they come in, we basically have to disconnect here and
-             * then reconnect. */
-            int fd = PQsocket(db->conn);
-
-            clear_db_requests(db);
-            PQfinish(db->conn);
-            db->conn = NULL;
-            db->connected = 0;
-
-            if (fd > 0) {
-                aeDeleteFileEvent(el, fd, AE_WRITABLE);
-                aeDeleteFileEvent(el, fd, AE_READABLE);
-            }
-
-            /* Try to connect again immediately. */
-            if (aeCreateTimeEvent(el, 0, db_connect_event, db, NULL) == AE_ERR) {
-                Log(WARNING, "failed to create db connect event");
-            }
+             * then reconnect immediately. */
+            db_reset(db, 0);
+            break;
         }
     }
 
@@ -242,39 +343,69 @@ static int db_check_queue(struct aeEventLoop *el, long long id, void *data)
 
 void clear_db_requests_from_client(database *db, void *c)
 {
-    /* Clear all requests whose data pointer points to c. */
-    dbRequest *req, *last, *next;
-
-    req = db->request_list;
+    /* Clear all requests whose data pointer points to c. Requests which
+     * have already been sent have to stay so the results still line up,
+     * so for those just set request->data = NULL. */
+    dbRequest *req;
+    int i, n = db->sent;
 
-    /* Delete requests from this client, except for the current request.
-     * If the current request is from this client,
-     * set request->client = NULL. */
-    if (req) {
+    for (i = 0; i < db->sent; i++) {
+        req = db_request(db, i);
         if (req->data == c) req->data = NULL;
+    }
 
-        last = req;
+    for (i = db->sent; i < db->count; i++) {
+        req = db_request(db, i);
 
-        req = req->next;
+        if (req->data == c) {
+            db_free_request(req);
+        } else {
+            *db_request(db, n++) = *req;
+        }
+    }
 
-        while (req) {
-            next = req->next;
+    db->count = n;
+}
 
-            if (req->data == c) {
-                last->next = req->next;
+int db_exec_async(database *db, const char *command, dbCallback *callback, void *data)
+{
+    return db_exec_async_timeout(db, command, callback, data, DB_DEFAULT_TIMEOUT);
+}
 
-                free(req->command);
-                free(req);
-            } else {
-                last = req;
-            }
+/* Add a request to the end of the queue and return it. */
+static dbRequest *db_queue_request(database *db, dbCallback *callback, void *data, int timeout)
+{
+    dbRequest *req;
 
-            req = next;
-        }
+    if (db->count == db->size) {
+        /* Grow the ring, unwrapping it so the oldest request is first. */
+        dbRequest *requests = malloc(sizeof(dbRequest)*db->size*2);
+        int i;
+
+        for (i = 0; i < db->count; i++)
+            requests[i] = *db_request(db, i);
+        free(db->requests);
+        db->requests = requests;
+        db->head = 0;
+        db->size *= 2;
     }
+
+    req = db_request(db, db->count++);
+    req->type = DB_QUERY;
+    req->command = NULL;
+    req->stmt = NULL;
+    req->nparams = 0;
+    req->params = NULL;
+    req->types = NULL;
+    req->callback = callback;
+    req->data = data;
+    req->timeout = (long long) timeout*1000;
+    req->us_sent = 0;
+
+    return req;
 }
 
-int db_exec_async(database *db, const char *command, dbCallback *callback, void *data)
+int db_exec_async_timeout(database *db, const char *command, dbCallback *callback, void *data, int timeout)
 {
     /* Function to asynchronously execute a query to the database. The function
      * signature for callback should be:
@@ -282,62 +413,142 @@ int db_exec_async(database *db, const char *command, dbCallback *callback, void
      *     void callback_function(PGresult *res, PGconn *conn, void *data);
      *
      * and will be called with the result when the query is completed. If there
-     * was a problem, it will be called with res = NULL.
-     * 
+     * was a problem, or there's no result within timeout milliseconds of the
+     * query being sent, it will be called with res = NULL.
+     *
      * Returns 0 on success or -1 if the database is not connected. */
-	if (db->connected == 0) return -1;
+    dbRequest *req;
 
-    dbRequest *req = (dbRequest *) malloc(sizeof(dbRequest));
-    req->command = (char *) malloc(strlen(command)+1);
-    strcpy(req->command, command);
-    req->callback = callback;
-    req->next = NULL;
-    req->data = data;
-    req->timeout = 1;
-
-    if (db->request_list == NULL) {
-        /* There are no active database requests, so just go ahead
-         * and send the request. */
-        db->request_list = req;
-        /* send request */
-        time(&req->time_sent);
-
-        send_to_db(db, req->command);
-    } else {
-    	dbRequest *tail = db->request_list;
-        /* Request goes on the end of the queue. */
-        while (tail->next != NULL) tail = tail->next;
-        tail->next = req;
-    }
+    if (db->connected == 0) return -1;
+
+    /* Request goes on the end of the queue. */
+    req = db_queue_request(db, callback, data, timeout);
+    req->command = strdup(command);
+
+    db_send_requests(db);
 
     return 0;
 }
 
-static void send_to_db(database *db, const char *command)
+/* Copy parameters into a request in network byte order. */
+static void db_set_params(dbRequest *req, int nparams, const dbParam *params)
 {
-    PQsendQuery(db->conn, command);
+    int i;
 
-    int sock = PQsocket(db->conn);
+    req->nparams = nparams;
+    req->params = malloc(sizeof(uint32_t)*(nparams ? nparams : 1));
+    for (i = 0; i < nparams; i++)
+        req->params[i] = htonl(params[i].u);
+}
 
-    if (aeCreateFileEvent(db->el, sock, AE_WRITABLE, db_write, db) == AE_ERR) {
-        Log(WARNING, "failed to create database write event.");
-        goto err;
+int db_exec_params_async(database *db, const char *command, int nparams, const Oid *types, const dbParam *params, dbCallback *callback, void *data)
+{
+    /* Execute a single statement with nparams parameters $1, $2, ... of the
+     * given types, which must be DB_INT4 or DB_FLOAT4. For statements run
+     * often use db_prepare() instead. The callback is called the same way as
+     * for db_exec_async().
+     *
+     * Returns 0 on success or -1 if the database is not connected or there
+     * are too many parameters. */
+    dbRequest *req;
+
+    if (db->connected == 0 || nparams > DB_MAX_PARAMS) return -1;
+
+    req = db_queue_request(db, callback, data, DB_DEFAULT_TIMEOUT);
+    req->type = DB_QUERY_PARAMS;
+    req->command = strdup(command);
+    db_set_params(req, nparams, params);
+    req->types = malloc(sizeof(Oid)*(nparams ? nparams : 1));
+    memcpy(req->types, types, sizeof(Oid)*nparams);
+
+    db_send_requests(db);
+
+    return 0;
+}
+
+int db_exec_prepared_async(database *db, dbStatement *stmt, const dbParam *params, dbCallback *callback, void *data)
+{
+    /* Execute a statement from db_prepare() with stmt->nparams parameters.
+     * The callback is called the same way as for db_exec_async().
+     *
+     * Returns 0 on success or -1 if the database is not connected. */
+    dbRequest *req;
+
+    if (db->connected == 0) return -1;
+
+    req = db_queue_request(db, callback, data, DB_DEFAULT_TIMEOUT);
+    req->type = DB_QUERY_PREPARED;
+    req->stmt = stmt;
+    db_set_params(req, stmt->nparams, params);
+
+    db_send_requests(db);
+
+    return 0;
+}
+
+static void db_prepare_callback(PGresult *res, PGconn *conn, void *data)
+{
+    dbStatement *stmt = (dbStatement *) data;
+
+    if (res == NULL) {
+        Log(WARNING, "failed to prepare statement %s: request timed out or database disconnected", stmt->name);
+    } else if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+        Log(WARNING, "failed to prepare statement %s: %s", stmt->name, PQresultErrorMessage(res));
     }
+}
 
-    return;
+static void db_queue_prepare(database *db, dbStatement *stmt)
+{
+    dbRequest *req = db_queue_request(db, db_prepare_callback, stmt, DB_DEFAULT_TIMEOUT);
 
-err:
-    clear_db_requests(db);
-    PQfinish(db->conn);
-    db->conn = NULL;
-    db->connected = 0;
-    aeDeleteFileEvent(db->el, sock, AE_WRITABLE);
-    aeDeleteFileEvent(db->el, sock, AE_READABLE);
+    req->type = DB_PREPARE;
+    req->stmt = stmt;
+}
 
-    /* Try to connect again in 10 seconds. */
-    if (aeCreateTimeEvent(db->el, 10000, db_connect_event, db, NULL) == AE_ERR) {
-        Log(WARNING, "failed to create db connect event");
+static void db_prepare_statements(database *db)
+{
+    dbStatement *stmt;
+
+    for (stmt = db->statements; stmt; stmt = stmt->next)
+        db_queue_prepare(db, stmt);
+
+    db_send_requests(db);
+}
+
+void db_on_connect(database *db, dbConnectCallback *callback, void *data)
+{
+    /* Set a function to be called every time we connect to the database.
+     * Requests it queues go ahead of any others. */
+    db->on_connect = callback;
+    db->on_connect_data = data;
+}
+
+dbStatement *db_prepare(database *db, const char *name, const char *command, int nparams, const Oid *types)
+{
+    /* Register a statement which is prepared now if we're connected, and
+     * again every time we reconnect. The parameter types must be DB_INT4
+     * or DB_FLOAT4. Returns NULL if there are too many parameters. */
+    dbStatement *stmt;
+
+    if (nparams > DB_MAX_PARAMS) {
+        Log(WARNING, "statement %s has more than %i parameters", name, DB_MAX_PARAMS);
+        return NULL;
     }
+
+    stmt = malloc(sizeof(dbStatement));
+    stmt->name = strdup(name);
+    stmt->command = strdup(command);
+    stmt->nparams = nparams;
+    memcpy(stmt->types, types, sizeof(Oid)*nparams);
+    stmt->next = db->statements;
+    db->statements = stmt;
+
+    if (db->connected) {
+        db_queue_prepare(db, stmt);
+        db_send_requests(db);
+    }
+
+    return stmt;
 }
 
 static int db_connect_event(aeEventLoop *el, long long id, void *data)
@@ -402,6 +613,15 @@ void free_database(database *db)
     sdsfree(db->name);
     sdsfree(db->user);
     sdsfree(db->pass);
+    free(db->requests);
+
+    while (db->statements) {
+        dbStatement *stmt = db->statements;
+        db->statements = stmt->next;
+        free(stmt->name);
+        free(stmt->command);
+        free(stmt);
+    }
 
     if (db->check_queue_id != AE_DELETED_EVENT_ID) {
         aeDeleteTimeEvent(db->el, db->check_queue_id);
@@ -430,8 +650,17 @@ database *db_connect(aeEventLoop *el, const char *host, const char *name, const
     db->user = sdsnew(user);
     db->pass = sdsnew(pass);
     db->conn = NULL;
-    db->request_list = NULL;
+    db->requests = malloc(sizeof(dbRequest)*DB_REQUESTS_INITIAL);
+    db->head = 0;
+    db->count = 0;
+    db->sent = 0;
+    db->size = DB_REQUESTS_INITIAL;
+    db->result = NULL;
+    db->statements = NULL;
+    db->on_connect = NULL;
+    db->on_connect_data = NULL;
     db->connected = 0;
+    db->fd = -1;
     db->check_queue_id = AE_DELETED_EVENT_ID;
 
     if (aeCreateTimeEvent(el, 0, db_connect_event, db, NULL) == AE_ERR) {
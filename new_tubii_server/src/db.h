@@ -3,6 +3,7 @@
 
 #include <libpq-fe.h>
 #include <time.h>
+#include <stdint.h>
 #include "sds.h"
 #include "ae.h"
 
@@ -19,18 +20,63 @@
  * Then the callback will be called *only* with the result of the second
  * statement.
  *
- * See http://postgresql.nabble.com/libpq-PQsendQuery-wait-for-complete-result-td5734111.html#a5734321. for more details. */
+ * See http://postgresql.nabble.com/libpq-PQsendQuery-wait-for-complete-result-td5734111.html#a5734321. for more details.
+ *
+ * When libpq supports pipeline mode, queries are sent with the extended
+ * query protocol which only allows a single statement per query. */
 typedef void dbCallback(PGresult *res, PGconn *conn, void *data);
 
+/* Type OIDs from pg_type for statement parameters. Parameters are always
+ * sent in binary, and only 4 byte types are supported. */
+#define DB_INT4 23
+#define DB_FLOAT4 700
+
+#define DB_MAX_PARAMS 64
+
+/* A single parameter for a prepared statement. */
+typedef union dbParam {
+    uint32_t u;
+    int32_t i;
+    float f;
+} dbParam;
+
+/* A statement prepared on every connection to the database. */
+typedef struct dbStatement {
+    char *name;
+    char *command;
+    int nparams;
+    Oid types[DB_MAX_PARAMS];
+    struct dbStatement *next;
+} dbStatement;
+
+enum {
+    DB_QUERY,
+    DB_QUERY_PARAMS,
+    DB_PREPARE,
+    DB_QUERY_PREPARED
+};
+
 typedef struct dbRequest {
+    int type;
     char *command;
-    time_t time_sent;
-    int timeout;
+    dbStatement *stmt;
+    /* parameters in network byte order for DB_QUERY_PARAMS and
+     * DB_QUERY_PREPARED, and their types for DB_QUERY_PARAMS */
+    int nparams;
+    uint32_t *params;
+    Oid *types;
+    long long us_sent;  /* stat_time() when the query was sent */
+    long long timeout;  /* microseconds after being sent */
     dbCallback *callback;
     void *data;
-    struct dbRequest *next;
 } dbRequest;
 
+struct database;
+
+/* Function signature for the callback called each time the connection to
+ * the database comes up, after the prepared statements are queued. */
+typedef void dbConnectCallback(struct database *db, void *data);
+
 typedef struct database {
     aeEventLoop *el;
 
@@ -43,12 +89,35 @@ typedef struct database {
     long long check_queue_id;
 
     int connected;
+    /* socket the read and write events are on. libpq may already have
+     * closed it by the time we notice the connection is gone. */
+    int fd;
+
+    /* Requests are kept in a ring buffer, oldest first. The first `sent` of
+     * them have been sent and are waiting for their results, which come
+     * back in the same order. */
+    dbRequest *requests;
+    int head;
+    int count;
+    int sent;
+    int size;
+    /* last result so far of the oldest request */
+    PGresult *result;
+
+    /* statements to prepare whenever we connect */
+    dbStatement *statements;
 
-    dbRequest *request_list;
+    dbConnectCallback *on_connect;
+    void *on_connect_data;
 } database;
 
 database *db_connect(aeEventLoop *el, const char *host, const char *name, const char *user, const char *pass);
 int db_exec_async(database *db, const char *command, dbCallback *callback, void *data);
+int db_exec_async_timeout(database *db, const char *command, dbCallback *callback, void *data, int timeout);
+dbStatement *db_prepare(database *db, const char *name, const char *command, int nparams, const Oid *types);
+int db_exec_params_async(database *db, const char *command, int nparams, const Oid *types, const dbParam *params, dbCallback *callback, void *data);
+int db_exec_prepared_async(database *db, dbStatement *stmt, const dbParam *params, dbCallback *callback, void *data);
+void db_on_connect(database *db, dbConnectCallback *callback, void *data);
 void clear_db_requests_from_client(database *db, void *c);
 
 #endif
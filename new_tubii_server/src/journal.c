@@ -0,0 +1,276 @@
+/* Append-only journal, see journal.h.
+ *
+ * Each record is a header followed by its data. The header holds a magic
+ * number, the record type and length and a checksum of all three, so a
+ * record which was only partly written when the power went is found and
+ * thrown away the next time the journal is opened. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <libgen.h>
+#include "journal.h"
+#include "logging.h"
+#include "sds.h"
+
+#define JOURNAL_MAGIC 0x4a524e4c /* "JRNL" */
+
+typedef struct journalHeader {
+    uint32_t magic;
+    uint32_t type;
+    uint32_t len;
+    uint32_t sum;
+} journalHeader;
+
+static uint32_t journal_sum(uint32_t type, const void *data, uint32_t len)
+{
+    /* FNV-1a over the type, length and data */
+    const unsigned char *p;
+    uint32_t h = 2166136261u;
+    uint32_t i;
+
+    p = (const unsigned char *) &type;
+    for (i = 0; i < sizeof(type); i++) h = (h ^ p[i])*16777619u;
+    p = (const unsigned char *) &len;
+    for (i = 0; i < sizeof(len); i++) h = (h ^ p[i])*16777619u;
+    p = (const unsigned char *) data;
+    for (i = 0; i < len; i++) h = (h ^ p[i])*16777619u;
+
+    return h;
+}
+
+static long journal_scan(int fd, journalProc *proc, void *privdata)
+{
+    /* Read records from the start of the file, calling proc for each one if
+     * it isn't NULL. Returns the offset just past the last good record. */
+    journalHeader h;
+    char *data = NULL;
+    long offset = 0;
+
+    while (pread(fd, &h, sizeof(h), offset) == sizeof(h)) {
+        if (h.magic != JOURNAL_MAGIC || h.len > JOURNAL_MAX_RECORD) break;
+
+        data = realloc(data, h.len ? h.len : 1);
+        if (pread(fd, data, h.len, offset + sizeof(h)) != h.len) break;
+        if (journal_sum(h.type, data, h.len) != h.sum) break;
+
+        offset += sizeof(h) + h.len;
+
+        if (proc) proc(h.type, data, h.len, offset, privdata);
+    }
+
+    free(data);
+
+    return offset;
+}
+
+static int journal_sync_dir(const char *path)
+{
+    /* fsync the directory holding path, so a rename into it survives a power
+     * cut. */
+    char *copy = strdup(path);
+    int fd, ret = 0;
+
+    fd = open(dirname(copy), O_RDONLY | O_DIRECTORY);
+
+    if (fd < 0 || fsync(fd)) ret = -1;
+
+    if (fd >= 0) close(fd);
+    free(copy);
+
+    return ret;
+}
+
+journal *journal_open(aeEventLoop *el, const char *path)
+{
+    /* Open the journal at path, creating it if it doesn't exist. Returns
+     * NULL on error. */
+    struct stat st;
+    long end;
+    journal *j;
+    int fd;
+
+    fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0644);
+
+    if (fd < 0) {
+        Log(WARNING, "failed to open journal %s: %s", path, strerror(errno));
+        return NULL;
+    }
+
+    /* Drop anything after the last good record so new records aren't
+     * appended behind it where they can't be read. */
+    end = journal_scan(fd, NULL, NULL);
+
+    if (fstat(fd, &st) == 0 && st.st_size > end) {
+        Log(WARNING, "journal %s: dropping %li bytes after the last good record",
+            path, (long) st.st_size - end);
+        if (ftruncate(fd, end) || fsync(fd)) {
+            Log(WARNING, "failed to truncate journal %s: %s", path, strerror(errno));
+            close(fd);
+            return NULL;
+        }
+    }
+
+    j = malloc(sizeof(journal));
+    j->path = strdup(path);
+    j->fd = fd;
+    j->el = el;
+    j->sync_id = -1;
+
+    return j;
+}
+
+static int journal_sync(aeEventLoop *el, long long id, void *data)
+{
+    journal *j = (journal *) data;
+
+    if (fsync(j->fd)) {
+        Log(WARNING, "failed to sync journal %s: %s", j->path, strerror(errno));
+    }
+
+    j->sync_id = -1;
+
+    return AE_NOMORE;
+}
+
+void journal_close(journal *j)
+{
+    if (j->sync_id != -1) {
+        aeDeleteTimeEvent(j->el, j->sync_id);
+        journal_sync(j->el, j->sync_id, j);
+    }
+
+    close(j->fd);
+    free(j->path);
+    free(j);
+}
+
+int journal_append(journal *j, uint32_t type, const void *data, uint32_t len)
+{
+    /* Append a record to the journal. It is fsync'd within
+     * JOURNAL_SYNC_DELAY ms. Returns 0 on success, -1 on error. */
+    journalHeader h;
+    struct iovec iov[2];
+    struct stat st;
+    ssize_t n;
+
+    if (len > JOURNAL_MAX_RECORD) {
+        Log(WARNING, "journal record of %u bytes is too large", len);
+        return -1;
+    }
+
+    if (fstat(j->fd, &st)) {
+        Log(WARNING, "failed to stat journal %s: %s", j->path, strerror(errno));
+        return -1;
+    }
+
+    h.magic = JOURNAL_MAGIC;
+    h.type = type;
+    h.len = len;
+    h.sum = journal_sum(type, data, len);
+
+    iov[0].iov_base = &h;
+    iov[0].iov_len = sizeof(h);
+    iov[1].iov_base = (void *) data;
+    iov[1].iov_len = len;
+
+    n = writev(j->fd, iov, 2);
+
+    if (n != (ssize_t) (sizeof(h) + len)) {
+        Log(WARNING, "failed to write to journal %s: %s", j->path,
+            n < 0 ? strerror(errno) : "short write");
+        /* Don't leave half a record behind. */
+        if (n > 0 && ftruncate(j->fd, st.st_size)) {
+            Log(WARNING, "failed to truncate journal %s: %s", j->path, strerror(errno));
+        }
+        return -1;
+    }
+
+    if (j->sync_id == -1) {
+        j->sync_id = aeCreateTimeEvent(j->el, JOURNAL_SYNC_DELAY, journal_sync, j, NULL);
+
+        if (j->sync_id == AE_ERR) {
+            /* Sync now instead. */
+            j->sync_id = -1;
+            journal_sync(j->el, -1, j);
+        }
+    }
+
+    return 0;
+}
+
+long journal_read(journal *j, journalProc *proc, void *privdata)
+{
+    /* Call proc for every record in the journal. Returns the offset after
+     * the last record, which can be passed to journal_consume() once the
+     * records are dealt with. */
+    return journal_scan(j->fd, proc, privdata);
+}
+
+int journal_consume(journal *j, long offset)
+{
+    /* Remove the first offset bytes of records from the journal, keeping
+     * any which were appended after it was read. Returns 0 on success, -1 on
+     * error. */
+    struct stat st;
+    char *tail;
+    sds tmp;
+    long len;
+    int fd;
+
+    if (fstat(j->fd, &st)) {
+        Log(WARNING, "failed to stat journal %s: %s", j->path, strerror(errno));
+        return -1;
+    }
+
+    if (offset >= st.st_size) {
+        if (ftruncate(j->fd, 0) || fsync(j->fd)) {
+            Log(WARNING, "failed to truncate journal %s: %s", j->path, strerror(errno));
+            return -1;
+        }
+        return 0;
+    }
+
+    /* Copy the records after offset to a new file and move it over the
+     * journal. */
+    len = st.st_size - offset;
+    tail = malloc(len);
+
+    if (pread(j->fd, tail, len, offset) != len) {
+        Log(WARNING, "failed to read journal %s: %s", j->path, strerror(errno));
+        free(tail);
+        return -1;
+    }
+
+    tmp = sdscatprintf(sdsempty(), "%s.tmp", j->path);
+    fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC | O_APPEND, 0644);
+
+    if (fd < 0 || write(fd, tail, len) != len || fsync(fd) || rename(tmp, j->path)) {
+        Log(WARNING, "failed to rewrite journal %s: %s", j->path, strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+            unlink(tmp);
+        }
+        free(tail);
+        sdsfree(tmp);
+        return -1;
+    }
+
+    close(j->fd);
+    j->fd = fd;
+
+    if (journal_sync_dir(j->path)) {
+        Log(WARNING, "failed to sync the directory of journal %s: %s", j->path,
+            strerror(errno));
+    }
+
+    free(tail);
+    sdsfree(tmp);
+
+    return 0;
+}
@@ -0,0 +1,36 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdint.h>
+#include "ae.h"
+
+/* An append-only file of records, for holding on to things which should go
+ * to the database while it can't be reached. Records are written straight
+ * away, but only fsync'd JOURNAL_SYNC_DELAY ms after the first one which
+ * isn't on disk yet, so a burst of appends costs a single fsync. */
+
+#define JOURNAL_SYNC_DELAY 100
+
+/* largest record journal_append() will write */
+#define JOURNAL_MAX_RECORD 65536
+
+typedef struct journal {
+    char *path;
+    int fd;
+    aeEventLoop *el;
+    /* time event for the pending fsync, or -1 */
+    long long sync_id;
+} journal;
+
+/* Called by journal_read() for each record in the order they were
+ * appended. `end` is the offset just past the record, which can be passed to
+ * journal_consume() to remove it and everything before it. */
+typedef void journalProc(uint32_t type, const void *data, uint32_t len, long end, void *privdata);
+
+journal *journal_open(aeEventLoop *el, const char *path);
+void journal_close(journal *j);
+int journal_append(journal *j, uint32_t type, const void *data, uint32_t len);
+long journal_read(journal *j, journalProc *proc, void *privdata);
+int journal_consume(journal *j, long offset);
+
+#endif
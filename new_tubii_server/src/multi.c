@@ -0,0 +1,222 @@
+/* MULTI/EXEC batches, after the Redis transactions.
+ *
+ * Commands sent after MULTI are checked and queued rather than run. Each
+ * argument is checked against the command's argument types, a string with
+ * one character per argument:
+ *
+ *     'u'  unsigned integer (decimal, hex or octal like safe_strtoul())
+ *     'f'  floating point number
+ *     's'  anything
+ *
+ * A leading '!' means the command can't be queued at all, e.g. commands
+ * which block the client waiting on the database. Once the types are right
+ * the command's check function, if it has one, checks the values (ranges,
+ * masks which mustn't overlap, ...). Any error while queueing makes EXEC
+ * throw the whole batch away, so a bad argument in the middle of a run
+ * configuration means nothing is applied.
+ *
+ * EXEC runs the queued commands back to back and collects their replies
+ * into a single multi bulk reply. The exec_begin and exec_end hooks let the
+ * application hold back slow work (the shift registers) until the whole
+ * batch has been run and then do it once. If a command still fails when it
+ * runs, the commands after it aren't run and get an error reply instead,
+ * and exec_end is told so it can throw away the held back work. Whatever
+ * the commands before it wrote straight to the hardware stays written. */
+
+#include "server.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+void initClientMultiState(client *c) {
+    c->mstate.commands = NULL;
+    c->mstate.count = 0;
+    c->mstate.reply = NULL;
+}
+
+void freeClientMultiState(client *c) {
+    int j;
+
+    for (j = 0; j < c->mstate.count; j++) {
+        int i;
+        multiCmd *mc = c->mstate.commands+j;
+
+        for (i = 0; i < mc->argc; i++)
+            sdsfree(mc->argv[i]);
+        free(mc->argv);
+    }
+    free(c->mstate.commands);
+    sdsfree(c->mstate.reply);
+}
+
+/* Returns the index of the first argument which doesn't match the argument
+ * types of the command, or 0 if they all do. */
+static int checkCommandArgs(client *c) {
+    char *t = c->cmd->args;
+    char *end;
+    int j;
+
+    if (t == NULL) return 0;
+    if (*t == '!') t++;
+
+    for (j = 1; j < c->argc && *t; j++, t++) {
+        char *s = c->argv[j];
+
+        errno = 0;
+        switch (*t) {
+        case 'u':
+            strtoul(s, &end, 0);
+            break;
+        case 'f':
+            strtod(s, &end);
+            break;
+        default:
+            continue;
+        }
+
+        if (end == s || *end != '\0' || errno == ERANGE) return j;
+    }
+
+    return 0;
+}
+
+/* Add a new command into the MULTI commands queue */
+void queueMultiCommand(client *c) {
+    multiCmd *mc;
+    const char *err;
+    int j;
+
+    if (c->cmd->args && c->cmd->args[0] == '!') {
+        addReplyErrorFormat(c,"'%s' can't be used inside MULTI",
+            c->cmd->name);
+        flagTransaction(c);
+        return;
+    }
+
+    if ((j = checkCommandArgs(c))) {
+        addReplyErrorFormat(c,"invalid argument %d '%s' for '%s'",
+            j, (char*)c->argv[j], c->cmd->name);
+        flagTransaction(c);
+        return;
+    }
+
+    if (c->cmd->check && (err = c->cmd->check(c->argc,c->argv))) {
+        addReplyErrorFormat(c,"invalid arguments for '%s': %s",
+            c->cmd->name, err);
+        flagTransaction(c);
+        return;
+    }
+
+    c->mstate.commands = realloc(c->mstate.commands,
+            sizeof(multiCmd)*(c->mstate.count+1));
+    mc = c->mstate.commands+c->mstate.count;
+    mc->cmd = c->cmd;
+    mc->argc = c->argc;
+    mc->argv = malloc(sizeof(sds)*c->argc);
+    for (j = 0; j < c->argc; j++)
+        mc->argv[j] = sdsdup(c->argv[j]);
+    c->mstate.count++;
+
+    addReplyStatus(c,"QUEUED");
+}
+
+void discardTransaction(client *c) {
+    freeClientMultiState(c);
+    initClientMultiState(c);
+    c->flags &= ~(CLIENT_MULTI|CLIENT_DIRTY_EXEC);
+}
+
+/* Flag the transaction as DIRTY_EXEC so that EXEC will fail.
+ * Should be called every time there is an error while queueing a command. */
+void flagTransaction(client *c) {
+    if (c->flags & CLIENT_MULTI)
+        c->flags |= CLIENT_DIRTY_EXEC;
+}
+
+void multiCommand(client *c, int argc, sds *argv) {
+    if (c->flags & CLIENT_MULTI) {
+        addReplyError(c,"MULTI calls can not be nested");
+        return;
+    }
+    c->flags |= CLIENT_MULTI;
+    addReplyStatus(c,"OK");
+}
+
+void discardCommand(client *c, int argc, sds *argv) {
+    if (!(c->flags & CLIENT_MULTI)) {
+        addReplyError(c,"DISCARD without MULTI");
+        return;
+    }
+    discardTransaction(c);
+    addReplyStatus(c,"OK");
+}
+
+/* Send the reply collected by EXEC. Called straight from execCommand(), or
+ * by the exec_end hook once it has finished applying the batch. */
+void execReply(client *c) {
+    sds reply = c->mstate.reply;
+
+    c->mstate.reply = NULL;
+    if (reply == NULL) return;
+    addReplyString(c,reply,sdslen(reply));
+    sdsfree(reply);
+}
+
+void execCommand(client *c, int argc, sds *argv) {
+    int j, failed = 0;
+    size_t pos;
+    sds *orig_argv;
+    int orig_argc;
+    struct command *orig_cmd;
+
+    if (!(c->flags & CLIENT_MULTI)) {
+        addReplyError(c,"EXEC without MULTI");
+        return;
+    }
+
+    /* Don't apply half a configuration if something failed to queue. */
+    if (c->flags & CLIENT_DIRTY_EXEC) {
+        addReplyError(c,"EXECABORT Transaction discarded because of previous "
+                        "errors.");
+        discardTransaction(c);
+        return;
+    }
+
+    /* Run the queued commands, collecting their replies instead of sending
+     * them. */
+    orig_argv = c->argv;
+    orig_argc = c->argc;
+    orig_cmd = c->cmd;
+    c->capture = sdsempty();
+    c->flags |= CLIENT_IN_EXEC;
+    if (server.exec_begin) server.exec_begin(c);
+
+    for (j = 0; j < c->mstate.count; j++) {
+        if (failed) {
+            addReplyErrorFormat(c,"not run because command %d failed",
+                failed);
+            continue;
+        }
+        c->argc = c->mstate.commands[j].argc;
+        c->argv = c->mstate.commands[j].argv;
+        c->cmd = c->mstate.commands[j].cmd;
+        pos = sdslen(c->capture);
+        call(c);
+        if (sdslen(c->capture) > pos && c->capture[pos] == '-') failed = j+1;
+    }
+    c->argv = orig_argv;
+    c->argc = orig_argc;
+    c->cmd = orig_cmd;
+    c->flags &= ~CLIENT_IN_EXEC;
+
+    sds reply = sdscatprintf(sdsempty(),"*%d\r\n",c->mstate.count);
+    reply = sdscatsds(reply,c->capture);
+    sdsfree(c->capture);
+    c->capture = NULL;
+
+    discardTransaction(c);
+    c->mstate.reply = reply;
+
+    if (server.exec_end && server.exec_end(c,failed != 0)) return;
+    execReply(c);
+}
@@ -5,6 +5,7 @@
 #include <string.h>
 #include "logging.h"
 #include "util.h"
+#include "stats.h"
 #include <errno.h>
 
 static void setProtocolError(client *c, int pos);
@@ -28,6 +29,8 @@ client *createClient(int fd) {
     c->fd = fd;
     c->name = NULL;
     c->bufpos = 0;
+    c->reply = listCreate();
+    c->reply_bytes = 0;
     c->querybuf = sdsempty();
     c->querybuf_peak = 0;
     c->reqtype = 0;
@@ -38,6 +41,12 @@ client *createClient(int fd) {
     c->bulklen = -1;
     c->sentlen = 0;
     c->flags = 0;
+    c->pipeline = 0;
+    c->pipeline_max = 0;
+    c->numcommands = 0;
+    c->numblocked = 0;
+    c->capture = NULL;
+    initClientMultiState(c);
     c->ctime = c->lastinteraction = server.unixtime;
     if (fd != -1) listAddNodeTail(server.clients,c);
     return c;
@@ -60,8 +69,11 @@ client *createClient(int fd) {
  * data to the clients output buffers. If the function returns C_ERR no
  * data should be appended to the output buffers. */
 int prepareClientToWrite(client *c) {
+    /* Replies of commands run by EXEC are sent together at the end. */
+    if (c->flags & CLIENT_IN_EXEC) return C_OK;
+
     /* Only install the handler if not already installed */
-    if (c->bufpos == 0) {
+    if (c->bufpos == 0 && listLength(c->reply) == 0) {
         /* Try to install the write handler. */
         if (aeCreateFileEvent(server.el, c->fd, AE_WRITABLE,
                 sendReplyToClient, c) == AE_ERR)
@@ -84,6 +96,15 @@ int _addReplyToBuffer(client *c, const char *s, size_t len) {
 
     if (c->flags & CLIENT_CLOSE_AFTER_REPLY) return C_OK;
 
+    if (c->flags & CLIENT_IN_EXEC) {
+        c->capture = sdscatlen(c->capture,s,len);
+        return C_OK;
+    }
+
+    /* If there already are blocks in the reply list we can't add anything
+     * more to the static buffer. */
+    if (listLength(c->reply) > 0) return C_ERR;
+
     /* Check that the buffer has enough space available for this string. */
     if (len > available) return C_ERR;
 
@@ -92,6 +113,125 @@ int _addReplyToBuffer(client *c, const char *s, size_t len) {
     return C_OK;
 }
 
+/* Get a reply block with room for at least len bytes, from the pool when it
+ * fits in a standard sized one. */
+static clientReplyBlock *createReplyBlock(size_t len) {
+    clientReplyBlock *b;
+    listNode *ln;
+
+    if (len <= PROTO_REPLY_CHUNK_BYTES && (ln = listFirst(server.reply_pool))) {
+        b = listNodeValue(ln);
+        listDelNode(server.reply_pool,ln);
+    } else {
+        size_t size = len < PROTO_REPLY_CHUNK_BYTES ? PROTO_REPLY_CHUNK_BYTES : len;
+        b = malloc(sizeof(*b)+size);
+        b->size = size;
+    }
+    b->used = 0;
+    return b;
+}
+
+/* Return a reply block to the pool, or free it if it's an odd size or the
+ * pool is full. */
+static void releaseReplyBlock(clientReplyBlock *b) {
+    if (b->size == PROTO_REPLY_CHUNK_BYTES &&
+        listLength(server.reply_pool) < PROTO_REPLY_POOL_MAX)
+    {
+        listAddNodeTail(server.reply_pool,b);
+    } else {
+        free(b);
+    }
+}
+
+void _addReplyToList(client *c, const char *s, size_t len) {
+    clientReplyBlock *tail;
+    listNode *ln;
+
+    if (c->flags & (CLIENT_CLOSE_AFTER_REPLY|CLIENT_CLOSE_ASAP)) return;
+
+    /* Fill the last block first. */
+    if ((ln = listLast(c->reply))) {
+        tail = listNodeValue(ln);
+        size_t avail = tail->size - tail->used;
+        size_t copy = avail >= len ? len : avail;
+        memcpy(tail->buf+tail->used,s,copy);
+        tail->used += copy;
+        c->reply_bytes += copy;
+        s += copy;
+        len -= copy;
+    }
+
+    /* The rest goes in a new block, big enough for all of it. */
+    if (len) {
+        tail = createReplyBlock(len);
+        memcpy(tail->buf,s,len);
+        tail->used = len;
+        c->reply_bytes += len;
+        listAddNodeTail(c->reply,tail);
+    }
+
+    /* Don't let a client which isn't reading its replies eat all the
+     * memory. */
+    if (c->reply_bytes > server.client_max_reply_bytes) {
+        Log(WARNING, "Closing client %llu, %zu bytes of replies pending",
+            (unsigned long long) c->id, c->reply_bytes);
+        freeClientAsync(c);
+    }
+}
+
+/* Reserve room for len bytes at the end of the client's reply, so that a
+ * reply can be formatted straight into the output buffer, then add the bytes
+ * which were actually written with _addReplyCommit(). Returns NULL if the
+ * reply can't go there, e.g. while EXEC is collecting replies, in which case
+ * the caller formats it somewhere else and uses addReplyString(). */
+static char *_addReplyReserve(client *c, size_t len) {
+    clientReplyBlock *tail;
+
+    if (c->flags & (CLIENT_CLOSE_AFTER_REPLY|CLIENT_CLOSE_ASAP|CLIENT_IN_EXEC))
+        return NULL;
+    if (prepareClientToWrite(c) != C_OK) return NULL;
+
+    if (listLength(c->reply) == 0) {
+        if (sizeof(c->buf)-c->bufpos >= len) return c->buf+c->bufpos;
+    } else {
+        tail = listNodeValue(listLast(c->reply));
+        if (tail->size-tail->used >= len) return tail->buf+tail->used;
+    }
+
+    tail = createReplyBlock(len);
+    listAddNodeTail(c->reply,tail);
+    return tail->buf;
+}
+
+static void _addReplyCommit(client *c, size_t len) {
+    if (listLength(c->reply) == 0) {
+        c->bufpos += len;
+    } else {
+        clientReplyBlock *tail = listNodeValue(listLast(c->reply));
+        tail->used += len;
+        c->reply_bytes += len;
+    }
+}
+
+/* Add <prefix><s><crlf> to the reply in one go. */
+static void _addReplyDelimited(client *c, const char *prefix, size_t plen,
+                               const char *s, size_t len)
+{
+    char *p = _addReplyReserve(c,plen+len+2);
+
+    if (p == NULL) {
+        addReplyString(c,prefix,plen);
+        addReplyString(c,s,len);
+        addReplyString(c,"\r\n",2);
+        return;
+    }
+    memcpy(p,prefix,plen);
+    memcpy(p+plen,s,len);
+    p[plen+len] = '\r';
+    p[plen+len+1] = '\n';
+    _addReplyCommit(c,plen+len+2);
+}
+
 /* -----------------------------------------------------------------------------
  * Higher level functions to queue data on the client output buffer.
  * The following functions are the ones that commands implementations will call.
@@ -103,19 +243,15 @@ void addReplySds(client *c, sds s) {
         sdsfree(s);
         return;
     }
-    if (_addReplyToBuffer(c,s,sdslen(s)) == C_OK) {
-        sdsfree(s);
-    } else {
-        Log(WARNING, "addReplySds: not enough space in buffer!");
-        sdsfree(s);
-    }
+    if (_addReplyToBuffer(c,s,sdslen(s)) != C_OK)
+        _addReplyToList(c,s,sdslen(s));
+    sdsfree(s);
 }
 
 void addReplyString(client *c, const char *s, size_t len) {
     if (prepareClientToWrite(c) != C_OK) return;
-    if (_addReplyToBuffer(c,s,len) != C_OK) {
-        Log(WARNING, "addReplyString: not enough space in buffer!");
-    }
+    if (_addReplyToBuffer(c,s,len) != C_OK)
+        _addReplyToList(c,s,len);
 }
 
 void addReply(client *c, const char *fmt, ...) {
@@ -129,9 +265,7 @@ void addReply(client *c, const char *fmt, ...) {
 }
 
 void addReplyErrorLength(client *c, const char *s, size_t len) {
-    addReplyString(c,"-ERR ",5);
-    addReplyString(c,s,len);
-    addReplyString(c,"\r\n",2);
+    _addReplyDelimited(c,"-ERR ",5,s,len);
 }
 
 void addReplyError(client *c, const char *err) {
@@ -155,9 +289,7 @@ void addReplyErrorFormat(client *c, const char *fmt, ...) {
 }
 
 void addReplyStatusLength(client *c, const char *s, size_t len) {
-    addReplyString(c,"+",1);
-    addReplyString(c,s,len);
-    addReplyString(c,"\r\n",2);
+    _addReplyDelimited(c,"+",1,s,len);
 }
 
 void addReplyStatus(client *c, const char *status) {
@@ -175,36 +307,45 @@ void addReplyStatusFormat(client *c, const char *fmt, ...) {
 
 /* Add a double as a bulk reply */
 void addReplyDouble(client *c, double d) {
-    char dbuf[128], sbuf[128];
-    int dlen, slen;
-    if (isinf(d)) {
-        /* Libc in odd systems (Hi Solaris!) will format infinite in a
-         * different way, so better to handle it in an explicit way. */
-        addReplyBulkCString(c, d > 0 ? "inf" : "-inf");
-    } else {
-        dlen = snprintf(dbuf,sizeof(dbuf),"%.17g",d);
-        slen = snprintf(sbuf,sizeof(sbuf),"$%d\r\n%s\r\n",dlen,dbuf);
-        addReplyString(c,sbuf,slen);
-    }
+    char dbuf[MAX_D2STRING_CHARS], hdr[8];
+    int dlen, hlen;
+
+    dlen = d2string(dbuf,sizeof(dbuf),d);
+    hdr[0] = '$';
+    hlen = ll2string(hdr+1,sizeof(hdr)-1,dlen)+1;
+    hdr[hlen++] = '\r';
+    hdr[hlen++] = '\n';
+    _addReplyDelimited(c,hdr,hlen,dbuf,dlen);
 }
 
 /* Add a long long as integer reply or bulk len / multi bulk count.
  * Basically this is used to output <prefix><long long><crlf>. */
 void addReplyLongLongWithPrefix(client *c, long long ll, char prefix) {
-    char buf[128];
+    char buf[LONG_STR_SIZE+3];
+    char *p;
     int len;
 
-    buf[0] = prefix;
-    len = ll2string(buf+1,sizeof(buf)-1,ll);
-    buf[len+1] = '\r';
-    buf[len+2] = '\n';
-    addReplyString(c,buf,len+3);
+    if ((p = _addReplyReserve(c,sizeof(buf))) == NULL) p = buf;
+
+    p[0] = prefix;
+    len = ll2string(p+1,LONG_STR_SIZE,ll);
+    p[len+1] = '\r';
+    p[len+2] = '\n';
+
+    if (p == buf)
+        addReplyString(c,buf,len+3);
+    else
+        _addReplyCommit(c,len+3);
 }
 
 void addReplyLongLong(client *c, long long ll) {
     addReplyLongLongWithPrefix(c,ll,':');
 }
 
+void addReplyMultiBulkLen(client *c, long length) {
+    addReplyLongLongWithPrefix(c,length,'*');
+}
+
 /* Add a C buffer as bulk reply */
 void addReplyBulkCBuffer(client *c, const void *p, size_t len) {
     addReplyLongLongWithPrefix(c,len,'$');
@@ -215,7 +356,7 @@ void addReplyBulkCBuffer(client *c, const void *p, size_t len) {
 /* Add a C nul term string as bulk reply */
 void addReplyBulkCString(client *c, const char *s) {
     if (s == NULL) {
-        addReply(c,"$-1\r\n");
+        addReplyString(c,"$-1\r\n",5);
     } else {
         addReplyBulkCBuffer(c,s,strlen(s));
     }
@@ -283,6 +424,14 @@ void freeClient(client *c) {
 
     if (c->flags & CLIENT_BLOCKED) {
         if (c->bfree) c->bfree(c->bpop.data);
+        server.bpop_blocked_clients--;
+    }
+
+    /* Don't try to process the rest of its query buffer once it's gone */
+    if (c->flags & CLIENT_UNBLOCKED) {
+        ln = listSearchKey(server.unblocked_clients,c);
+        serverAssert(ln != NULL);
+        listDelNode(server.unblocked_clients,ln);
     }
 
     /* If this is marked as current client unset it */
@@ -300,6 +449,13 @@ void freeClient(client *c) {
         close(c->fd);
     }
     freeClientArgv(c);
+    freeClientMultiState(c);
+    while (listLength(c->reply)) {
+        listNode *ln = listFirst(c->reply);
+        releaseReplyBlock(listNodeValue(ln));
+        listDelNode(c->reply,ln);
+    }
+    listRelease(c->reply);
 
     /* Remove from the list of clients */
     if (c->fd != -1) {
@@ -343,25 +499,77 @@ void freeClientsInAsyncFreeQueue(void) {
     }
 }
 
+/* Drop nwritten bytes from the front of the client's pending reply. */
+static void replyWritten(client *c, size_t nwritten) {
+    if (c->bufpos > 0) {
+        size_t left = c->bufpos - c->sentlen;
+
+        if (nwritten < left) {
+            c->sentlen += nwritten;
+            return;
+        }
+        nwritten -= left;
+        c->bufpos = 0;
+        c->sentlen = 0;
+    }
+
+    while (nwritten > 0) {
+        listNode *ln = listFirst(c->reply);
+        clientReplyBlock *b = listNodeValue(ln);
+        size_t left = b->used - c->sentlen;
+
+        if (nwritten < left) {
+            c->sentlen += nwritten;
+            return;
+        }
+        nwritten -= left;
+        c->reply_bytes -= b->used;
+        c->sentlen = 0;
+        listDelNode(c->reply,ln);
+        releaseReplyBlock(b);
+    }
+}
+
 void sendReplyToClient(aeEventLoop *el, int fd, void *privdata, int mask) {
     client *c = privdata;
     ssize_t nwritten = 0, totwritten = 0;
+    struct iovec iov[NET_MAX_IOV];
     UNUSED(el);
     UNUSED(mask);
 
-    while(c->bufpos > 0) {
-        nwritten = write(fd,c->buf+c->sentlen,c->bufpos-c->sentlen);
+    while(c->bufpos > 0 || listLength(c->reply)) {
+        int iovcnt = 0;
+        size_t offset = c->sentlen;
+        listIter li;
+        listNode *ln;
+
+        /* Gather the static buffer and as many reply blocks as fit into a
+         * single writev(). Only the first one can be partly sent. */
+        if (c->bufpos > 0) {
+            iov[iovcnt].iov_base = c->buf+offset;
+            iov[iovcnt].iov_len = c->bufpos-offset;
+            iovcnt++;
+            offset = 0;
+        }
+        listRewind(c->reply,&li);
+        while (iovcnt < NET_MAX_IOV && (ln = listNext(&li))) {
+            clientReplyBlock *b = listNodeValue(ln);
+            iov[iovcnt].iov_base = b->buf+offset;
+            iov[iovcnt].iov_len = b->used-offset;
+            iovcnt++;
+            offset = 0;
+        }
+
+        nwritten = writev(fd,iov,iovcnt);
         if (nwritten <= 0) break;
-        c->sentlen += nwritten;
         totwritten += nwritten;
+        replyWritten(c,nwritten);
 
-        /* If the buffer was sent, set bufpos to zero to continue with
-         * the remainder of the reply. */
-        if ((int)c->sentlen == c->bufpos) {
-            c->bufpos = 0;
-            c->sentlen = 0;
-        }
+        /* Don't hog the event loop writing a huge reply to one client, the
+         * rest is sent the next time around. */
+        if (totwritten > NET_MAX_WRITES_PER_EVENT) break;
     }
+    server.stat_net_output_bytes += totwritten;
 
     if (nwritten == -1) {
         if (errno == EAGAIN) {
@@ -376,7 +584,7 @@ void sendReplyToClient(aeEventLoop *el, int fd, void *privdata, int mask) {
     if (totwritten > 0)
         c->lastinteraction = server.unixtime;
 
-    if (c->bufpos == 0) {
+    if (c->bufpos == 0 && listLength(c->reply) == 0) {
         c->sentlen = 0;
         aeDeleteFileEvent(server.el,c->fd,AE_WRITABLE);
 
@@ -593,6 +801,11 @@ void processInputBuffer(client *c) {
     server.current_client = c;
     /* Keep processing while there is something in the input buffer */
     while(sdslen(c->querybuf)) {
+        /* Commands pipelined behind a blocking one wait in the query buffer
+         * until the client is unblocked. processUnblockedClients() then
+         * picks them up before the event loop sleeps again. */
+        if (c->flags & CLIENT_BLOCKED) break;
+
         /* CLIENT_CLOSE_AFTER_REPLY closes the connection once the reply is
          * written to the client. Make sure to not let the reply grow after
          * this flag has been set (i.e. don't process more commands). */
@@ -619,11 +832,21 @@ void processInputBuffer(client *c) {
         if (c->argc == 0) {
             resetClient(c);
         } else {
+            c->pipeline++;
+            c->numcommands++;
             /* Only reset the client when the command was executed. */
             if (processCommand(c) == C_OK)
                 resetClient(c);
         }
     }
+
+    /* Once the buffer has been drained the batch of pipelined commands is
+     * finished. */
+    if (sdslen(c->querybuf) == 0 && c->pipeline) {
+        hist_record(&stat_pipeline, c->pipeline);
+        if (c->pipeline > c->pipeline_max) c->pipeline_max = c->pipeline;
+        c->pipeline = 0;
+    }
     server.current_client = NULL;
 }
 
@@ -690,6 +913,9 @@ sds catClientInfoString(sds s, client *client) {
     int emask;
 
     p = flags;
+    if (client->flags & CLIENT_MULTI) *p++ = 'x';
+    if (client->flags & CLIENT_BLOCKED) *p++ = 'b';
+    if (client->flags & CLIENT_UNBLOCKED) *p++ = 'u';
     if (client->flags & CLIENT_CLOSE_AFTER_REPLY) *p++ = 'c';
     if (client->flags & CLIENT_CLOSE_ASAP) *p++ = 'A';
     if (p == flags) *p++ = 'N';
@@ -701,7 +927,8 @@ sds catClientInfoString(sds s, client *client) {
     if (emask & AE_WRITABLE) *p++ = 'w';
     *p = '\0';
     return sdscatfmt(s,
-        "id=%U fd=%i name=%s age=%I idle=%I flags=%s qbuf=%U qbuf-free=%U obl=%U cmd=%s",
+        "id=%U fd=%i name=%s age=%I idle=%I flags=%s qbuf=%U qbuf-free=%U obl=%U oll=%U omem=%U cmd=%s "
+        "cmds=%I pipeline=%i pipeline-max=%i blocks=%I multi=%i",
         (unsigned long long) client->id,
         client->fd,
         client->name ? (char*)client->name : "",
@@ -711,7 +938,14 @@ sds catClientInfoString(sds s, client *client) {
         (unsigned long long) sdslen(client->querybuf),
         (unsigned long long) sdsavail(client->querybuf),
         (unsigned long long) client->bufpos,
-        client->lastcmd ? client->lastcmd->name : "NULL");
+        (unsigned long long) listLength(client->reply),
+        (unsigned long long) client->reply_bytes,
+        client->lastcmd ? client->lastcmd->name : "NULL",
+        client->numcommands,
+        client->pipeline,
+        client->pipeline_max,
+        client->numblocked,
+        (client->flags & CLIENT_MULTI) ? client->mstate.count : -1);
 }
 
 sds getAllClientsInfoString(void) {
@@ -730,3 +964,81 @@ sds getAllClientsInfoString(void) {
     return o;
 }
 
+/* Reply with one line of catClientInfoString() per client, like the Redis
+ * CLIENT LIST command. */
+void ClientList(client *c, int argc, sds *argv) {
+    sds o = getAllClientsInfoString();
+    addReplyBulkCBuffer(c,o,sdslen(o));
+    sdsfree(o);
+}
+
+#ifdef NETWORKING_BENCH_MAIN
+#include <stdio.h>
+#include <sys/socket.h>
+
+/* Micro-benchmark of integer replies, comparing the addReply(c, ":%d", ...)
+ * the getters used to send with addReplyLongLong(). The replies are written
+ * to one end of a socket pair and read back from the other, like on the
+ * command port. Build with:
+ *
+ *     gcc -O2 -fcommon -DNETWORKING_BENCH_MAIN networking.c server.c \
+ *         blocked.c multi.c slowlog.c stats.c data.c sock.c ae.c anet.c \
+ *         adlist.c dict.c sds.c util.c logging.c hiredis.c async.c net.c \
+ *         read.c sha1.c \
+ *         -lm -o networking-bench
+ */
+
+#define BENCH_REPLIES 2000000
+#define BENCH_BATCH 256
+
+aeEventLoop *el;
+
+static void bench_drain(client *c, int fd) {
+    char buf[PROTO_IOBUF_LEN];
+
+    while (c->bufpos > 0 || listLength(c->reply)) {
+        sendReplyToClient(server.el,c->fd,c,AE_WRITABLE);
+        while (read(fd,buf,sizeof(buf)) == sizeof(buf));
+    }
+}
+
+static double bench(client *c, int fd, int old) {
+    long long start = ustime();
+    int i;
+
+    for (i = 0; i < BENCH_REPLIES; i++) {
+        if (old)
+            addReply(c,":%d",i);
+        else
+            addReplyLongLong(c,i);
+        if (i % BENCH_BATCH == BENCH_BATCH-1) bench_drain(c,fd);
+    }
+    bench_drain(c,fd);
+
+    return BENCH_REPLIES*1e6/(ustime()-start);
+}
+
+int main(void) {
+    int sv[2];
+    client *c;
+
+    server.el = el = aeCreateEventLoop(64);
+    server.clients = listCreate();
+    server.clients_to_close = listCreate();
+    server.reply_pool = listCreate();
+    server.client_max_reply_bytes = PROTO_REPLY_MAX_BYTES;
+
+    if (socketpair(AF_UNIX,SOCK_STREAM,0,sv) == -1) {
+        perror("socketpair");
+        return 1;
+    }
+    anetNonBlock(NULL,sv[1]);
+    c = createClient(sv[0]);
+
+    printf("%d integer replies\n", BENCH_REPLIES);
+    printf("addReply(\":%%d\"): %.0f replies/s\n", bench(c,sv[1],1));
+    printf("addReplyLongLong: %.0f replies/s\n", bench(c,sv[1],0));
+
+    return 0;
+}
+#endif
@@ -0,0 +1,343 @@
+#include "readout.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+#include <sys/time.h>
+#include <pthread.h>
+#include "logging.h"
+
+char readout_err[256];
+
+/* depth of the simulated FIFO */
+#define SIM_FIFO_DEPTH 4096
+/* how often the simulated FIFO generates triggers */
+#define SIM_TICK 1
+
+/* GTIDs are 24 bits */
+#define GTID_MASK 0xFFFFFF
+
+typedef struct simFifo {
+    aeEventLoop *el;
+    long long tick_id;
+    double rate;           /* trigger rate in Hz */
+    double pending;        /* fractional triggers carried over between ticks */
+    long long last_tick;   /* time of the last tick in microseconds */
+    uint32_t gtid;
+    int armed;             /* 1 if the next trigger should signal the eventfd */
+    /* protects the FIFO when it's read out from the readout thread */
+    pthread_mutex_t lock;
+    int head;
+    int tail;
+    int count;
+    struct TubiiRecord fifo[SIM_FIFO_DEPTH];
+} simFifo;
+
+static long long now_us(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return ((long long) tv.tv_sec)*1000000 + tv.tv_usec;
+}
+
+int readout_mode_from_string(const char *s)
+{
+    if (!strcmp(s, "poll")) return READOUT_POLL;
+    if (!strcmp(s, "uio"))  return READOUT_UIO;
+    if (!strcmp(s, "sim"))  return READOUT_SIM;
+
+    return -1;
+}
+
+const char *readout_mode_name(int mode)
+{
+    switch (mode) {
+    case READOUT_POLL:
+        return "poll";
+    case READOUT_UIO:
+        return "uio";
+    case READOUT_SIM:
+        return "sim";
+    default:
+        return "unknown";
+    }
+}
+
+static readoutSource *readout_create(int mode)
+{
+    readoutSource *src = (readoutSource *) malloc(sizeof(readoutSource));
+
+    src->mode = mode;
+    src->fd = -1;
+    src->read = NULL;
+    src->count = NULL;
+    src->arm = NULL;
+    src->ack = NULL;
+    src->free = NULL;
+    src->priv = NULL;
+
+    return src;
+}
+
+void readout_free(readoutSource *src)
+{
+    if (src->free) src->free(src);
+
+    if (src->fd != -1) close(src->fd);
+
+    free(src);
+}
+
+/* Polled hardware FIFO. */
+
+readoutSource *readout_poll_create(readoutReadProc *read, readoutCountProc *count)
+{
+    readoutSource *src = readout_create(READOUT_POLL);
+
+    src->read = read;
+    src->count = count;
+
+    return src;
+}
+
+/* Hardware FIFO with the "not empty" interrupt exposed through a UIO device.
+ *
+ * Reading 4 bytes from the device returns the interrupt count and clears the
+ * readable condition. Writing 1 re-enables the interrupt, so we only do that
+ * once the FIFO has been drained. If more triggers arrive after the drain
+ * the level-sensitive interrupt fires again as soon as it is re-enabled. */
+
+static int uio_arm(readoutSource *src)
+{
+    uint32_t enable = 1;
+
+    if (write(src->fd, &enable, sizeof(enable)) != sizeof(enable)) {
+        sprintf(readout_err, "failed to enable FIFO interrupt: %s",
+                strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+static int uio_ack(readoutSource *src)
+{
+    uint32_t count;
+
+    if (read(src->fd, &count, sizeof(count)) != sizeof(count)) {
+        if (errno == EAGAIN) return 0;
+
+        sprintf(readout_err, "failed to read FIFO interrupt: %s",
+                strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+readoutSource *readout_uio_create(const char *dev, readoutReadProc *read,
+                                  readoutCountProc *count)
+{
+    readoutSource *src;
+    int fd;
+
+    if ((fd = open(dev, O_RDWR | O_NONBLOCK)) == -1) {
+        sprintf(readout_err, "failed to open %s: %s", dev, strerror(errno));
+        return NULL;
+    }
+
+    src = readout_create(READOUT_UIO);
+    src->fd = fd;
+    src->read = read;
+    src->count = count;
+    src->arm = uio_arm;
+    src->ack = uio_ack;
+
+    if (uio_arm(src)) {
+        readout_free(src);
+        return NULL;
+    }
+
+    return src;
+}
+
+/* Simulated FIFO. A time event fills a software FIFO with fake triggers at
+ * a configurable rate and signals an eventfd in the same way the hardware
+ * raises its interrupt, so the interrupt driven readout can be run on any
+ * Linux box. */
+
+static void sim_signal(readoutSource *src)
+{
+    uint64_t one = 1;
+    simFifo *sim = (simFifo *) src->priv;
+
+    if (!sim->armed) return;
+
+    if (write(src->fd, &one, sizeof(one)) != sizeof(one)) {
+        Log(WARNING, "simulated FIFO: failed to signal eventfd: %s",
+            strerror(errno));
+        return;
+    }
+
+    sim->armed = 0;
+}
+
+static int sim_tick(aeEventLoop *el, long long id, void *data)
+{
+    readoutSource *src = (readoutSource *) data;
+    simFifo *sim = (simFifo *) src->priv;
+    long long now = now_us();
+    int i, n;
+
+    sim->pending += sim->rate*(now - sim->last_tick)/1e6;
+    sim->last_tick = now;
+
+    n = (int) sim->pending;
+    sim->pending -= n;
+
+    pthread_mutex_lock(&sim->lock);
+
+    for (i = 0; i < n; i++) {
+        sim->gtid = (sim->gtid + 1) & GTID_MASK;
+
+        /* like the hardware, triggers which arrive while the FIFO is full
+         * are lost, which shows up as a gap in the GTIDs */
+        if (sim->count == SIM_FIFO_DEPTH) continue;
+
+        sim->fifo[sim->tail].GTID = sim->gtid;
+        sim->fifo[sim->tail].TrigWord = rand() & GTID_MASK;
+        sim->tail = (sim->tail + 1) % SIM_FIFO_DEPTH;
+        sim->count++;
+    }
+
+    n = sim->count;
+
+    pthread_mutex_unlock(&sim->lock);
+
+    if (n) sim_signal(src);
+
+    return SIM_TICK;
+}
+
+static int sim_read(readoutSource *src, struct TubiiRecord *rec, int max)
+{
+    simFifo *sim = (simFifo *) src->priv;
+    int n = 0;
+
+    pthread_mutex_lock(&sim->lock);
+
+    while (sim->count && n < max) {
+        rec[n++] = sim->fifo[sim->head];
+        sim->head = (sim->head + 1) % SIM_FIFO_DEPTH;
+        sim->count--;
+    }
+
+    pthread_mutex_unlock(&sim->lock);
+
+    return n;
+}
+
+static int sim_count(readoutSource *src)
+{
+    simFifo *sim = (simFifo *) src->priv;
+    int n;
+
+    pthread_mutex_lock(&sim->lock);
+    n = sim->count;
+    pthread_mutex_unlock(&sim->lock);
+
+    return n;
+}
+
+static int sim_arm(readoutSource *src)
+{
+    simFifo *sim = (simFifo *) src->priv;
+
+    sim->armed = 1;
+
+    /* level triggered, so signal straight away if data is still waiting */
+    if (sim_count(src)) sim_signal(src);
+
+    return 0;
+}
+
+static int sim_ack(readoutSource *src)
+{
+    uint64_t count;
+
+    if (read(src->fd, &count, sizeof(count)) != sizeof(count)) {
+        if (errno == EAGAIN) return 0;
+
+        sprintf(readout_err, "failed to read eventfd: %s", strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+static void sim_free(readoutSource *src)
+{
+    simFifo *sim = (simFifo *) src->priv;
+
+    if (sim->tick_id != AE_ERR) aeDeleteTimeEvent(sim->el, sim->tick_id);
+
+    pthread_mutex_destroy(&sim->lock);
+    free(sim);
+}
+
+readoutSource *readout_sim_create(aeEventLoop *el, double rate)
+{
+    readoutSource *src;
+    simFifo *sim;
+    int fd;
+
+    if ((fd = eventfd(0, EFD_NONBLOCK)) == -1) {
+        sprintf(readout_err, "eventfd: %s", strerror(errno));
+        return NULL;
+    }
+
+    sim = (simFifo *) malloc(sizeof(simFifo));
+    sim->el = el;
+    sim->rate = rate;
+    sim->pending = 0;
+    sim->last_tick = now_us();
+    sim->gtid = 0;
+    sim->armed = 1;
+    sim->head = 0;
+    sim->tail = 0;
+    sim->count = 0;
+    pthread_mutex_init(&sim->lock, NULL);
+
+    src = readout_create(READOUT_SIM);
+    src->fd = fd;
+    src->read = sim_read;
+    src->count = sim_count;
+    src->arm = sim_arm;
+    src->ack = sim_ack;
+    src->free = sim_free;
+    src->priv = sim;
+
+    if ((sim->tick_id = aeCreateTimeEvent(el, SIM_TICK, sim_tick, src, NULL)) == AE_ERR) {
+        sprintf(readout_err, "failed to set up simulated FIFO");
+        readout_free(src);
+        return NULL;
+    }
+
+    return src;
+}
+
+void readout_sim_set_rate(readoutSource *src, double rate)
+{
+    simFifo *sim = (simFifo *) src->priv;
+
+    if (src->mode != READOUT_SIM) return;
+
+    sim->rate = rate;
+    sim->pending = 0;
+    sim->last_tick = now_us();
+}
@@ -0,0 +1,54 @@
+#ifndef READOUT_H
+#define READOUT_H
+
+#include "ae.h"
+#include "record_info.h"
+
+/* A readout source is where tubii_readout() gets its trigger records from.
+ *
+ * Every source provides a read() function which copies up to `max` records
+ * out of the FIFO, and a count() function which returns how many records are
+ * waiting so the readout can let a bundle build up in the FIFO. Sources which can tell us when the FIFO has data also
+ * provide a file descriptor which becomes readable when the FIFO is not
+ * empty (or above its high-watermark). When that happens the event loop
+ * calls the readout, which drains the FIFO and then calls arm() to re-enable
+ * the wakeup. Sources without a file descriptor (fd == -1) are polled from a
+ * time event like the original readout. */
+
+/* readout modes */
+#define READOUT_POLL 0 /* poll the hardware FIFO every millisecond */
+#define READOUT_UIO  1 /* hardware FIFO, woken by the FIFO interrupt via UIO */
+#define READOUT_SIM  2 /* simulated FIFO, woken via an eventfd */
+
+struct readoutSource;
+
+typedef int readoutReadProc(struct readoutSource *src, struct TubiiRecord *rec, int max);
+typedef int readoutCountProc(struct readoutSource *src);
+
+typedef struct readoutSource {
+    int mode;
+    int fd;
+    readoutReadProc *read;
+    readoutCountProc *count;
+    /* re-enable the wakeup after the FIFO has been drained */
+    int (*arm)(struct readoutSource *src);
+    /* clear the wakeup condition once the file descriptor is readable */
+    int (*ack)(struct readoutSource *src);
+    void (*free)(struct readoutSource *src);
+    void *priv;
+} readoutSource;
+
+extern char readout_err[256];
+
+int readout_mode_from_string(const char *s);
+const char *readout_mode_name(int mode);
+
+readoutSource *readout_poll_create(readoutReadProc *read, readoutCountProc *count);
+readoutSource *readout_uio_create(const char *dev, readoutReadProc *read,
+                                  readoutCountProc *count);
+readoutSource *readout_sim_create(aeEventLoop *el, double rate);
+void readout_free(readoutSource *src);
+
+void readout_sim_set_rate(readoutSource *src, double rate);
+
+#endif
@@ -0,0 +1,220 @@
+#define _GNU_SOURCE
+#include "readout_thread.h"
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/eventfd.h>
+#include "logging.h"
+
+char readout_thread_err[256];
+
+typedef struct readoutSlot {
+    long long t_read; /* when the bundle was read out of the FIFO (us) */
+    int n;
+    struct TubiiRecord rec[MEGA_RECORD_MAX];
+} readoutSlot;
+
+/* The ring is only ever written at `head` by the readout thread and only
+ * ever consumed at `tail` by the event loop. Each side publishes its index
+ * with a release store and reads the other's with an acquire load, so the
+ * slot contents are visible before the index that hands them over. */
+static readoutSlot ring[READOUT_RING_SIZE];
+static unsigned int ring_head = 0;
+static unsigned int ring_tail = 0;
+
+static pthread_t thread;
+static int running = 0;
+static int notify_fd = -1;
+static readoutSource *source;
+static readoutReadyProc *ready_proc;
+static readoutEmitProc *emit_proc;
+
+static readoutThreadStats stats;
+/* written by the readout thread, so kept out of `stats` */
+static unsigned long long ring_full = 0;
+
+static long long mono_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((long long) ts.tv_sec)*1000000 + ts.tv_nsec/1000;
+}
+
+static void *readout_thread(void *arg)
+{
+    struct timespec next;
+    unsigned int head, tail;
+    uint64_t one = 1;
+    int max;
+    readoutSlot *slot;
+
+    clock_gettime(CLOCK_MONOTONIC, &next);
+
+    while (1) {
+        next.tv_nsec += READOUT_THREAD_PERIOD*1000;
+        if (next.tv_nsec >= 1000000000) {
+            next.tv_nsec -= 1000000000;
+            next.tv_sec++;
+        }
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+
+        if ((max = ready_proc()) <= 0) continue;
+
+        head = ring_head;
+        tail = __atomic_load_n(&ring_tail, __ATOMIC_ACQUIRE);
+
+        if (head - tail == READOUT_RING_SIZE) {
+            /* the event loop has fallen behind, so leave the records in
+             * the FIFO until there's room */
+            __atomic_add_fetch(&ring_full, 1, __ATOMIC_RELAXED);
+            continue;
+        }
+
+        slot = &ring[head & (READOUT_RING_SIZE - 1)];
+        slot->n = source->read(source, slot->rec, max);
+        slot->t_read = mono_us();
+
+        if (slot->n == 0) continue;
+
+        __atomic_store_n(&ring_head, head + 1, __ATOMIC_RELEASE);
+
+        /* this can only fail if the eventfd counter would overflow, in
+         * which case it's already readable */
+        if (write(notify_fd, &one, sizeof(one)) != sizeof(one)) continue;
+    }
+
+    return NULL;
+}
+
+static void readout_thread_drain(aeEventLoop *el, int fd, void *data, int mask)
+{
+    uint64_t count;
+    unsigned int head, tail, waiting;
+    long long latency;
+    readoutSlot *slot;
+    int i;
+
+    if (read(fd, &count, sizeof(count)) != sizeof(count) && errno != EAGAIN) {
+        Log(WARNING, "readout thread: failed to read eventfd: %s",
+            strerror(errno));
+    }
+
+    head = __atomic_load_n(&ring_head, __ATOMIC_ACQUIRE);
+    tail = ring_tail;
+
+    waiting = head - tail;
+    if (waiting > stats.ring_max) stats.ring_max = waiting;
+
+    for (; tail != head; tail++) {
+        slot = &ring[tail & (READOUT_RING_SIZE - 1)];
+
+        emit_proc(slot->rec, slot->n);
+
+        latency = mono_us() - slot->t_read;
+        stats.bundles++;
+        stats.records += slot->n;
+        stats.latency_sum += latency;
+        if (latency > stats.latency_max) stats.latency_max = latency;
+        for (i = 0; (latency >> (i+1)) && i < READOUT_LATENCY_BINS-1; i++);
+        stats.latency_hist[i]++;
+
+        /* hand the slot back to the readout thread */
+        __atomic_store_n(&ring_tail, tail + 1, __ATOMIC_RELEASE);
+    }
+}
+
+int readout_thread_start(aeEventLoop *el, readoutSource *src,
+                         readoutReadyProc *ready, readoutEmitProc *emit,
+                         int cpu, int prio)
+{
+    /* Start the readout thread, pinned to `cpu` and running under
+     * SCHED_FIFO at priority `prio`. If the scheduling can't be set (e.g.
+     * the server isn't running as root) the thread is still started, but
+     * a warning is logged. */
+    pthread_attr_t attr;
+    struct sched_param param;
+    cpu_set_t cpus;
+    int rv;
+
+    if (running) {
+        sprintf(readout_thread_err, "readout thread already running");
+        return -1;
+    }
+
+    if ((notify_fd = eventfd(0, EFD_NONBLOCK)) == -1) {
+        sprintf(readout_thread_err, "eventfd: %s", strerror(errno));
+        return -1;
+    }
+
+    if (aeCreateFileEvent(el, notify_fd, AE_READABLE, readout_thread_drain, NULL) == AE_ERR) {
+        sprintf(readout_thread_err, "failed to set up readout thread event");
+        goto err;
+    }
+
+    source = src;
+    ready_proc = ready;
+    emit_proc = emit;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+    pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+    param.sched_priority = prio;
+    pthread_attr_setschedparam(&attr, &param);
+
+    if ((rv = pthread_create(&thread, &attr, readout_thread, NULL)) == EPERM) {
+        Log(WARNING, "readout thread: not allowed to use SCHED_FIFO, "
+            "running with normal priority");
+        pthread_attr_setinheritsched(&attr, PTHREAD_INHERIT_SCHED);
+        rv = pthread_create(&thread, &attr, readout_thread, NULL);
+    }
+
+    pthread_attr_destroy(&attr);
+
+    if (rv) {
+        sprintf(readout_thread_err, "failed to start readout thread: %s",
+                strerror(rv));
+        aeDeleteFileEvent(el, notify_fd, AE_READABLE);
+        goto err;
+    }
+
+    if (cpu >= 0) {
+        CPU_ZERO(&cpus);
+        CPU_SET(cpu, &cpus);
+        if ((rv = pthread_setaffinity_np(thread, sizeof(cpus), &cpus))) {
+            Log(WARNING, "readout thread: failed to pin to cpu %i: %s", cpu,
+                strerror(rv));
+        }
+    }
+
+    running = 1;
+
+    return 0;
+
+err:
+    close(notify_fd);
+    notify_fd = -1;
+    return -1;
+}
+
+int readout_thread_running(void)
+{
+    return running;
+}
+
+void readout_thread_get_stats(readoutThreadStats *s)
+{
+    *s = stats;
+    s->ring_full = __atomic_load_n(&ring_full, __ATOMIC_RELAXED);
+}
+
+void readout_thread_reset_stats(void)
+{
+    memset(&stats, 0, sizeof(stats));
+    __atomic_store_n(&ring_full, 0, __ATOMIC_RELAXED);
+}
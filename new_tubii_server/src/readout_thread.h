@@ -0,0 +1,58 @@
+#ifndef READOUT_THREAD_H
+#define READOUT_THREAD_H
+
+#include "ae.h"
+#include "readout.h"
+#include "record_info.h"
+
+/* Optional real-time readout thread.
+ *
+ * The thread polls the readout source every READOUT_THREAD_PERIOD
+ * microseconds and copies bundles out of the FIFO into a lock-free single
+ * producer/single consumer ring. It then signals an eventfd, and the event
+ * loop hands each bundle to emit(), which runs in the main thread and so can
+ * safely write to the data stream. This keeps slow commands and database
+ * callbacks from delaying the FIFO drain. The thread doesn't use the
+ * source's wakeup file descriptor. */
+
+/* pass as the cpu to start_tubii_readout() to not use a readout thread, or
+ * -1 to run the thread without pinning it */
+#define READOUT_NO_THREAD -2
+
+/* how often the thread checks the FIFO (us) */
+#define READOUT_THREAD_PERIOD 100
+/* number of bundles in the ring, must be a power of two */
+#define READOUT_RING_SIZE 32
+/* bins in the latency histogram */
+#define READOUT_LATENCY_BINS 16
+
+/* Called from the readout thread. Returns the number of records to read out
+ * of the FIFO, or <= 0 if the thread should wait. */
+typedef int readoutReadyProc(void);
+/* Called from the event loop with each bundle, in the order they were read */
+typedef void readoutEmitProc(struct TubiiRecord *rec, int n);
+
+typedef struct readoutThreadStats {
+    unsigned long long bundles;
+    unsigned long long records;
+    /* time from the FIFO read to emit() returning (us) */
+    unsigned long long latency_sum;
+    unsigned long long latency_max;
+    /* latency_hist[i] counts bundles with a latency of 2^i to 2^(i+1)-1 us */
+    unsigned long long latency_hist[READOUT_LATENCY_BINS];
+    /* times the FIFO was left waiting because the ring was full */
+    unsigned long long ring_full;
+    /* most bundles ever waiting in the ring */
+    unsigned int ring_max;
+} readoutThreadStats;
+
+extern char readout_thread_err[256];
+
+int readout_thread_start(aeEventLoop *el, readoutSource *src,
+                         readoutReadyProc *ready, readoutEmitProc *emit,
+                         int cpu, int prio);
+int readout_thread_running(void);
+void readout_thread_get_stats(readoutThreadStats *stats);
+void readout_thread_reset_stats(void);
+
+#endif
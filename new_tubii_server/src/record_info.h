@@ -16,9 +16,12 @@ struct TubiiRecord {
     uint32_t GTID;
 };
 
+/* most trigger records in a single MEGA_RECORD bundle */
+#define MEGA_RECORD_MAX 1000
+
 struct MegaRecord {
 	//uint32_t size;
-	struct TubiiRecord array[1000];
+	struct TubiiRecord array[MEGA_RECORD_MAX];
 };
 
 struct TubiiStatus {
@@ -28,6 +31,32 @@ struct TubiiStatus {
     uint32_t FIFO;
 };
 
+/* GTID gaps seen by the readout since the last TUBII_GAPS record */
+struct TubiiGaps {
+    uint32_t Gaps;   // number of jumps forward by more than one
+    uint32_t Missed; // total number of GTIDs skipped over by those jumps
+    uint32_t Wraps;  // number of times the 24 bit GTID wrapped around
+    uint32_t Resets; // number of times the GTID went backwards (e.g. reset)
+};
+
+/* summary of one of the hot path histograms in stats.h */
+struct TubiiHistSummary {
+    uint32_t Count;
+    uint32_t Min;
+    uint32_t P50;
+    uint32_t P90;
+    uint32_t P99;
+    uint32_t Max;
+};
+
+struct TubiiStatsRecord {
+    struct TubiiHistSummary Readout;       // us
+    struct TubiiHistSummary ReadoutEvents; // records
+    struct TubiiHistSummary SockWrite;     // us
+    struct TubiiHistSummary SockBytes;     // bytes
+    struct TubiiHistSummary DBRoundTrip;   // us
+};
+
 enum RecordTypes {
     RHDR_RECORD    = 0x52484452,
     EPED_RECORD    = 0x45504544,
@@ -39,6 +68,8 @@ enum RecordTypes {
     FIFO_LEVELS    = 0x4649464f,
     TUBII_RECORD   = 0xabc12345, // Temp
     TUBII_STATUS   = 0x54554253, // Temp
+    TUBII_GAPS     = 0x54554247, // TUBG
+    TUBII_STATS    = 0x54555354, // TUST
     MEGA_RECORD    = 0x54554232, // TUB2 Change later
 };
 
@@ -0,0 +1,451 @@
+/* Software model of TUBii's registers.
+ *
+ * regsim_create() returns a register backend which stands in for the
+ * hardware behind the AXI register window, so the server (readout, data
+ * stream and command port) can be run and benchmarked on any Linux box.
+ * Registers without a model just hold what was last written to them. On top
+ * of that it models:
+ *
+ *   - triggers, arriving as a Poisson process at `rate` Hz, optionally in
+ *     bursts of `burst` back to back triggers. The bursts then start as a
+ *     Poisson process at rate/burst so the mean rate stays the same.
+ *   - the generic, SMELLIE, TELLIE and TUBii PGT pulsers. Once a period and
+ *     a number of pulses are set each pulse is a trigger with the pulser's
+ *     own bit set in the trigger word.
+ *   - the GTID counter, which counts every trigger, and the soft GT and
+ *     GTID reset strobes.
+ *   - the readout FIFO. Setting bit 0 of register 0 pops the oldest record
+ *     into registers 1 and 2, bit 1 empties it, and register 3 reads back
+ *     how many records are waiting. Triggers which arrive while it's full
+ *     are lost, which shows up as a gap in the GTIDs like on the hardware.
+ *   - the shift register chains. Each shift clock moves the top bit of the
+ *     data register into the chain, and data ready latches the chain into
+ *     the register it selects.
+ *
+ * Nothing runs in the background: triggers are generated from the
+ * monotonic clock whenever the FIFO or the GTID is looked at. The readout
+ * thread and the event loop both get here, so the model is locked. */
+
+#include "regsim.h"
+#include "tubiiAddresses.h"
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+
+#define SIM_WINDOW_SIZE (AXI_HIGHADDR - AXI_BASEADDR + 1)
+#define SIM_BLOCK(BASEADDR) ((BASEADDR) - AXI_BASEADDR)
+#define SIM_REG(BASEADDR, n) (SIM_BLOCK(BASEADDR) + 4*(n))
+
+/* depth of the FIFO */
+#define SIM_FIFO_DEPTH 4096
+
+/* GTIDs and trigger words are 24 bits */
+#define GTID_MASK 0xFFFFFF
+
+/* pulser registers are in 100 MHz clock ticks */
+#define SIM_TICK_NS 10
+
+#define SIM_PULSERS 4
+#define SIM_SHIFT_REGS 16
+
+typedef struct simRecord {
+    uint32_t trigword;
+    uint32_t gtid;
+} simRecord;
+
+typedef struct simPulser {
+    uint32_t block;     /* offset of the pulser in the window */
+    uint32_t word;      /* trigger word of its pulses */
+    long long next;     /* time of the next pulse (ns), -1 if stopped */
+    long long period;   /* ns */
+    uint32_t remaining;
+} simPulser;
+
+typedef struct regSim {
+    pthread_mutex_t lock;
+    uint32_t regs[SIM_WINDOW_SIZE/4];
+    /* random triggers */
+    double rate;
+    int burst;
+    long long next;     /* time of the next trigger or burst (ns), -1 if off */
+    uint64_t rng;
+    simPulser pulsers[SIM_PULSERS];
+    uint32_t gtid;
+    uint64_t triggers;
+    uint64_t lost;
+    /* shift registers */
+    uint32_t shift_data;
+    uint64_t shift_chain;
+    uint64_t shift_latched[SIM_SHIFT_REGS];
+    /* FIFO */
+    int head;
+    int tail;
+    int count;
+    simRecord fifo[SIM_FIFO_DEPTH];
+} regSim;
+
+static const struct {
+    uint32_t base;
+    uint32_t word;
+} sim_pulsers[SIM_PULSERS] = {
+    {GENERICPULSER_BASEADDR, 1<<20},
+    {SMELLIEPULSER_BASEADDR, 1<<21},
+    {TELLIEPULSER_BASEADDR,  1<<22},
+    {TUBIIPGT_BASEADDR,      1<<23}
+};
+
+static long long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((long long) ts.tv_sec)*1000000000 + ts.tv_nsec;
+}
+
+/* xorshift64*, so the readout thread doesn't contend on rand()'s lock */
+static uint64_t sim_random(regSim *sim)
+{
+    sim->rng ^= sim->rng >> 12;
+    sim->rng ^= sim->rng << 25;
+    sim->rng ^= sim->rng >> 27;
+    return sim->rng * 2685821657736338717ULL;
+}
+
+/* Time until the next trigger (or burst) in ns */
+static long long sim_interval(regSim *sim)
+{
+    double u = ((sim_random(sim) >> 11) + 1) / 9007199254740992.0;
+
+    return (long long) (-log(u)*1e9*sim->burst/sim->rate);
+}
+
+static void sim_trigger(regSim *sim, uint32_t word)
+{
+    sim->gtid = (sim->gtid + 1) & GTID_MASK;
+    sim->triggers++;
+
+    if (sim->count == SIM_FIFO_DEPTH) {
+        sim->lost++;
+        return;
+    }
+
+    sim->fifo[sim->tail].trigword = word & GTID_MASK;
+    sim->fifo[sim->tail].gtid = sim->gtid;
+    sim->tail = (sim->tail + 1) % SIM_FIFO_DEPTH;
+    sim->count++;
+}
+
+/* Count n triggers which all arrive while the FIFO is full */
+static void sim_skip(regSim *sim, uint64_t n)
+{
+    sim->gtid = (sim->gtid + n) & GTID_MASK;
+    sim->triggers += n;
+    sim->lost += n;
+}
+
+/* Generate every trigger which has arrived since the last call. Once the
+ * FIFO is full the rest are only counted, so catching up after a long time
+ * without a readout doesn't cost a loop iteration per trigger. */
+static void sim_advance(regSim *sim)
+{
+    long long now = now_ns();
+    simPulser *p;
+    uint64_t n;
+    int i;
+
+    for (i = 0; i < SIM_PULSERS; i++) {
+        p = &sim->pulsers[i];
+
+        while (p->next >= 0 && p->next <= now) {
+            if (sim->count == SIM_FIFO_DEPTH) {
+                n = (now - p->next)/p->period + 1;
+                if (n > p->remaining) n = p->remaining;
+                sim_skip(sim, n);
+                p->remaining -= n;
+                p->next += n*p->period;
+            } else {
+                sim_trigger(sim, p->word);
+                p->remaining--;
+                p->next += p->period;
+            }
+
+            if (p->remaining == 0) p->next = -1;
+        }
+    }
+
+    while (sim->next >= 0 && sim->next <= now) {
+        if (sim->count == SIM_FIFO_DEPTH) {
+            sim_skip(sim, (uint64_t) ((now - sim->next)*sim->rate/1e9) + sim->burst);
+            sim->next = now + sim_interval(sim);
+            break;
+        }
+
+        for (i = 0; i < sim->burst; i++)
+            sim_trigger(sim, sim_random(sim));
+        sim->next += sim_interval(sim);
+    }
+}
+
+/* A pulser starts over whenever its period or number of pulses is set */
+static void sim_pulser_set(regSim *sim, simPulser *p)
+{
+    uint32_t period = sim->regs[(p->block + 4)/4];
+
+    p->period = (long long) period*SIM_TICK_NS;
+    p->remaining = sim->regs[(p->block + 12)/4];
+    p->next = (period && p->remaining) ? now_ns() + p->period : -1;
+}
+
+static uint32_t sim_read(regBackend *b, uint32_t offset)
+{
+    regSim *sim = (regSim *) b->priv;
+    uint32_t value;
+
+    if (offset >= SIM_WINDOW_SIZE) return 0;
+
+    pthread_mutex_lock(&sim->lock);
+
+    switch (offset) {
+    case SIM_REG(FIFOREADOUT_BASEADDR, 3):
+        sim_advance(sim);
+        value = sim->count;
+        break;
+    case SIM_REG(TRIGGEROUT_BASEADDR, 4):
+        sim_advance(sim);
+        value = sim->gtid;
+        break;
+    default:
+        value = sim->regs[offset/4];
+    }
+
+    pthread_mutex_unlock(&sim->lock);
+
+    return value;
+}
+
+static void sim_write(regBackend *b, uint32_t offset, uint32_t value)
+{
+    regSim *sim = (regSim *) b->priv;
+    uint32_t old;
+    int i;
+
+    if (offset >= SIM_WINDOW_SIZE) return;
+
+    pthread_mutex_lock(&sim->lock);
+
+    old = sim->regs[offset/4];
+    sim->regs[offset/4] = value;
+
+    switch (offset) {
+    case SIM_REG(FIFOREADOUT_BASEADDR, 0):
+        if ((value & 1) && !(old & 1) && sim->count) {
+            /* pop */
+            sim->regs[offset/4 + 1] = sim->fifo[sim->head].trigword;
+            sim->regs[offset/4 + 2] = sim->fifo[sim->head].gtid;
+            sim->head = (sim->head + 1) % SIM_FIFO_DEPTH;
+            sim->count--;
+        }
+        if (value & 2) {
+            /* reset */
+            sim->head = 0;
+            sim->tail = 0;
+            sim->count = 0;
+        }
+        break;
+    case SIM_REG(TRIGGEROUT_BASEADDR, 6):
+        /* soft GT */
+        if (value && !old) {
+            sim_advance(sim);
+            sim_trigger(sim, 0);
+        }
+        break;
+    case SIM_REG(TRIGGEROUT_BASEADDR, 7):
+        /* GTID reset */
+        if (value && !old) {
+            sim_advance(sim);
+            sim->gtid = 0;
+        }
+        break;
+    case SIM_REG(SHIFTREGS_BASEADDR, 2):
+        /* data ready */
+        sim->shift_latched[value % SIM_SHIFT_REGS] = sim->shift_chain;
+        break;
+    case SIM_REG(SHIFTREGS_BASEADDR, 3):
+        sim->shift_data = value;
+        break;
+    case SIM_REG(SHIFTREGS_BASEADDR, 4):
+        /* shift clock */
+        sim->shift_chain = (sim->shift_chain << 1) | ((sim->shift_data >> 7) & 1);
+        sim->shift_data <<= 1;
+        break;
+    default:
+        for (i = 0; i < SIM_PULSERS; i++) {
+            simPulser *p = &sim->pulsers[i];
+
+            if (offset == p->block + 4 || offset == p->block + 12) {
+                sim_advance(sim);
+                sim_pulser_set(sim, p);
+            }
+        }
+    }
+
+    pthread_mutex_unlock(&sim->lock);
+}
+
+static void sim_free(regBackend *b)
+{
+    regSim *sim = (regSim *) b->priv;
+
+    pthread_mutex_destroy(&sim->lock);
+    free(sim);
+}
+
+regBackend *regsim_create(double rate, int burst)
+{
+    regBackend *b;
+    regSim *sim;
+    int i;
+
+    sim = (regSim *) calloc(1, sizeof(regSim));
+    pthread_mutex_init(&sim->lock, NULL);
+    sim->rng = 0x9E3779B97F4A7C15ULL ^ (uint64_t) now_ns();
+
+    for (i = 0; i < SIM_PULSERS; i++) {
+        sim->pulsers[i].block = SIM_BLOCK(sim_pulsers[i].base);
+        sim->pulsers[i].word = sim_pulsers[i].word;
+        sim->pulsers[i].next = -1;
+    }
+
+    b = (regBackend *) malloc(sizeof(regBackend));
+    b->read = sim_read;
+    b->write = sim_write;
+    b->free = sim_free;
+    b->priv = sim;
+
+    sim->rate = rate;
+    sim->burst = burst < 1 ? 1 : burst;
+    sim->next = rate > 0 ? now_ns() + sim_interval(sim) : -1;
+
+    return b;
+}
+
+void regsim_free(regBackend *b)
+{
+    if (b->free) b->free(b);
+    free(b);
+}
+
+/* Start the random triggers over at the current rate and burst size */
+static void sim_restart(regSim *sim)
+{
+    sim_advance(sim);
+    sim->next = sim->rate > 0 ? now_ns() + sim_interval(sim) : -1;
+}
+
+void regsim_set_rate(regBackend *b, double rate)
+{
+    regSim *sim = (regSim *) b->priv;
+
+    pthread_mutex_lock(&sim->lock);
+    sim->rate = rate;
+    sim_restart(sim);
+    pthread_mutex_unlock(&sim->lock);
+}
+
+void regsim_set_burst(regBackend *b, int burst)
+{
+    regSim *sim = (regSim *) b->priv;
+
+    pthread_mutex_lock(&sim->lock);
+    sim->burst = burst < 1 ? 1 : burst;
+    sim_restart(sim);
+    pthread_mutex_unlock(&sim->lock);
+}
+
+void regsim_counts(regBackend *b, uint64_t *triggers, uint64_t *lost)
+{
+    regSim *sim = (regSim *) b->priv;
+
+    pthread_mutex_lock(&sim->lock);
+    sim_advance(sim);
+    *triggers = sim->triggers;
+    *lost = sim->lost;
+    pthread_mutex_unlock(&sim->lock);
+}
+
+uint64_t regsim_shift_latched(regBackend *b, int reg)
+{
+    regSim *sim = (regSim *) b->priv;
+    uint64_t value;
+
+    pthread_mutex_lock(&sim->lock);
+    value = sim->shift_latched[reg % SIM_SHIFT_REGS];
+    pthread_mutex_unlock(&sim->lock);
+
+    return value;
+}
+
+#ifdef REGSIM_BENCH_MAIN
+#include <stdio.h>
+
+/* Drains the model's FIFO through the registers the same way fifoDrain()
+ * does, at a range of trigger rates, and reports how many records per
+ * second get through and how many are lost. Build with:
+ *
+ *     gcc -O2 -DREGSIM_BENCH_MAIN regsim.c -lm -lpthread -o regsim-bench
+ */
+
+#define BENCH_SECONDS 1
+#define BENCH_MAX 1000
+
+#define FIFO(n) SIM_REG(FIFOREADOUT_BASEADDR, n)
+
+static void bench(double rate, int burst)
+{
+    regBackend *b = regsim_create(rate, burst);
+    long long start = now_ns(), end = start + BENCH_SECONDS*1000000000LL;
+    uint64_t records = 0, accesses = 0, triggers, lost;
+    uint32_t gtid, last = 0, gaps = 0;
+    uint32_t n, i;
+
+    while (now_ns() < end) {
+        n = b->read(b, FIFO(3));
+        accesses++;
+        if (n > BENCH_MAX) n = BENCH_MAX;
+
+        for (i = 0; i < n; i++) {
+            b->write(b, FIFO(0), 1);
+            b->read(b, FIFO(1));
+            gtid = b->read(b, FIFO(2));
+            b->write(b, FIFO(0), 0);
+            accesses += 4;
+
+            if (records && gtid != ((last + 1) & GTID_MASK)) gaps++;
+            last = gtid;
+            records++;
+        }
+    }
+
+    regsim_counts(b, &triggers, &lost);
+    printf("rate %9.0f Hz burst %4d: %9.0f records/s, %llu triggers, "
+           "%llu lost, %u gaps, %.0f ns/access\n",
+           rate, burst, (double) records/BENCH_SECONDS,
+           (unsigned long long) triggers, (unsigned long long) lost, gaps,
+           (double) BENCH_SECONDS*1e9/accesses);
+
+    regsim_free(b);
+}
+
+int main(void)
+{
+    bench(1000, 1);
+    bench(100000, 1);
+    bench(1000000, 1);
+    bench(100000, 100);
+    bench(10000000, 1);
+
+    return 0;
+}
+#endif
@@ -0,0 +1,32 @@
+#ifndef REGSIM_H
+#define REGSIM_H
+
+#include <stdint.h>
+
+/* A register backend stands in for the hardware behind the AXI register
+ * window. When one is set, every register read and write goes through it
+ * instead of through the /dev/mem mapping. Offsets are in bytes from the
+ * start of the window (AXI_BASEADDR). */
+typedef struct regBackend {
+    uint32_t (*read)(struct regBackend *b, uint32_t offset);
+    void (*write)(struct regBackend *b, uint32_t offset, uint32_t value);
+    void (*free)(struct regBackend *b);
+    void *priv;
+} regBackend;
+
+/* Software model of TUBii's registers, see regsim.c. Triggers arrive as a
+ * Poisson process at `rate` Hz, in bursts of `burst` triggers if burst is
+ * more than 1. */
+regBackend *regsim_create(double rate, int burst);
+void regsim_free(regBackend *b);
+
+void regsim_set_rate(regBackend *b, double rate);
+void regsim_set_burst(regBackend *b, int burst);
+
+/* Triggers generated, and triggers lost because the FIFO was full */
+void regsim_counts(regBackend *b, uint64_t *triggers, uint64_t *lost);
+
+/* Value latched into shift register `reg` by the last data ready */
+uint64_t regsim_shift_latched(regBackend *b, int reg);
+
+#endif
@@ -7,6 +7,8 @@
 #include <unistd.h> /* for close */
 #include "logging.h"
 #include "util.h"   /* for string2ll */
+#include "stats.h"  /* for command timing */
+#include "slowlog.h"
 #include <string.h> /* for strchr */
 #include <stdarg.h> /* for va_start,va_arg, etc. */
 #include <signal.h> /* for SIGHUP, SIGPIPE, etc. */
@@ -120,8 +122,8 @@ void beforeSleep(struct aeEventLoop *eventLoop) {
     UNUSED(eventLoop);
 
     /* Try to process pending commands for clients that were just unblocked. */
-    //if (listLength(server.unblocked_clients))
-        //processUnblockedClients();
+    if (listLength(server.unblocked_clients))
+        processUnblockedClients();
 }
 
 /* Initialize a set of file descriptors to listen to the specified 'port'
@@ -209,6 +211,7 @@ void initServerConfig(void) {
     server.tcpkeepalive = CONFIG_DEFAULT_TCP_KEEPALIVE;
     server.maxclients = CONFIG_DEFAULT_MAX_CLIENTS;
     server.client_max_querybuf_len = PROTO_MAX_QUERYBUF_LEN;
+    server.client_max_reply_bytes = PROTO_REPLY_MAX_BYTES;
     server.next_client_id = 1; /* Client IDs, start from 1 .*/
 }
 
@@ -224,6 +227,10 @@ void initServer(aeEventLoop *el, int port, struct command *commandTable, int num
     server.clients = listCreate();
     server.clients_to_close = listCreate();
     server.unblocked_clients = listCreate();
+    server.reply_pool = listCreate();
+    server.exec_begin = NULL;
+    server.exec_end = NULL;
+    slowlogInit();
     server.port = port;
 
     /* Open the TCP listening socket for the user commands. */
@@ -263,12 +270,198 @@ void initServer(aeEventLoop *el, int port, struct command *commandTable, int num
             }
     }
 
-    /* Command table -- we initiialize it here as it is part of the
-     * initial configuration, since command names may be changed via
-     * redis.conf using the rename-command directive. */
+    populateCommandTable(commandTable, numcommands);
+}
+
+/* ====================== Commands lookup and execution ===================== */
+
+/* The commands are looked up through a perfect hash over the command table,
+ * built once at startup since the table never changes afterwards.
+ *
+ * A name is read four bytes at a time, lower cased a word at a time and
+ * hashed in the same pass. One mix of the hash picks a bucket, and every
+ * bucket has a displacement which was chosen so that a second mix of the
+ * hash and the displacement puts each name in a slot of its own. The folded
+ * words are then compared with the ones stored for that slot. A lookup
+ * allocates nothing.
+ *
+ * The dict is still used by the stats commands to iterate over the
+ * commands, and for lookups if the hash can't be built. */
+#define CMDHASH_MAX_DISP (1<<16)
+#define CMDHASH_MAX_WORDS 16 /* longest command name, in 4 byte words */
+
+static struct {
+    uint32_t mask;          /* number of slots - 1 */
+    uint32_t nbuckets;
+    uint32_t *disp;         /* displacement of each bucket */
+    uint32_t *hash;         /* hash of the name in each slot */
+    size_t *len;            /* length of the name in each slot */
+    uint32_t **words;       /* lower case name in each slot, zero padded */
+    struct command **slot;
+} cmdhash;
+
+/* Lower case the ASCII letters in a word: bytes from 'A' to 'Z' get bit 5
+ * set, everything else is left alone. */
+static inline uint32_t cmdhashFold(uint32_t w) {
+    uint32_t ascii = ~w & 0x80808080u;
+    uint32_t low7 = w & 0x7f7f7f7fu;
+    uint32_t ge_a = (low7 + 0x3f3f3f3fu) & 0x80808080u;  /* >= 'A' */
+    uint32_t gt_z = (low7 + 0x25252525u) & 0x80808080u;  /* > 'Z' */
+
+    return w | ((ascii & ge_a & ~gt_z) >> 2);
+}
+
+/* Hash the name, leaving its folded words in words[]. Returns 0 if it's
+ * too long to be a command, which no command hashes to. */
+static uint32_t cmdhashName(const char *s, size_t len, uint32_t *words) {
+    uint32_t h = 0x811c9dc5u ^ len;
+    size_t j, n = len/4;
+    uint32_t w;
+
+    if (len > CMDHASH_MAX_WORDS*4) return 0;
+    for (j = 0; j < n; j++) {
+        memcpy(&w,s+j*4,4);
+        words[j] = cmdhashFold(w);
+        h = (h ^ words[j])*0x9e3779b1u;
+        h ^= h >> 15;
+    }
+    if (len & 3) {
+        /* The last few bytes, zero padded. Take them from the end of the last
+         * four bytes rather than a byte at a time. */
+        if (len >= 4) {
+            memcpy(&w,s+len-4,4);
+            w >>= 8*(4-(len & 3));
+        } else {
+            unsigned char tail[4] = {0};
+            memcpy(tail,s,len);
+            memcpy(&w,tail,4);
+        }
+        words[n] = cmdhashFold(w);
+        h = (h ^ words[n])*0x9e3779b1u;
+        h ^= h >> 15;
+    }
+    return h ? h : 1;
+}
+
+/* murmur3 finaliser */
+static uint32_t cmdhashMix(uint32_t x) {
+    x ^= x >> 16;
+    x *= 0x85ebca6b;
+    x ^= x >> 13;
+    x *= 0xc2b2ae35;
+    x ^= x >> 16;
+    return x;
+}
+
+static uint32_t cmdhashSlot(uint32_t h, uint32_t disp) {
+    return cmdhashMix(h ^ disp) & cmdhash.mask;
+}
+
+static uint32_t cmdhashBucket(uint32_t h) {
+    /* Fibonacci hash scaled to [0, nbuckets) without a division */
+    return ((uint64_t)(h*0x9e3779b9u)*cmdhash.nbuckets) >> 32;
+}
+
+static int *cmdhash_bucket_size;
+
+static int cmdhashCompareBuckets(const void *a, const void *b) {
+    return cmdhash_bucket_size[*(const int*)b] -
+           cmdhash_bucket_size[*(const int*)a];
+}
+
+/* Find a displacement for every bucket, biggest first. Returns C_ERR if
+ * some bucket can't be placed, which only happens if two names hash the
+ * same or a name is too long. */
+static int buildCommandHash(struct command *commandTable, int numcommands) {
+    uint32_t *h = malloc(sizeof(*h)*numcommands);
+    uint32_t *slots = malloc(sizeof(*slots)*numcommands);
+    uint32_t words[CMDHASH_MAX_WORDS];
+    int *order, *keys;
+    uint32_t size = 1;
+    uint32_t b, d;
+    int i, j, k, n, ret = C_OK;
+
+    while (size < 2*(uint32_t)numcommands) size <<= 1;
+    cmdhash.mask = size-1;
+    cmdhash.nbuckets = numcommands/2+1;
+    cmdhash.disp = calloc(cmdhash.nbuckets,sizeof(uint32_t));
+    cmdhash.hash = calloc(size,sizeof(uint32_t));
+    cmdhash.len = calloc(size,sizeof(size_t));
+    cmdhash.words = calloc(size,sizeof(uint32_t *));
+    cmdhash.slot = calloc(size,sizeof(struct command *));
+
+    cmdhash_bucket_size = calloc(cmdhash.nbuckets,sizeof(int));
+    order = malloc(sizeof(int)*cmdhash.nbuckets);
+    keys = malloc(sizeof(int)*numcommands);
+    for (i = 0; i < numcommands; i++) {
+        char *name = commandTable[i].name;
+
+        if ((h[i] = cmdhashName(name,strlen(name),words)) == 0) {
+            ret = C_ERR;
+            goto done;
+        }
+        cmdhash_bucket_size[cmdhashBucket(h[i])]++;
+    }
+    for (b = 0; b < cmdhash.nbuckets; b++) order[b] = b;
+    qsort(order,cmdhash.nbuckets,sizeof(int),cmdhashCompareBuckets);
+
+    for (i = 0; i < (int)cmdhash.nbuckets && cmdhash_bucket_size[order[i]]; i++) {
+        b = order[i];
+        for (n = 0, j = 0; j < numcommands; j++)
+            if (cmdhashBucket(h[j]) == b) keys[n++] = j;
+
+        for (d = 0; d < CMDHASH_MAX_DISP; d++) {
+            for (j = 0; j < n; j++) {
+                slots[j] = cmdhashSlot(h[keys[j]],d);
+                if (cmdhash.slot[slots[j]]) break;
+                for (k = 0; k < j; k++)
+                    if (slots[k] == slots[j]) break;
+                if (k < j) break;
+            }
+            if (j == n) break;
+        }
+        if (d == CMDHASH_MAX_DISP) {
+            ret = C_ERR;
+            goto done;
+        }
+
+        cmdhash.disp[b] = d;
+        for (j = 0; j < n; j++) {
+            char *name = commandTable[keys[j]].name;
+            uint32_t *w = calloc(CMDHASH_MAX_WORDS,sizeof(uint32_t));
+
+            cmdhashName(name,strlen(name),w);
+            cmdhash.slot[slots[j]] = commandTable+keys[j];
+            cmdhash.hash[slots[j]] = h[keys[j]];
+            cmdhash.len[slots[j]] = strlen(name);
+            cmdhash.words[slots[j]] = w;
+        }
+    }
+
+done:
+    if (ret != C_OK) {
+        for (b = 0; b < size; b++) free(cmdhash.words[b]);
+        free(cmdhash.disp);
+        free(cmdhash.hash);
+        free(cmdhash.len);
+        free(cmdhash.words);
+        free(cmdhash.slot);
+        cmdhash.slot = NULL;
+    }
+
+    free(h);
+    free(slots);
+    free(order);
+    free(keys);
+    free(cmdhash_bucket_size);
+    return ret;
+}
+
+void populateCommandTable(struct command *commandTable, int numcommands) {
+    int j;
+
     server.commands = dictCreate(&commandTableDictType,NULL);
 
-    /* populate command table */
     for (j = 0; j < numcommands; j++) {
         struct command *c = commandTable+j;
         int retval;
@@ -276,21 +469,42 @@ void initServer(aeEventLoop *el, int port, struct command *commandTable, int num
         retval = dictAdd(server.commands, sdsnew(c->name), c);
         serverAssert(retval == DICT_OK);
     }
+
+    if (buildCommandHash(commandTable, numcommands) != C_OK)
+        Log(WARNING, "Unable to build the command hash, using the dict");
 }
 
-/* ====================== Commands lookup and execution ===================== */
+struct command *lookupCommandLen(const char *name, size_t len) {
+    uint32_t words[CMDHASH_MAX_WORDS];
+    uint32_t h, slot, *stored;
+    size_t j;
+
+    if (cmdhash.slot == NULL) {
+        sds s = sdsnewlen(name,len);
+        struct command *cmd = dictFetchValue(server.commands,s);
+        sdsfree(s);
+        return cmd;
+    }
+
+    if ((h = cmdhashName(name,len,words)) == 0) return NULL;
+    slot = cmdhashSlot(h,cmdhash.disp[cmdhashBucket(h)]);
+    if (cmdhash.slot[slot] == NULL || cmdhash.hash[slot] != h ||
+        cmdhash.len[slot] != len) return NULL;
+
+    /* The hash matches, so this is almost certainly it. Check anyway. */
+    stored = cmdhash.words[slot];
+    for (j = 0; j < (len+3)/4; j++)
+        if (stored[j] != words[j]) return NULL;
+
+    return cmdhash.slot[slot];
+}
 
 struct command *lookupCommand(sds name) {
-    return dictFetchValue(server.commands, name);
+    return lookupCommandLen(name, sdslen(name));
 }
 
 struct command *lookupCommandByCString(char *s) {
-    struct command *cmd;
-    sds name = sdsnew(s);
-
-    cmd = dictFetchValue(server.commands, name);
-    sdsfree(name);
-    return cmd;
+    return lookupCommandLen(s, strlen(s));
 }
 
 /* If this function gets called we already read a whole
@@ -316,19 +530,110 @@ int processCommand(client *c) {
      * such as wrong arity, bad command name and so forth. */
     c->cmd = c->lastcmd = lookupCommand(c->argv[0]);
     if (!c->cmd) {
+        flagTransaction(c);
         addReplyErrorFormat(c,"unknown command '%s'",
             (char*)c->argv[0]);
         return C_OK;
     } else if ((c->cmd->arity > 0 && c->cmd->arity != c->argc) ||
                (c->argc < -c->cmd->arity)) {
+        flagTransaction(c);
         addReplyErrorFormat(c,"wrong number of arguments for '%s' command",
             c->cmd->name);
         return C_OK;
     }
 
     /* Exec the command */
-    c->cmd->func(c, c->argc, c->argv);
+    if (c->flags & CLIENT_MULTI &&
+        c->cmd->func != execCommand && c->cmd->func != discardCommand &&
+        c->cmd->func != multiCommand)
+    {
+        queueMultiCommand(c);
+    } else {
+        call(c);
+    }
 
     return C_OK;
 }
 
+/* Call() is the core of the execution of a command, timing it for the
+ * command stats and the slow log. */
+void call(client *c) {
+    struct command *cmd = c->cmd;
+    long long start = stat_time();
+    cmd->func(c, c->argc, c->argv);
+    long long duration = stat_time() - start;
+    if (!cmd->latency) cmd->latency = calloc(1, sizeof(histogram));
+    hist_record(cmd->latency, duration);
+    slowlogPushEntryIfNeeded(c->argv, c->argc, duration);
+}
+
+
+#ifdef SERVER_BENCH_MAIN
+#include <stdio.h>
+
+/* Micro-benchmark of the command lookup, comparing the perfect hash with
+ * the case insensitive dict it replaced, over the names in the TUBii
+ * command table. tubii-server.c leaves out its main() when built with
+ * SERVER_BENCH_MAIN, so build it with everything else:
+ *
+ *     gcc -O2 -fcommon -I. -DSERVER_BENCH_MAIN $(ls *.c | grep -v ae_epoll.c) \\
+ *         -lpq -lpthread -lm -o server-bench
+ */
+
+#define BENCH_LOOKUPS 2000000
+#define BENCH_ROUNDS 5
+
+extern struct command commandTable[];
+extern int numcommands;
+
+int main(void) {
+    int n = numcommands;
+    sds *names = malloc(sizeof(sds)*n);
+    long long start, t, t_dict, t_hash;
+    int i, j, round, found = 0;
+
+    for (i = 0; i < n; i++) {
+        /* Mixed case, like a client might send. */
+        names[i] = sdsnew(commandTable[i].name);
+        if (i % 2) sdstoupper(names[i]);
+    }
+    populateCommandTable(commandTable,n);
+
+    for (i = 0; i < n; i++) {
+        sds longer = sdscat(sdsdup(names[i]),"x");
+        sds shorter = sdsnewlen(names[i],sdslen(names[i])-1);
+
+        if (lookupCommand(names[i]) != dictFetchValue(server.commands,names[i]) ||
+            lookupCommand(longer) || lookupCommand(shorter)) {
+            printf("lookupCommand() doesn't match the dict for '%s'!\n",
+                   names[i]);
+            return 1;
+        }
+        sdsfree(longer);
+        sdsfree(shorter);
+    }
+
+    /* Best of a few interleaved rounds, the timings are noisy otherwise. */
+    t_dict = t_hash = -1;
+    for (round = 0; round < BENCH_ROUNDS; round++) {
+        start = ustime();
+        for (i = 0, j = 0; i < BENCH_LOOKUPS; i++, j = j+1 == n ? 0 : j+1)
+            found += dictFetchValue(server.commands,names[j]) != NULL;
+        t = ustime()-start;
+        if (t_dict < 0 || t < t_dict) t_dict = t;
+
+        start = ustime();
+        for (i = 0, j = 0; i < BENCH_LOOKUPS; i++, j = j+1 == n ? 0 : j+1)
+            found += lookupCommand(names[j]) != NULL;
+        t = ustime()-start;
+        if (t_hash < 0 || t < t_hash) t_hash = t;
+    }
+
+    printf("%d lookups over %d commands (%d found)\n",
+           BENCH_LOOKUPS, n, found/BENCH_ROUNDS/2);
+    printf("dict:         %.2f ns/lookup\n", t_dict*1000.0/BENCH_LOOKUPS);
+    printf("perfect hash: %.2f ns/lookup\n", t_hash*1000.0/BENCH_LOOKUPS);
+
+    return 0;
+}
+#endif
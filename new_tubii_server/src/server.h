@@ -32,9 +32,14 @@ typedef long long mstime_t; /* millisecond time type. */
 #define PROTO_MAX_QUERYBUF_LEN  (1024*1024*1024) /* 1GB max query buffer. */
 #define PROTO_IOBUF_LEN         (1024*16)  /* Generic I/O buffer size */
 #define PROTO_REPLY_CHUNK_BYTES (16*1024) /* 16k output buffer */
+#define PROTO_REPLY_POOL_MAX    64         /* Free reply chunks kept around */
+#define PROTO_REPLY_MAX_BYTES   (32*1024*1024) /* Close clients above this */
+#define NET_MAX_WRITES_PER_EVENT (1024*64)
+#define NET_MAX_IOV             64         /* Reply chunks per writev() */
 #define PROTO_INLINE_MAX_SIZE   (1024*64) /* Max size of inline reads */
 #define PROTO_MBULK_BIG_ARG     (1024*32)
 #define LONG_STR_SIZE      21          /* Bytes needed for long -> str */
+#define MAX_D2STRING_CHARS 128         /* Bytes needed for double -> str */
 #define AOF_AUTOSYNC_BYTES (1024*1024*32) /* fdatasync every 32MB */
 
 /* Client flags */
@@ -60,6 +65,7 @@ typedef long long mstime_t; /* millisecond time type. */
 #define CLIENT_PUBSUB (1<<18)      /* Client is in Pub/Sub mode. */
 #define CLIENT_PREVENT_PROP (1<<19)  /* Don't propagate to AOF / Slaves. */
 #define CLIENT_SUBSCRIBE (1<<20)  /* Client is sent all log messages. */
+#define CLIENT_IN_EXEC (1<<21)    /* Replies are collected for EXEC. */
 
 /* Client block type (btype field in client structure)
  * if CLIENT_BLOCKED flag is set. */
@@ -106,6 +112,25 @@ typedef struct blockingState {
  * while a blocking operation is in progress. */
 typedef void blockingFreeProc(void *data);
 
+/* Replies which don't fit in the client buffer go to a list of these. */
+typedef struct clientReplyBlock {
+    size_t size, used;
+    char buf[];
+} clientReplyBlock;
+
+/* Client MULTI/EXEC state */
+typedef struct multiCmd {
+    sds *argv;
+    int argc;
+    struct command *cmd;
+} multiCmd;
+
+typedef struct multiState {
+    multiCmd *commands;     /* Array of MULTI commands */
+    int count;              /* Total number of MULTI commands */
+    sds reply;              /* EXEC reply, held until the batch is applied */
+} multiState;
+
 typedef struct client {
     uint64_t id;            /* Client incremental unique ID. */
     int fd;                 /* Client socket. */
@@ -128,21 +153,43 @@ typedef struct client {
     blockingState bpop;     /* blocking state */
     blockingFreeProc *bfree; /* function called if client disconnects while
                              * in a blocking command. */
+    multiState mstate;      /* MULTI/EXEC state */
+    sds capture;            /* Replies of the commands run by EXEC */
+
+    /* Pipelining stats */
+    int pipeline;           /* Commands run since the query buffer was empty */
+    int pipeline_max;       /* Deepest pipeline seen from this client */
+    long long numcommands;  /* Commands run for this client */
+    long long numblocked;   /* Times this client was blocked */
 
     /* Response buffer */
+    list *reply;            /* Reply blocks queued after buf */
+    size_t reply_bytes;     /* Total bytes of the blocks in the reply list */
     int bufpos;
     char buf[PROTO_REPLY_CHUNK_BYTES];
 } client;
 
 /* command functions should have this signature */
 typedef void command_func(client *c, int argc, sds *argv);
+/* Checks the values of a command's arguments once their types are known to
+ * be right. Returns NULL if they're fine, otherwise the error. */
+typedef const char *command_check(int argc, sds *argv);
 
 struct command {
     char *name;
     command_func *func;
     int arity;
+    char *args;         /* argument types checked when queued by MULTI, see
+                         * multi.c. NULL means anything goes. */
+    command_check *check; /* argument values checked when queued by MULTI,
+                           * or NULL */
+    struct histogram *latency; /* execution time, allocated on first call */
 };
 
+/* Hooks run around EXEC */
+typedef void execProc(client *c);
+typedef int execEndProc(client *c, int failed);
+
 struct redisServer {
     /* General */
     int hz;                     /* serverCron() calls frequency in hertz */
@@ -172,11 +219,19 @@ struct redisServer {
     int verbosity;                  /* Loglevel in redis.conf */
     int tcpkeepalive;               /* Set SO_KEEPALIVE if non-zero. */
     size_t client_max_querybuf_len; /* Limit for client query buffer length */
+    size_t client_max_reply_bytes;  /* Limit for a client's pending reply */
     /* Limits */
     unsigned int maxclients;            /* Max number of simultaneous clients */
     /* Blocked clients */
     unsigned int bpop_blocked_clients; /* Number of clients blocked by lists */
     list *unblocked_clients; /* list of clients to unblock before next loop */
+    list *reply_pool;        /* Free PROTO_REPLY_CHUNK_BYTES reply blocks */
+    /* MULTI/EXEC */
+    execProc *exec_begin;   /* Called before EXEC runs the queued commands */
+    execEndProc *exec_end;  /* Called after, with failed set if a command
+                             * failed and the rest weren't run. Returns 1 if
+                             * it will send the reply itself with
+                             * execReply() */
     /* time cache */
     time_t unixtime;        /* Unix time sampled every cron cycle. */
     long long mstime;       /* Like 'unixtime' but with milliseconds resolution. */
@@ -196,6 +251,7 @@ mstime_t mstime(void);
 client *createClient(int fd);
 int prepareClientToWrite(client *c);
 int _addReplyToBuffer(client *c, const char *s, size_t len);
+void _addReplyToList(client *c, const char *s, size_t len);
 void addReplySds(client *c, sds s);
 void addReplyString(client *c, const char *s, size_t len);
 void addReply(client *c, const char *fmt, ...);
@@ -207,6 +263,7 @@ void addReplyStatus(client *c, const char *status);
 void addReplyStatusFormat(client *c, const char *fmt, ...);
 void addReplyDouble(client *c, double d);
 void addReplyLongLong(client *c, long long ll);
+void addReplyMultiBulkLen(client *c, long length);
 void addReplyBulkCBuffer(client *c, const void *p, size_t len);
 void addReplyBulkCString(client *c, const char *s);
 void acceptTcpHandler(aeEventLoop *el, int fd, void *privdata, int mask);
@@ -221,13 +278,28 @@ void processInputBuffer(client *c);
 void readQueryFromClient(aeEventLoop *el, int fd, void *privdata, int mask);
 sds catClientInfoString(sds s, client *client);
 sds getAllClientsInfoString(void);
+void ClientList(client *c, int argc, sds *argv);
 void updateCachedTime(void);
 int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientData);
 int listenToPort(int port, int *fds, int *count);
 void resetServerStats(void);
 void initServerConfig(void);
 void initServer(aeEventLoop *el, int port, struct command *commandTable, int numcommands);
+void populateCommandTable(struct command *commandTable, int numcommands);
+struct command *lookupCommandLen(const char *name, size_t len);
 struct command *lookupCommand(sds name);
 struct command *lookupCommandByCString(char *s);
 int processCommand(client *c);
+void call(client *c);
+
+/* MULTI/EXEC */
+void initClientMultiState(client *c);
+void freeClientMultiState(client *c);
+void queueMultiCommand(client *c);
+void discardTransaction(client *c);
+void flagTransaction(client *c);
+void execReply(client *c);
+void multiCommand(client *c, int argc, sds *argv);
+void execCommand(client *c, int argc, sds *argv);
+void discardCommand(client *c, int argc, sds *argv);
 #endif
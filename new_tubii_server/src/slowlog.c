@@ -0,0 +1,171 @@
+#include "slowlog.h"
+#include <string.h>
+#include "adlist.h"
+#include "util.h"
+#include "stats.h"
+
+static list *slowlog;
+static long long slowlog_entry_id = 0;
+static long long slowlog_threshold = SLOWLOG_DEFAULT_THRESHOLD;
+
+static slowlogEntry *slowlogCreateEntry(sds *argv, int argc, long long duration)
+{
+    slowlogEntry *se = malloc(sizeof(*se));
+    int j, slargc = argc;
+
+    if (slargc > SLOWLOG_ENTRY_MAX_ARGC) slargc = SLOWLOG_ENTRY_MAX_ARGC;
+    se->argc = slargc;
+    se->argv = malloc(sizeof(sds)*slargc);
+
+    for (j = 0; j < slargc; j++) {
+        /* Logging too many arguments is a useless memory waste, so we
+         * note how many were left out in the last argument. */
+        if (slargc != argc && j == slargc-1) {
+            se->argv[j] = sdscatprintf(sdsempty(),"... (%d more arguments)",
+                argc-slargc+1);
+        } else if (sdslen(argv[j]) > SLOWLOG_ENTRY_MAX_STRING) {
+            se->argv[j] = sdsnewlen(argv[j], SLOWLOG_ENTRY_MAX_STRING);
+            se->argv[j] = sdscatprintf(se->argv[j],"... (%lu more bytes)",
+                (unsigned long) sdslen(argv[j]) - SLOWLOG_ENTRY_MAX_STRING);
+        } else {
+            se->argv[j] = sdsdup(argv[j]);
+        }
+    }
+
+    se->time = time(NULL);
+    se->duration = duration;
+    se->id = slowlog_entry_id++;
+
+    return se;
+}
+
+static void slowlogFreeEntry(void *septr)
+{
+    slowlogEntry *se = septr;
+    int j;
+
+    for (j = 0; j < se->argc; j++) sdsfree(se->argv[j]);
+    free(se->argv);
+    free(se);
+}
+
+void slowlogInit(void)
+{
+    slowlog = listCreate();
+    listSetFreeMethod(slowlog, slowlogFreeEntry);
+}
+
+void slowlogPushEntryIfNeeded(sds *argv, int argc, long long duration)
+{
+    if (slowlog_threshold < 0) return; /* slowlog disabled */
+
+    if (duration >= slowlog_threshold)
+        listAddNodeHead(slowlog, slowlogCreateEntry(argv, argc, duration));
+
+    /* Remove old entries if needed. */
+    while (listLength(slowlog) > SLOWLOG_MAX_LEN)
+        listDelNode(slowlog, listLast(slowlog));
+}
+
+void SlowlogGet(client *c, int argc, sds *argv)
+{
+    /* slowlogGet [count]
+     *
+     * Replies with the `count` (default 10) most recent entries as
+     * [id, unix time, duration (us), [arguments...]]. */
+    long long count = 10;
+    listIter li;
+    listNode *ln;
+    slowlogEntry *se;
+    int j;
+
+    if (argc == 2 && (string2ll(argv[1], sdslen(argv[1]), &count) == 0 || count < 0)) {
+        addReplyErrorFormat(c, "'%s' is not a valid count", argv[1]);
+        return;
+    } else if (argc > 2) {
+        addReplyError(c, "wrong number of arguments for 'slowlogGet' command");
+        return;
+    }
+
+    if (count > listLength(slowlog)) count = listLength(slowlog);
+
+    addReplyMultiBulkLen(c, count);
+
+    listRewind(slowlog, &li);
+    while (count-- && (ln = listNext(&li))) {
+        se = ln->value;
+        addReplyMultiBulkLen(c, 4);
+        addReplyLongLong(c, se->id);
+        addReplyLongLong(c, se->time);
+        addReplyLongLong(c, se->duration);
+        addReplyMultiBulkLen(c, se->argc);
+        for (j = 0; j < se->argc; j++)
+            addReplyBulkCBuffer(c, se->argv[j], sdslen(se->argv[j]));
+    }
+}
+
+void SlowlogLen(client *c, int argc, sds *argv)
+{
+    addReplyLongLong(c, listLength(slowlog));
+}
+
+void SlowlogReset(client *c, int argc, sds *argv)
+{
+    while (listLength(slowlog) > 0) listDelNode(slowlog, listLast(slowlog));
+    addReplyStatus(c, "+OK");
+}
+
+const char *CheckSlowlogThreshold(int argc, sds *argv)
+{
+    /* Argument check for MULTI, see multi.c. */
+    long long threshold;
+
+    if (string2ll(argv[1], sdslen(argv[1]), &threshold) == 0)
+        return "not a valid threshold";
+
+    return NULL;
+}
+
+void SetSlowlogThreshold(client *c, int argc, sds *argv)
+{
+    /* setSlowlogThreshold <us>
+     *
+     * Commands which take at least this many microseconds are logged. A
+     * negative threshold turns the slowlog off. */
+    long long threshold;
+
+    if (string2ll(argv[1], sdslen(argv[1]), &threshold) == 0) {
+        addReplyErrorFormat(c, "'%s' is not a valid threshold", argv[1]);
+        return;
+    }
+
+    slowlog_threshold = threshold;
+    addReplyStatus(c, "+OK");
+}
+
+void CommandStats(client *c, int argc, sds *argv)
+{
+    /* Replies with a bulk string with one line per command which has been
+     * run, like the commandstats section of the Redis INFO command. The
+     * counts come from the command histograms, so resetStats clears them. */
+    dictIterator *di;
+    dictEntry *de;
+    struct command *cmd;
+    histogram *h;
+    sds s = sdsempty();
+
+    di = dictGetIterator(server.commands);
+    while ((de = dictNext(di)) != NULL) {
+        cmd = dictGetVal(de);
+        if ((h = cmd->latency) == NULL || h->count == 0) continue;
+        s = sdscatprintf(s, "cmdstat_%s:calls=%llu,usec=%llu,"
+                         "usec_per_call=%.2f,usec_max=%u\r\n", cmd->name,
+                         (unsigned long long) h->count,
+                         (unsigned long long) h->sum,
+                         (double) h->sum/h->count, h->max);
+    }
+    dictReleaseIterator(di);
+
+    addReplyBulkCBuffer(c, s, sdslen(s));
+    sdsfree(s);
+}
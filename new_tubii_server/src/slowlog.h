@@ -0,0 +1,35 @@
+#ifndef SLOWLOG_H
+#define SLOWLOG_H
+
+#include "server.h"
+
+/* Slow command log, like the Redis SLOWLOG.
+ *
+ * Every command which takes longer than the threshold is added to the head
+ * of a list, along with its arguments, and the oldest entry is dropped once
+ * there are SLOWLOG_MAX_LEN of them. */
+
+#define SLOWLOG_MAX_LEN 128
+#define SLOWLOG_ENTRY_MAX_ARGC 32
+#define SLOWLOG_ENTRY_MAX_STRING 128
+#define SLOWLOG_DEFAULT_THRESHOLD 10000 /* microseconds */
+
+typedef struct slowlogEntry {
+    sds *argv;
+    int argc;
+    long long id;       /* unique entry identifier */
+    long long duration; /* time spent executing the command (us) */
+    time_t time;        /* unix time at which the command was executed */
+} slowlogEntry;
+
+void slowlogInit(void);
+void slowlogPushEntryIfNeeded(sds *argv, int argc, long long duration);
+
+void SlowlogGet(client *c, int argc, sds *argv);
+void SlowlogLen(client *c, int argc, sds *argv);
+void SlowlogReset(client *c, int argc, sds *argv);
+const char *CheckSlowlogThreshold(int argc, sds *argv);
+void SetSlowlogThreshold(client *c, int argc, sds *argv);
+void CommandStats(client *c, int argc, sds *argv);
+
+#endif
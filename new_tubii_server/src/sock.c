@@ -7,6 +7,7 @@
 #include <errno.h>
 #include "anet.h"
 #include "record_info.h"
+#include "stats.h"
 #include <arpa/inet.h>
 
 CircularBuffer *cb_init(int size)
@@ -94,6 +95,47 @@ int sock_append_record(Sock *s, struct GenericRecordHeader *header,
     return 0;
 }
 
+void *sock_reserve_record(Sock *s, int len)
+{
+    /* Reserve room for a record header plus `len` bytes of record in one
+     * contiguous block at the tail of the send buffer so that the caller
+     * can build the record in place. Returns a pointer to where the record
+     * (not the header) should be written, or NULL if there isn't enough
+     * contiguous room, in which case the caller should build the record
+     * elsewhere and use sock_append_record().
+     *
+     * Nothing is added to the buffer until sock_commit_record() is called,
+     * and only one record may be reserved at a time. */
+    int total = sizeof(struct GenericRecordHeader) + len;
+
+    if (total > CB_SPACE(s->sendbuf)) {
+        sprintf(sock_err, "buffer is full");
+        return NULL;
+    }
+
+    if (total > CB_SPACE_TO_END(s->sendbuf)) {
+        sprintf(sock_err, "no contiguous room in send buffer");
+        return NULL;
+    }
+
+    return s->sendbuf->buf + s->sendbuf->tail + sizeof(struct GenericRecordHeader);
+}
+
+void sock_commit_record(Sock *s, uint32_t type, int len)
+{
+    /* Fill in the header of a record reserved with sock_reserve_record()
+     * and add it to the send buffer. `len` is the number of bytes of the
+     * record actually written and must be no more than was reserved. */
+    struct GenericRecordHeader *header;
+
+    header = (struct GenericRecordHeader *) (s->sendbuf->buf + s->sendbuf->tail);
+    header->RecordID = htonl(type);
+    header->RecordLength = htonl(len);
+    header->RecordVersion = htonl(RECORD_VERSION);
+
+    s->sendbuf->tail = MOD(s->sendbuf->tail + (int) sizeof(struct GenericRecordHeader) + len, s->sendbuf->size);
+}
+
 char *sock_read_record(Sock *s, struct GenericRecordHeader *header)
 {
     /* If there is a full record in the buffer, copy the header and return
@@ -156,7 +198,8 @@ int sock_read(Sock *s)
     
 int sock_write(Sock *s)
 {
-    int bytes, sent;
+    int bytes, sent, total = 0;
+    long long start = stat_time();
 
     while (1) {
         if ((bytes = CB_BYTES_TO_END(s->sendbuf)) == 0) break;
@@ -174,11 +217,15 @@ int sock_write(Sock *s)
         }
 
         s->sendbuf->head += sent;
+        total += sent;
 
         if (s->sendbuf->head == s->sendbuf->size) s->sendbuf->head = 0;
     }
 
     if (s->sendbuf->head == s->sendbuf->tail) s->sendbuf->head = s->sendbuf->tail = 0;
 
+    hist_record(&stat_sock_write, stat_time() - start);
+    hist_record(&stat_sock_bytes, total);
+
     return 0;
 }
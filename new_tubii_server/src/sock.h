@@ -43,5 +43,7 @@ int sock_read(Sock *s);
 char *sock_read_record(Sock *s, struct GenericRecordHeader *header);
 int sock_append_record(Sock *s, struct GenericRecordHeader *header,
                        void *record);
+void *sock_reserve_record(Sock *s, int len);
+void sock_commit_record(Sock *s, uint32_t type, int len);
 
 #endif
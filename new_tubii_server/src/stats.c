@@ -0,0 +1,233 @@
+#include "stats.h"
+#include <string.h>
+#include <arpa/inet.h>
+#include "data.h"
+#include "logging.h"
+#include "record_info.h"
+#include "util.h"
+
+histogram stat_readout;
+histogram stat_readout_events;
+histogram stat_sock_write;
+histogram stat_sock_bytes;
+histogram stat_db_rtt;
+histogram stat_pipeline;
+
+static struct {
+    const char *name;
+    histogram *h;
+} hot_paths[] = {
+    {"readout_us", &stat_readout},
+    {"readout_events", &stat_readout_events},
+    {"sock_write_us", &stat_sock_write},
+    {"sock_write_bytes", &stat_sock_bytes},
+    {"db_rtt_us", &stat_db_rtt},
+    {"pipeline_depth", &stat_pipeline},
+};
+
+#define NUM_HOT_PATHS (sizeof(hot_paths)/sizeof(hot_paths[0]))
+
+/* id of the time event sending the TUBII_STATS record, or AE_ERR */
+static long long stats_record_id = AE_ERR;
+static int stats_interval = 0;
+
+static int hist_bin(uint32_t value)
+{
+    int msb;
+
+    if (value < HIST_SUB_BINS) return value;
+
+    msb = 31 - __builtin_clz(value);
+
+    return HIST_SUB_BINS + (msb - HIST_SUB_BITS)*HIST_SUB_BINS +
+           ((value >> (msb - HIST_SUB_BITS)) & (HIST_SUB_BINS - 1));
+}
+
+static uint32_t hist_bin_max(int bin)
+{
+    /* Returns the largest value which falls in `bin`. */
+    int shift;
+
+    if (bin < HIST_SUB_BINS) return bin;
+
+    shift = (bin - HIST_SUB_BINS)/HIST_SUB_BINS;
+
+    return (((uint64_t) (HIST_SUB_BINS + bin % HIST_SUB_BINS) + 1) << shift) - 1;
+}
+
+void hist_record(histogram *h, uint64_t value)
+{
+    uint32_t v = value > UINT32_MAX ? UINT32_MAX : value;
+
+    if (h->count == 0 || v < h->min) h->min = v;
+    if (v > h->max) h->max = v;
+
+    h->count++;
+    h->sum += v;
+    h->bins[hist_bin(v)]++;
+}
+
+uint32_t hist_percentile(histogram *h, double p)
+{
+    /* Returns the value below which a fraction `p` of the recorded values
+     * fall, to within the resolution of the bins. */
+    uint64_t rank, seen = 0;
+    int i;
+
+    if (h->count == 0) return 0;
+
+    rank = p*h->count;
+    if (rank >= h->count) return h->max;
+
+    for (i = 0; i < HIST_BINS; i++) {
+        seen += h->bins[i];
+        if (seen > rank) break;
+    }
+
+    /* the bin's upper edge can be past the largest value we've seen */
+    return hist_bin_max(i) < h->max ? hist_bin_max(i) : h->max;
+}
+
+void hist_reset(histogram *h)
+{
+    memset(h, 0, sizeof(*h));
+}
+
+sds hist_cat_summary(sds s, const char *name, histogram *h)
+{
+    return sdscatprintf(s, "%s:count=%llu,mean=%llu,min=%u,p50=%u,p90=%u,"
+                        "p99=%u,p999=%u,max=%u\r\n", name,
+                        (unsigned long long) h->count,
+                        (unsigned long long) (h->count ? h->sum/h->count : 0),
+                        h->min, hist_percentile(h, 0.5),
+                        hist_percentile(h, 0.9), hist_percentile(h, 0.99),
+                        hist_percentile(h, 0.999), h->max);
+}
+
+void StatsCommand(client *c, int argc, sds *argv)
+{
+    /* Replies with a bulk string with one line per histogram, like the
+     * Redis INFO command. Commands which have never been run are left
+     * out. */
+    dictIterator *di;
+    dictEntry *de;
+    struct command *cmd;
+    sds s = sdsempty();
+    int i;
+
+    s = sdscat(s, "# hot paths\r\n");
+    for (i = 0; i < NUM_HOT_PATHS; i++) {
+        s = hist_cat_summary(s, hot_paths[i].name, hot_paths[i].h);
+    }
+
+    s = sdscat(s, "# commands (us)\r\n");
+    di = dictGetIterator(server.commands);
+    while ((de = dictNext(di)) != NULL) {
+        cmd = dictGetVal(de);
+        if (cmd->latency == NULL || cmd->latency->count == 0) continue;
+        s = hist_cat_summary(s, cmd->name, cmd->latency);
+    }
+    dictReleaseIterator(di);
+
+    addReplyBulkCBuffer(c, s, sdslen(s));
+    sdsfree(s);
+}
+
+void ResetStats(client *c, int argc, sds *argv)
+{
+    dictIterator *di;
+    dictEntry *de;
+    struct command *cmd;
+    int i;
+
+    for (i = 0; i < NUM_HOT_PATHS; i++) hist_reset(hot_paths[i].h);
+
+    di = dictGetIterator(server.commands);
+    while ((de = dictNext(di)) != NULL) {
+        cmd = dictGetVal(de);
+        if (cmd->latency) hist_reset(cmd->latency);
+    }
+    dictReleaseIterator(di);
+
+    addReplyStatus(c, "+OK");
+}
+
+static void summarize(struct TubiiHistSummary *sum, histogram *h)
+{
+    sum->Count = htonl(h->count > UINT32_MAX ? UINT32_MAX : h->count);
+    sum->Min = htonl(h->min);
+    sum->P50 = htonl(hist_percentile(h, 0.5));
+    sum->P90 = htonl(hist_percentile(h, 0.9));
+    sum->P99 = htonl(hist_percentile(h, 0.99));
+    sum->Max = htonl(h->max);
+}
+
+static int send_stats_record(aeEventLoop *el, long long id, void *data)
+{
+    /* Sends a summary of the hot path histograms to the data stream and
+     * starts them again for the next interval. */
+    struct GenericRecordHeader header;
+    struct TubiiStatsRecord stats;
+    int i;
+
+    if (stats_interval == 0) {
+        stats_record_id = AE_ERR;
+        return AE_NOMORE;
+    }
+
+    summarize(&stats.Readout, &stat_readout);
+    summarize(&stats.ReadoutEvents, &stat_readout_events);
+    summarize(&stats.SockWrite, &stat_sock_write);
+    summarize(&stats.SockBytes, &stat_sock_bytes);
+    summarize(&stats.DBRoundTrip, &stat_db_rtt);
+
+    for (i = 0; i < NUM_HOT_PATHS; i++) hist_reset(hot_paths[i].h);
+
+    header.RecordID = htonl(TUBII_STATS);
+    header.RecordLength = htonl(sizeof(stats));
+    header.RecordVersion = htonl(RECORD_VERSION);
+
+    write_to_data_stream(&header, &stats);
+
+    return stats_interval*1000;
+}
+
+const char *CheckStatsInterval(int argc, sds *argv)
+{
+    /* Argument check for MULTI, see multi.c. */
+    long long interval;
+
+    if (string2ll(argv[1], sdslen(argv[1]), &interval) == 0 ||
+        interval < 0 || interval > 3600)
+        return "interval must be between 0 and 3600 seconds";
+
+    return NULL;
+}
+
+void SetStatsInterval(client *c, int argc, sds *argv)
+{
+    /* Set how often (in seconds) the TUBII_STATS record is sent to the data
+     * stream. 0 turns it off. Since the histograms are cleared each time the
+     * record is sent, the `stats` command then only covers the current
+     * interval. */
+    const char *err = CheckStatsInterval(argc, argv);
+    long long interval;
+
+    if (err) {
+        addReplyError(c, err);
+        return;
+    }
+
+    string2ll(argv[1], sdslen(argv[1]), &interval);
+    stats_interval = interval;
+
+    if (stats_interval && stats_record_id == AE_ERR) {
+        if ((stats_record_id = aeCreateTimeEvent(server.el, stats_interval*1000,
+                send_stats_record, NULL, NULL)) == AE_ERR) {
+            addReplyError(c, "failed to set up stats record event");
+            return;
+        }
+    }
+
+    addReplyStatus(c, "+OK");
+}
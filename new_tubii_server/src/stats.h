@@ -0,0 +1,55 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+#include <time.h>
+#include "sds.h"
+#include "server.h"
+
+/* Low overhead log-linear histograms, in the style of HdrHistogram.
+ *
+ * Values below 16 each get their own bin. Above that every power of two is
+ * split into 16 linear bins, so any recorded value is known to within about
+ * 6%. Values are clamped to 2^32 - 1 (a little over an hour in
+ * microseconds). Recording a value is a count-leading-zeros and an add. */
+
+#define HIST_SUB_BITS 4
+#define HIST_SUB_BINS (1 << HIST_SUB_BITS)
+#define HIST_BINS (HIST_SUB_BINS + (32 - HIST_SUB_BITS)*HIST_SUB_BINS)
+
+typedef struct histogram {
+    uint64_t count;
+    uint64_t sum;
+    uint32_t min;
+    uint32_t max;
+    uint32_t bins[HIST_BINS];
+} histogram;
+
+/* The hot path histograms. Values are in microseconds unless noted. */
+extern histogram stat_readout;      /* one FIFO readout */
+extern histogram stat_readout_events; /* records read per readout */
+extern histogram stat_sock_write;   /* one call to sock_write() */
+extern histogram stat_sock_bytes;   /* bytes sent per call to sock_write() */
+extern histogram stat_db_rtt;       /* database query round trip */
+extern histogram stat_pipeline;     /* commands per pipelined batch (count) */
+
+static inline long long stat_time(void)
+{
+    /* monotonic time in microseconds for timing the hot paths */
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((long long) ts.tv_sec)*1000000 + ts.tv_nsec/1000;
+}
+
+void hist_record(histogram *h, uint64_t value);
+uint32_t hist_percentile(histogram *h, double p);
+void hist_reset(histogram *h);
+sds hist_cat_summary(sds s, const char *name, histogram *h);
+
+void StatsCommand(client *c, int argc, sds *argv);
+void ResetStats(client *c, int argc, sds *argv);
+const char *CheckStatsInterval(int argc, sds *argv);
+void SetStatsInterval(client *c, int argc, sds *argv);
+
+#endif
@@ -2,6 +2,10 @@
 #include "ae.h"
 #include "anet.h"
 #include "db.h"
+#include "readout.h"
+#include "readout_thread.h"
+#include "stats.h"
+#include "slowlog.h"
 #include <errno.h>
 #include <stdio.h>
 #include "data.h"
@@ -24,6 +28,13 @@ static struct config {
     char *dataserver;
     char *logfile;
     int loglevel;
+    int readout;
+    char *uio;
+    double sim_rate;
+    int sim_burst;
+    int rt_cpu;
+    int rt_prio;
+    char *journal;
 } config;
 void auto_load_config(char* file);
 
@@ -41,6 +52,19 @@ static void usage(void) {
 "  --log-server <host>   Log server hostname (default: 'minard').\n"
 "  --data-server <host>  Data server hostname (default: 'daq1').\n"
 "  --logfile <filename>  Filename for log file.\n"
+"  --readout <mode>      FIFO readout: 'poll', 'uio' or 'sim' (default: 'poll').\n"
+"  --uio <device>        UIO device for the FIFO interrupt (default: '/dev/uio0').\n"
+"  --sim-rate <Hz>       Trigger rate of the simulated FIFO or registers\n"
+"                        (default: 1000).\n"
+"  --sim-burst <n>       Simulated registers: triggers come in bursts of n\n"
+"                        (default: 1).\n"
+"  --readout-thread <cpu> Read the FIFO out from a SCHED_FIFO thread pinned\n"
+"                        to <cpu> (-1 for no pinning).\n"
+"  --readout-prio <prio> SCHED_FIFO priority of the readout thread (default: 50).\n"
+"  --registers <backing> Register window: 'devmem', 'anon' for plain memory\n"
+"                        or 'sim' for the register model (default: 'devmem').\n"
+"  --journal <filename>  Where to keep saves while the database is down\n"
+"                        (default: '/mnt/tubii.journal').\n"
 "  -v                    Increase verbosity (default: NOTICE).\\n).\n"
 "  -q                    Decrease verbosity (default: NOTICE).\\n).\n"
 "  --help                Output this help and exit.\n"
@@ -67,6 +91,30 @@ static int parseOptions(int argc, char **argv)
             config.dataserver = argv[++i];
         } else if (!strcmp(argv[i],"--logfile") && !lastarg) {
             config.logfile = argv[++i];
+        } else if (!strcmp(argv[i],"--readout") && !lastarg) {
+            config.readout = readout_mode_from_string(argv[++i]);
+            if (config.readout == -1) {
+                fprintf(stderr, "Unknown readout mode '%s'\n", argv[i]);
+                exit(1);
+            }
+        } else if (!strcmp(argv[i],"--uio") && !lastarg) {
+            config.uio = argv[++i];
+        } else if (!strcmp(argv[i],"--sim-rate") && !lastarg) {
+            config.sim_rate = atof(argv[++i]);
+        } else if (!strcmp(argv[i],"--sim-burst") && !lastarg) {
+            config.sim_burst = atoi(argv[++i]);
+        } else if (!strcmp(argv[i],"--readout-thread") && !lastarg) {
+            config.rt_cpu = atoi(argv[++i]);
+        } else if (!strcmp(argv[i],"--readout-prio") && !lastarg) {
+            config.rt_prio = atoi(argv[++i]);
+        } else if (!strcmp(argv[i],"--registers") && !lastarg) {
+            register_backing = register_backing_from_string(argv[++i]);
+            if (register_backing == -1) {
+                fprintf(stderr, "Unknown register backing '%s'\n", argv[i]);
+                exit(1);
+            }
+        } else if (!strcmp(argv[i],"--journal") && !lastarg) {
+            config.journal = argv[++i];
         } else if (!strcmp(argv[i],"--config") && !lastarg){
         	printf("%s\n", argv[++i]);
         	FILE *fp=fopen(argv[i],"r");
@@ -104,33 +152,33 @@ struct command commandTable[] = {
 		{"clockReset",   clockreset,   1},
 		{"clockStatus",  clockstatus,  1},
 		// shift registers
-		{"dataready",    dataready,    2},
-		{"loadShift",  	 loadShift,    2},
-		{"muxenable",    muxenable,    2},
-		{"muxer",   	 muxer,        2},
+		{"dataready",    dataready,    2, "u", CheckDataReady},
+		{"loadShift",  	 loadShift,    2, "!u"},
+		{"muxenable",    muxenable,    2, "u", CheckMuxEnable},
+		{"muxer",   	 muxer,        2, "u", CheckMuxer},
 		// utilities
-		{"initialise",	 initialise,   1},
+		{"initialise",	 initialise,   1, "!"},
 		{"MZHappy",      MZHappy,      1},
-		{"setMZHappyPulser", SetMZHappyPulser, 4},
+		{"setMZHappyPulser", SetMZHappyPulser, 4, "ffu", CheckPulser},
 		{"ping",         ping,         1},
 		// ellie
-		{"setGenericDelay",  	SetGenericdelay,  	2},
-		{"setGenericPulser", 	SetGenericpulser, 	4},
+		{"setGenericDelay",  	SetGenericdelay,  	2, "f"},
+		{"setGenericPulser", 	SetGenericpulser, 	4, "ffu", CheckPulser},
 		{"getGenericRate", 		GetPulserRate, 		1},
 		{"getGenericPulseWidth", GetPulserWidth, 	1},
 		{"getGenericNPulses", 	GetPulserNPulses, 	1},
 		{"getGenericDelay", 	GetDelay, 			1},
-		{"lengthenDelay", 		LengthenDelay, 		2},
-		{"setSmellieDelay", 	SetSmelliedelay, 	2},
-		{"setSmelliePulser",	SetSmelliepulser,	4},
+		{"lengthenDelay", 		LengthenDelay, 		2, "s"},
+		{"setSmellieDelay", 	SetSmelliedelay, 	2, "f"},
+		{"setSmelliePulser",	SetSmelliepulser,	4, "ffu", CheckPulser},
 		{"getSmellieRate", 		GetSmellieRate, 	1},
 		{"getSmelliePulseWidth", GetSmelliePulseWidth, 1},
 		{"getSmellieNPulses", 	GetSmellieNPulses, 	1},
 		{"getSmellieDelay", 	GetSmellieDelay, 	1},
-		{"setTellieDelay",  	SetTelliedelay,  	2},
-		{"setTellieMode",       SetTellieMode,      2},
+		{"setTellieDelay",  	SetTelliedelay,  	2, "f"},
+		{"setTellieMode",       SetTellieMode,      2, "u"},
 		{"GetTellieMode",       GetTellieMode,      1},
-		{"setTelliePulser", 	SetTelliepulser, 	4},
+		{"setTelliePulser", 	SetTelliepulser, 	4, "ffu", CheckPulser},
 		{"getTellieRate", 		GetTellieRate, 		1},
 		{"getTelliePulseWidth", GetTelliePulseWidth, 1},
 		{"getTellieNPulses", 	GetTellieNPulses, 	1},
@@ -138,51 +186,77 @@ struct command commandTable[] = {
 		{"STOP", 				StopTUBii, 			1},
 		{"keepAlive", 			KeepAlive, 			1},
 		// triggers
-		{"setCounterMask", 	SetCounterMask, 2},
+		{"setCounterMask", 	SetCounterMask, 2, "u"},
 		{"getCounterMask", 	GetCounterMask, 1},
-		{"setSpeakerMask", 	SetSpeakerMask, 2},
+		{"setSpeakerMask", 	SetSpeakerMask, 2, "u"},
 		{"getSpeakerMask", 	GetSpeakerMask, 1},
-		{"setSpeakerScale", SetSpeakerScale, 2},
-		{"setTriggerMask", 	SetTriggerMask, 3},
+		{"setSpeakerScale", SetSpeakerScale, 2, "u"},
+		{"setTriggerMask", 	SetTriggerMask, 3, "uu", CheckTriggerMask},
 		{"getSyncTriggerMask", 	GetSyncTriggerMask, 1},
 		{"getAsyncTriggerMask", 	GetAsyncTriggerMask, 1},
 		{"softGT", 		   	SoftGT, 		1},
-		{"countLatch",     	countLatch,   	2},
-		{"countReset",     	countReset,   	2},
-		{"countMode",      	countMode,    	2},
-		{"gtdelay",        	gtdelay,      	2},
-		{"settrigworddelay", 	SetTrigWordDelay, 	2},
-		{"settrigwordlength", 	SetTrigWordLength, 	2},
+		{"countLatch",     	countLatch,   	2, "u"},
+		{"countReset",     	countReset,   	2, "u"},
+		{"countMode",      	countMode,    	2, "u"},
+		{"gtdelay",        	gtdelay,      	2, "f"},
+		{"settrigworddelay", 	SetTrigWordDelay, 	2, "f"},
+		{"settrigwordlength", 	SetTrigWordLength, 	2, "f"},
 		{"startReadout",   		start_data_readout, 1},
 		{"stopReadout",	   		stop_data_readout,  1},
 		{"startStatusReadout",  start_status_readout, 1},
 		{"stopStatusReadout",	stop_status_readout,  1},
-		{"setBurstTrigger",	    SetBurstTrigger,    4},
-		{"setTUBiiPGT",         SetTUBiiPGT,        2},
+		{"getReadoutMode",      GetReadoutMode,       1},
+		{"getGapCounts",        GetGapCounts,         1},
+		{"stats",               StatsCommand,         1},
+		{"resetStats",          ResetStats,           1},
+		{"setStatsInterval",    SetStatsInterval,     2, "u", CheckStatsInterval},
+		{"commandStats",        CommandStats,         1},
+		{"clientList",          ClientList,           1},
+		{"slowlogGet",          SlowlogGet,          -1},
+		{"slowlogLen",          SlowlogLen,           1},
+		{"slowlogReset",        SlowlogReset,         1},
+		{"setSlowlogThreshold", SetSlowlogThreshold,  2, "u", CheckSlowlogThreshold},
+		{"getReadoutLatency",   GetReadoutLatency,    1},
+		{"resetReadoutLatency", ResetReadoutLatency,  1},
+		{"setBundleSize",       SetBundleSize,        2, "u", CheckBundleSize},
+		{"setBundleDeadline",   SetBundleDeadline,    2, "u", CheckBundleDeadline},
+		{"getBundleHist",       GetBundleHist,        1},
+		{"resetBundleHist",     ResetBundleHist,      1},
+		{"setSimRate",          SetSimRate,           2, "f", CheckSimRate},
+		{"setSimBurst",         SetSimBurst,          2, "u", CheckSimBurst},
+		{"getSimCounts",        GetSimCounts,         1},
+		{"verifyShadow",        VerifyShadow,         1},
+		{"setBurstTrigger",	    SetBurstTrigger,    4, "fuu", CheckBurstTrigger},
+		{"setTUBiiPGT",         SetTUBiiPGT,        2, "f", CheckTUBiiPGT},
 		{"getTUBiiPGT",         GetTUBiiPGT,        1},
-		{"setComboTrigger",    	SetComboTrigger,    3},
-		{"setPrescaleTrigger", 	SetPrescaleTrigger, 3},
+		{"setComboTrigger",    	SetComboTrigger,    3, "uu", CheckComboTrigger},
+		{"setPrescaleTrigger", 	SetPrescaleTrigger, 3, "fu", CheckPrescaleTrigger},
 		{"GetGTID", 			GetGTID,		1},
 		{"GetFifoTrigger",     	GetFifoTrigger,     1},
 		{"ResetFifo",     	   	ResetFIFO,	   	    1},
 		{"ResetGTID",		   	ResetGTID,          1},
 		/// High level functions
-		{"setGTDelays", 	SetGTDelays, 	3},
+		{"setGTDelays", 	SetGTDelays, 	3, "uu", CheckGTDelays},
 		{"getLODelay", 		GetLODelay, 	1},
 		{"getDGTDelay", 	GetDGTDelay, 	1},
-		{"setCAENWords", 	SetCaenWords, 	3},
+		{"setCAENWords", 	SetCaenWords, 	3, "uu", CheckCaenWords},
 		{"getCAENGainPathWord", 		GetCAENGainPathWord, 	  1},
 		{"getCAENChannelSelectWord", 	GetCAENChannelSelectWord, 1},
-		{"setControlReg", 	SetControlReg, 	 2},
+		{"setControlReg", 	SetControlReg, 	 2, "u", CheckControlReg},
 		{"getControlReg", 	GetControlReg, 	 1},
-		{"setECalBit", 		SetECalBit, 	 2},
-		{"setDACThreshold", SetDACThreshold, 2},
+		{"setECalBit", 		SetECalBit, 	 2, "u", CheckECalBit},
+		{"setDACThreshold", SetDACThreshold, 2, "u", CheckDACThreshold},
 		{"getDACThreshold", GetDACThreshold, 1},
-		{"setAllowableClockMisses", SetAllowableClockMisses, 2},
+		{"setAllowableClockMisses", SetAllowableClockMisses, 2, "u", CheckAllowableClockMisses},
 		//DB
-		{"save", save_TUBii_command, 1},
-		{"load", load_TUBii_command, 2},
-		{"loadConfig", load_new_config, 2}
+		{"save", save_TUBii_command, 1, "!"},
+		{"load", load_TUBii_command, 2, "!u"},
+		{"getSaveCounts", GetSaveCounts, 1},
+		{"loadConfig", load_new_config, 2, "!s"},
+		// batches
+		{"multi",   multiCommand,   1},
+		{"exec",    execCommand,    1},
+		{"discard", discardCommand, 1}
 };
 
 void sigint_handler(int dummy)
@@ -207,8 +281,10 @@ void daemonize(void) {
     }
 }
 
-
-
+#ifdef SERVER_BENCH_MAIN
+/* The command lookup benchmark in server.c runs over this table instead. */
+int numcommands = sizeof(commandTable)/sizeof(struct command);
+#else
 int main(int argc, char **argv)
 {
     config.daemonize = 0;
@@ -216,6 +292,13 @@ int main(int argc, char **argv)
     config.dataserver = "192.168.80.100";//"192.168.80.1";
     config.logfile = "";
     config.loglevel = NOTICE;
+    config.readout = READOUT_POLL;
+    config.uio = "/dev/uio0";
+    config.sim_rate = 1000;
+    config.sim_burst = 1;
+    config.rt_cpu = READOUT_NO_THREAD;
+    config.rt_prio = 50;
+    config.journal = "/mnt/tubii.journal";
 
     parseOptions(argc, argv);
 
@@ -238,6 +321,9 @@ int main(int argc, char **argv)
     startLogServer(config.logserver, "tubii");
 
     initServer(el, 4001, commandTable, sizeof(commandTable)/sizeof(struct command));
+    aeSetBeforeSleepProc(el, beforeSleep);
+    server.exec_begin = tubii_exec_begin;
+    server.exec_end = tubii_exec_end;
 
     /* set up the dispatch_connect event which will try to connect to the
      * data stream server. If it can't connect, it will retry every 10
@@ -255,12 +341,24 @@ int main(int argc, char **argv)
          return 1;
     }
 
+    if (prepare_tubii_statements(detector_db)) {
+        Log(WARNING, "failed to set up database statements");
+        return 1;
+    }
+
+    /* Not fatal, saves just fail while the database is down without it */
+    if (open_tubii_journal(detector_db, config.journal)) {
+        Log(WARNING, "failed to open journal %s", config.journal);
+    }
+
     /* Run TUBii's initialisation */
+    if (register_backing == REGS_SIM)
+        reg_backend = regsim_create(config.sim_rate, config.sim_burst);
     auto_init();
 
     /* start tubii readout */
-    if (start_tubii_readout(1000)) {
-        //Log(WARNING, tubii_err);
+    if (start_tubii_readout(config.readout, config.uio, config.sim_rate, config.rt_cpu, config.rt_prio)) {
+        Log(WARNING, "%s", tubii_err);
         return 1;
     }
 
@@ -276,6 +374,12 @@ int main(int argc, char **argv)
         return 1;
     }
 
+    /* check the register shadow against the hardware */
+    if (aeCreateTimeEvent(el, SHADOW_VERIFY_PERIOD, shadow_verify, NULL, NULL) == AE_ERR) {
+        Log(WARNING, "failed to set up register shadow check");
+        return 1;
+    }
+
     /* enter the main event loop */
     el->stop = 0;
     while (!el->stop) {
@@ -295,3 +399,4 @@ int main(int argc, char **argv)
 
     return 0;
 }
+#endif
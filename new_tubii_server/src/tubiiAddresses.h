@@ -8,6 +8,9 @@
 #ifndef TUBIIADDRESSES_H_
 #define TUBIIADDRESSES_H_
 
+// Window holding all of the blocks below
+#define AXI_BASEADDR 0x43C00000
+#define AXI_HIGHADDR 0x43C17FFF
 
 #define BURSTTRIG_BASEADDR 0x43C12000
 #define BURSTTRIG_HIGHADDR 0x43C12FFF
@@ -20,7 +20,7 @@ void *MappedTPulserBaseAddress;
 void *MappedDelayLengthenBaseAddress;
 void *MappedEllieControlBaseAddress;
 
-int Pulser(float rate, float length, u32 nPulse, void* MappedBaseAddress)
+int checkPulser(float rate, float length)
 {
   if(rate < 0 || rate > 1000000){
 	Log(WARNING, "TUBii: pulser rate is outside acceptable range.");
@@ -38,6 +38,12 @@ int Pulser(float rate, float length, u32 nPulse, void* MappedBaseAddress)
 	sprintf(tubii_err, "Tubii: Pulse width is longer than period.");
 	return -1;
   }
+  return 0;
+}
+
+int Pulser(float rate, float length, u32 nPulse, void* MappedBaseAddress)
+{
+  if(checkPulser(rate, length)) return -1;
 
   u32 period = HunMHz/rate;
   if(rate==0) period=0;
@@ -46,16 +52,16 @@ int Pulser(float rate, float length, u32 nPulse, void* MappedBaseAddress)
   Log(VERBOSE, "TUBii: rate is %f Hz for %d pulses.", rate, nPulse);
 
   // 0 is pulse width, 1 is period, 3 is no. of pulses
-  mWriteReg((u32) MappedBaseAddress, RegOffset0, width);
-  mWriteReg((u32) MappedBaseAddress, RegOffset1, period);
-  mWriteReg((u32) MappedBaseAddress, RegOffset3, nPulse);
+  sWriteReg((u32) MappedBaseAddress, RegOffset0, width);
+  sWriteReg((u32) MappedBaseAddress, RegOffset1, period);
+  sWriteReg((u32) MappedBaseAddress, RegOffset3, nPulse);
 
   return 0;
 }
 
 double GetRate(void* MappedBaseAddress)
 {
-  u32 period= mReadReg((u32) MappedBaseAddress, RegOffset1);
+  u32 period= sReadReg((u32) MappedBaseAddress, RegOffset1);
   float rate= HunMHz/period;
   if(period==0) rate=0;
 
@@ -64,7 +70,7 @@ double GetRate(void* MappedBaseAddress)
 
 double GetWidth(void* MappedBaseAddress)
 {
-  float width= (mReadReg((u32) MappedBaseAddress, RegOffset1) - mReadReg((u32) MappedBaseAddress, RegOffset0));
+  float width= (sReadReg((u32) MappedBaseAddress, RegOffset1) - sReadReg((u32) MappedBaseAddress, RegOffset0));
   width *= 1/ns;
 
   return width;
@@ -72,7 +78,7 @@ double GetWidth(void* MappedBaseAddress)
 
 int GetNPulses(void* MappedBaseAddress)
 {
-  return mReadReg((u32) MappedBaseAddress, RegOffset3);
+  return sReadReg((u32) MappedBaseAddress, RegOffset3);
 }
 
 int Delay(u32 delay, void* MappedBaseAddress)
@@ -86,33 +92,33 @@ int Delay(u32 delay, void* MappedBaseAddress)
   }
 
   // Set Delay
-  mWriteReg((u32) MappedBaseAddress, RegOffset3, delay);
+  sWriteReg((u32) MappedBaseAddress, RegOffset3, delay);
   return 0;
 }
 
 int GetDelayLength(void* MappedBaseAddress)
 {
-  return mReadReg((u32) MappedBaseAddress, RegOffset3)/ns;
+  return sReadReg((u32) MappedBaseAddress, RegOffset3)/ns;
 }
 
 int Lengthen(char* dArg)
 {
   u32 length=0;
   safe_strtoul(dArg,&length);
-  mWriteReg((u32) MappedDelayLengthenBaseAddress, RegOffset1, length);
-  mWriteReg((u32) MappedDelayLengthenBaseAddress, RegOffset2, length);
+  sWriteReg((u32) MappedDelayLengthenBaseAddress, RegOffset1, length);
+  sWriteReg((u32) MappedDelayLengthenBaseAddress, RegOffset2, length);
 
   return 0;
 }
 
 void SetTellieTriggerMode(u32 option)
 {
-  mWriteReg((u32) MappedEllieControlBaseAddress, RegOffset0, option);
+  sWriteReg((u32) MappedEllieControlBaseAddress, RegOffset0, option);
 }
 
 int GetTellieTriggerMode()
 {
-  return mReadReg((u32) MappedEllieControlBaseAddress, RegOffset0);
+  return sReadReg((u32) MappedEllieControlBaseAddress, RegOffset0);
 }
 
 #endif /* TUBIIELLIE_H_ */
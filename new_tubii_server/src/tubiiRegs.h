@@ -11,145 +11,444 @@
 void *MappedRegsBaseAddress;
 void *MappedReadBaseAddress;
 
-int Muxer(u32 mux)
+// The check functions test a setter's arguments without touching the
+// hardware, so a MULTI batch can be checked before any of it is run.
+int checkMuxer(u32 mux)
 {
   if(mux>7 || mux<0){
 	Log(WARNING, "TUBii: Muxer must be between 0 and 7.");
     sprintf(tubii_err, "TUBii: Muxer must be between 0 and 7.");
 	return -1;
   }
+  return 0;
+}
+
+int Muxer(u32 mux)
+{
+  if(checkMuxer(mux)) return -1;
   mWriteReg((u32) MappedRegsBaseAddress, RegOffset0, mux);
 
   return 0;
 }
 
-int MuxEnable(u32 mux)
+int checkMuxEnable(u32 mux)
 {
   if(mux != 0 && mux != 1){
 	Log(WARNING, "TUBii: MuxEnable must be 1 or 0.");
 	sprintf(tubii_err, "TUBii: MuxEnable must be 1 or 0.");
 	return -1;
   }
+  return 0;
+}
+
+int MuxEnable(u32 mux)
+{
+  if(checkMuxEnable(mux)) return -1;
   mWriteReg((u32) MappedRegsBaseAddress, RegOffset1, mux);
 
   return 0;
 }
 
-int DataReady(u32 dReg)
+int checkDataReady(u32 dReg)
 {
-  // 1 ControlReg
-  // 2 CAEN
-  // 3 MTCA Mimic
-  // 4 Clocks
   if(dReg > 15 || dReg <0){
 	Log(WARNING, "TUBii: Invalid register selected.");
 	sprintf(tubii_err, "TUBii: Invalid register selected.");
 	return -1;
   }
+  return 0;
+}
+
+int DataReady(u32 dReg)
+{
+  // 1 ControlReg
+  // 2 CAEN
+  // 3 MTCA Mimic
+  // 4 Clocks
+  if(checkDataReady(dReg)) return -1;
   mWriteReg((u32) MappedRegsBaseAddress, RegOffset2, dReg);
 
   return 0;
 }
 
-int LoadShift(u32 data)
+// Shift registers
+//   The shift register chains are loaded a bit at a time, and the hardware
+//   needs 10 ms per shift clock. Rather than sleeping in the event loop each
+//   load is queued as a job: a list of register writes, some of which are
+//   followed by a wait. A time event works through the queue one job at a
+//   time, so the FIFO readout and other commands keep running meanwhile.
+//   done(data) is called once a job's last write has been made.
+//
+//   The readback registers (10-15) are written as soon as a job is queued,
+//   so the getters and save_tubii_state() see the new values straight away.
+#define SHIFT_MAX_STEPS 128
+#define SHIFT_CLOCK_DELAY 10 // ms per shift clock
+
+extern aeEventLoop *el;
+
+typedef void shiftDoneProc(void *data);
+
+typedef struct shiftStep {
+  u32 offset;
+  u32 value;
+  int wait; // ms to wait after the write
+} shiftStep;
+
+typedef struct shiftJob {
+  shiftStep steps[SHIFT_MAX_STEPS];
+  int nsteps;
+  int pos;
+  shiftDoneProc *done;
+  void *data;
+  struct shiftJob *next;
+} shiftJob;
+
+shiftJob *shift_queue = NULL;
+shiftJob *shift_queue_tail = NULL;
+long long shift_event_id = AE_ERR;
+
+static int shift_run(aeEventLoop *el, long long id, void *data)
+{
+  shiftJob *job;
+  shiftStep *step;
+
+  while((job = shift_queue)){
+    while(job->pos < job->nsteps){
+      step = &job->steps[job->pos++];
+      mWriteReg((u32) MappedRegsBaseAddress, step->offset, step->value);
+      if(step->wait) return step->wait;
+    }
+
+    shift_queue = job->next;
+    if(shift_queue == NULL) shift_queue_tail = NULL;
+
+    if(job->done) job->done(job->data);
+    free(job);
+  }
+
+  shift_event_id = AE_ERR;
+  return AE_NOMORE;
+}
+
+shiftJob *shift_job_new()
+{
+  shiftJob *job = (shiftJob *) malloc(sizeof(shiftJob));
+  job->nsteps = 0;
+  job->pos = 0;
+  job->done = NULL;
+  job->data = NULL;
+  job->next = NULL;
+  return job;
+}
+
+void shift_write(shiftJob *job, u32 offset, u32 value, int wait)
+{
+  shiftStep *step = &job->steps[job->nsteps++];
+  step->offset = offset;
+  step->value = value;
+  step->wait = wait;
+}
+
+int shift_load(shiftJob *job, u32 data)
 {
+  // Queue the eight shift clocks to load one byte
   if(data>255 || data<0){
 	Log(WARNING, "TUBii: Data out of range 0 to 255.");
 	sprintf(tubii_err, "TUBii: Data out of range 0 to 255.");
 	return -1;
   }
-  mWriteReg((u32) MappedRegsBaseAddress, RegOffset3, data);
+  shift_write(job, RegOffset3, data, 0);
 
   int cnt=0;
   for(cnt=0; cnt<8; cnt++){
 	// Set
-	mWriteReg((u32) MappedRegsBaseAddress, RegOffset4, 1);
-	usleep(10000);
+	shift_write(job, RegOffset4, 1, SHIFT_CLOCK_DELAY);
   }
 
   return 0;
 }
 
-int ControlReg(int word)
+int shift_submit(shiftJob *job, shiftDoneProc *done, void *data)
 {
-  Muxer(0);
-  MuxEnable(1);
-  LoadShift(word);
-  MuxEnable(0);
-  DataReady(5);
-  DataReady(4);
+  job->done = done;
+  job->data = data;
+
+  if(shift_queue_tail) shift_queue_tail->next = job;
+  else shift_queue = job;
+  shift_queue_tail = job;
 
-  mWriteReg((u32) MappedRegsBaseAddress, RegOffset10, word);
-  Log(VERBOSE, "TUBii: Set control register %d.", word);
+  if(shift_event_id == AE_ERR){
+    if((shift_event_id = aeCreateTimeEvent(el, 0, shift_run, NULL, NULL)) == AE_ERR){
+      Log(WARNING, "TUBii: failed to set up shift register event");
+      sprintf(tubii_err, "TUBii: failed to set up shift register event");
+      return -1;
+    }
+  }
 
   return 0;
 }
 
+int shift_barrier(shiftDoneProc *done, void *data)
+{
+  // Call done(data) once everything queued so far has been shifted out
+  return shift_submit(shift_job_new(), done, data);
+}
 
-int CAENWords(int GainPath, int ChanSelect)
+void shift_clear_client(void *data)
 {
-  Muxer(1);
-  MuxEnable(1);
-  LoadShift(GainPath);
-  LoadShift(ChanSelect);
-  MuxEnable(0);
-  DataReady(6);
-  DataReady(4);
+  // Don't call back for a client which has gone away. The jobs still run.
+  shiftJob *job;
+  for(job = shift_queue; job; job = job->next){
+    if(job->data == data){
+      job->done = NULL;
+      job->data = NULL;
+    }
+  }
+}
+
+int LoadShift(u32 data, shiftDoneProc *done, void *cbdata)
+{
+  shiftJob *job = shift_job_new();
+
+  if(shift_load(job, data)){
+    free(job);
+    return -1;
+  }
+
+  return shift_submit(job, done, cbdata);
+}
+
+// Shift register transactions
+//   Changes to the chains are staged in a shadow of what was last shifted
+//   out, then shift_commit() queues a single job which loads only the
+//   chains whose value changed (or which were forced with shift_force()).
+//   Restoring a full configuration is then one pass per chain.
+#define SHIFT_CONTROL (1<<0)
+#define SHIFT_CAEN    (1<<1)
+#define SHIFT_DAC     (1<<2)
+#define SHIFT_GT      (1<<3)
+#define SHIFT_CLOCK   (1<<4)
+#define SHIFT_ALL     0x1F
+
+struct shiftShadow {
+  u32 control;
+  u32 caen_gain;
+  u32 caen_channel;
+  u32 dac;
+  u32 lo;
+  u32 dgt;
+  u32 clock_misses;
+};
 
-  mWriteReg((u32) MappedRegsBaseAddress, RegOffset11, GainPath);
-  mWriteReg((u32) MappedRegsBaseAddress, RegOffset12, ChanSelect);
-  Log(VERBOSE, "TUBii: Set CAEN gain path %d.", GainPath);
-  Log(VERBOSE, "TUBii: Set CAEN channel select %d.", ChanSelect);
+struct shiftShadow shift_staged;
+struct shiftShadow shift_committed;
+// Chains which differ from what was last shifted out. Nothing has been
+// shifted out at startup, so the chains auto_init() sets start dirty.
+int shift_dirty = SHIFT_CONTROL | SHIFT_CAEN | SHIFT_DAC | SHIFT_GT;
+// Set while a MULTI/EXEC batch runs. The setters only stage their chains and
+// everything is committed in one go at the end of the batch.
+int shift_batch = 0;
 
+int shift_check_byte(const char *name, u32 value)
+{
+  if(value>255){
+	Log(WARNING, "TUBii: %s must be between 0 and 255.", name);
+	sprintf(tubii_err, "TUBii: %s must be between 0 and 255.", name);
+	return -1;
+  }
   return 0;
 }
 
-int DACThresholds(int DACThresh)
+static void shift_mark(int chain, u32 staged, u32 committed)
 {
-  int DACThresh_pt1 = DACThresh & 0xFF;
-  int DACThresh_pt2 = (DACThresh >> 8) & 0xFF;
+  if(staged != committed) shift_dirty |= chain;
+}
 
-  Muxer(2);
-  MuxEnable(1);
-  MuxEnable(0);
-  LoadShift(DACThresh_pt2);
-  LoadShift(DACThresh_pt1);
-  MuxEnable(0);
-  DataReady(0);
-  DataReady(4);
+int shift_stage_control(u32 word)
+{
+  if(shift_check_byte("Control register", word)) return -1;
+  shift_staged.control = word;
+  shift_mark(SHIFT_CONTROL, word, shift_committed.control);
+  return 0;
+}
 
-  mWriteReg((u32) MappedRegsBaseAddress, RegOffset13, DACThresh);
-  Log(VERBOSE, "TUBii: Set DAC threshold %d.", DACThresh);
+int shift_stage_caen(u32 GainPath, u32 ChanSelect)
+{
+  if(shift_check_byte("CAEN gain path", GainPath)) return -1;
+  if(shift_check_byte("CAEN channel select", ChanSelect)) return -1;
+  shift_staged.caen_gain = GainPath;
+  shift_staged.caen_channel = ChanSelect;
+  shift_mark(SHIFT_CAEN, GainPath, shift_committed.caen_gain);
+  shift_mark(SHIFT_CAEN, ChanSelect, shift_committed.caen_channel);
+  return 0;
+}
 
+int shift_check_dac(u32 DACThresh)
+{
+  if(DACThresh>0xFFFF){
+	Log(WARNING, "TUBii: DAC threshold must be between 0 and 65535.");
+	sprintf(tubii_err, "TUBii: DAC threshold must be between 0 and 65535.");
+	return -1;
+  }
   return 0;
 }
 
-int GTDelays(int LO, int DGT)
+int shift_stage_dac(u32 DACThresh)
 {
-  Muxer(3);
-  MuxEnable(1);
-  LoadShift(LO);
-  LoadShift(DGT);
-  MuxEnable(0);
+  if(shift_check_dac(DACThresh)) return -1;
+  shift_staged.dac = DACThresh;
+  shift_mark(SHIFT_DAC, DACThresh, shift_committed.dac);
+  return 0;
+}
 
-  mWriteReg((u32) MappedRegsBaseAddress, RegOffset14, LO);
-  mWriteReg((u32) MappedRegsBaseAddress, RegOffset15, DGT);
-  Log(VERBOSE, "TUBii: Set LO* Delay %d.", LO);
-  Log(VERBOSE, "TUBii: Set DGT Delay %d.", DGT);
+int shift_stage_gt(u32 LO, u32 DGT)
+{
+  if(shift_check_byte("LO* delay", LO)) return -1;
+  if(shift_check_byte("DGT delay", DGT)) return -1;
+  shift_staged.lo = LO;
+  shift_staged.dgt = DGT;
+  shift_mark(SHIFT_GT, LO, shift_committed.lo);
+  shift_mark(SHIFT_GT, DGT, shift_committed.dgt);
+  return 0;
+}
 
+int shift_stage_clock_misses(u32 nMisses)
+{
+  if(shift_check_byte("Allowable clock misses", nMisses)) return -1;
+  shift_staged.clock_misses = nMisses;
+  shift_mark(SHIFT_CLOCK, nMisses, shift_committed.clock_misses);
   return 0;
 }
 
-int ClockMisses(int nMisses)
+void shift_force(int chains)
 {
-  // I think this'll work...
-  Muxer(5);
-  MuxEnable(1);
-  LoadShift(nMisses);
-  MuxEnable(0);
-  Log(VERBOSE, "TUBii: Set number of allowable missed clock ticks %d.", nMisses);
+  // Shift these chains out on the next commit even if they haven't changed
+  shift_dirty |= chains;
+}
 
-  return 0;
+int shift_commit(shiftDoneProc *done, void *data)
+{
+  // Queue one job loading every dirty chain. done(data) is called once it
+  // has been shifted out, even if nothing needed to change.
+  shiftJob *job = shift_job_new();
+  struct shiftShadow *st = &shift_staged;
+
+  if(shift_dirty & SHIFT_CAEN){
+    shift_write(job, RegOffset0, 1, 0);
+    shift_write(job, RegOffset1, 1, 0);
+    shift_load(job, st->caen_gain);
+    shift_load(job, st->caen_channel);
+    shift_write(job, RegOffset1, 0, 0);
+    shift_write(job, RegOffset2, 6, 0);
+    shift_write(job, RegOffset2, 4, 0);
+
+    sWriteReg((u32) MappedRegsBaseAddress, RegOffset11, st->caen_gain);
+    sWriteReg((u32) MappedRegsBaseAddress, RegOffset12, st->caen_channel);
+    Log(VERBOSE, "TUBii: Set CAEN gain path %d.", st->caen_gain);
+    Log(VERBOSE, "TUBii: Set CAEN channel select %d.", st->caen_channel);
+  }
+
+  if(shift_dirty & SHIFT_GT){
+    shift_write(job, RegOffset0, 3, 0);
+    shift_write(job, RegOffset1, 1, 0);
+    shift_load(job, st->lo);
+    shift_load(job, st->dgt);
+    shift_write(job, RegOffset1, 0, 0);
+
+    sWriteReg((u32) MappedRegsBaseAddress, RegOffset14, st->lo);
+    sWriteReg((u32) MappedRegsBaseAddress, RegOffset15, st->dgt);
+    Log(VERBOSE, "TUBii: Set LO* Delay %d.", st->lo);
+    Log(VERBOSE, "TUBii: Set DGT Delay %d.", st->dgt);
+  }
+
+  if(shift_dirty & SHIFT_DAC){
+    shift_write(job, RegOffset0, 2, 0);
+    shift_write(job, RegOffset1, 1, 0);
+    shift_write(job, RegOffset1, 0, 0);
+    shift_load(job, (st->dac >> 8) & 0xFF);
+    shift_load(job, st->dac & 0xFF);
+    shift_write(job, RegOffset1, 0, 0);
+    shift_write(job, RegOffset2, 0, 0);
+    shift_write(job, RegOffset2, 4, 0);
+
+    sWriteReg((u32) MappedRegsBaseAddress, RegOffset13, st->dac);
+    Log(VERBOSE, "TUBii: Set DAC threshold %d.", st->dac);
+  }
+
+  if(shift_dirty & SHIFT_CONTROL){
+    shift_write(job, RegOffset0, 0, 0);
+    shift_write(job, RegOffset1, 1, 0);
+    shift_load(job, st->control);
+    shift_write(job, RegOffset1, 0, 0);
+    shift_write(job, RegOffset2, 5, 0);
+    shift_write(job, RegOffset2, 4, 0);
+
+    sWriteReg((u32) MappedRegsBaseAddress, RegOffset10, st->control);
+    Log(VERBOSE, "TUBii: Set control register %d.", st->control);
+  }
+
+  if(shift_dirty & SHIFT_CLOCK){
+    // I think this'll work...
+    shift_write(job, RegOffset0, 5, 0);
+    shift_write(job, RegOffset1, 1, 0);
+    shift_load(job, st->clock_misses);
+    shift_write(job, RegOffset1, 0, 0);
+    Log(VERBOSE, "TUBii: Set number of allowable missed clock ticks %d.", st->clock_misses);
+  }
+
+  shift_committed = shift_staged;
+  shift_dirty = 0;
+
+  return shift_submit(job, done, data);
+}
+
+void shift_rollback()
+{
+  // Throw away anything staged since the last commit
+  shift_staged = shift_committed;
+  shift_dirty = 0;
+}
+
+static int shift_apply(shiftDoneProc *done, void *data)
+{
+  if(shift_batch) return 0;
+  return shift_commit(done, data);
+}
+
+// The setters always shift their chain out, even if it hasn't changed
+int ControlReg(int word, shiftDoneProc *done, void *data)
+{
+  if(shift_stage_control(word)) return -1;
+  shift_force(SHIFT_CONTROL);
+  return shift_apply(done, data);
+}
+
+int CAENWords(int GainPath, int ChanSelect, shiftDoneProc *done, void *data)
+{
+  if(shift_stage_caen(GainPath, ChanSelect)) return -1;
+  shift_force(SHIFT_CAEN);
+  return shift_apply(done, data);
+}
+
+int DACThresholds(int DACThresh, shiftDoneProc *done, void *data)
+{
+  if(shift_stage_dac(DACThresh)) return -1;
+  shift_force(SHIFT_DAC);
+  return shift_apply(done, data);
+}
+
+int GTDelays(int LO, int DGT, shiftDoneProc *done, void *data)
+{
+  if(shift_stage_gt(LO, DGT)) return -1;
+  shift_force(SHIFT_GT);
+  return shift_apply(done, data);
+}
+
+int ClockMisses(int nMisses, shiftDoneProc *done, void *data)
+{
+  if(shift_stage_clock_misses(nMisses)) return -1;
+  shift_force(SHIFT_CLOCK);
+  return shift_apply(done, data);
 }
 
 #endif /* TUBIIREGS_H_ */
@@ -31,7 +31,7 @@ void* MappedGTIDBaseAddress;
 void* MappedSpeakerScaleBaseAddress;
 
 /////// Internal Triggers
-int burstTrig(float rate, int masterBit, int slaveBit)
+int checkBurstTrig(int masterBit, int slaveBit)
 {
   if(masterBit<0 || masterBit>15){
 	  Log(WARNING, "TUBii: Choose a burst trigger bit between 0 and 15.");
@@ -44,42 +44,60 @@ int burstTrig(float rate, int masterBit, int slaveBit)
 	  sprintf(tubii_err, "TUBii: Choose a burst trigger bit between 0 and 15.");
 	  return -1;
   }
+  return 0;
+}
+
+int burstTrig(float rate, int masterBit, int slaveBit)
+{
+  if(checkBurstTrig(masterBit, slaveBit)) return -1;
 
   int masterMask = pow(2,masterBit);
   int slaveMask = pow(2,slaveBit);
   Log(VERBOSE, "TUBii: Set rate for burst trigger: %lf on bit %i",rate,masterBit);
-  mWriteReg((u32) MappedBurstBaseAddress, RegOffset0, rate);
-  mWriteReg((u32) MappedBurstBaseAddress, RegOffset2, masterMask);
-  mWriteReg((u32) MappedBurstBaseAddress, RegOffset3, slaveMask);
+  sWriteReg((u32) MappedBurstBaseAddress, RegOffset0, rate);
+  sWriteReg((u32) MappedBurstBaseAddress, RegOffset2, masterMask);
+  sWriteReg((u32) MappedBurstBaseAddress, RegOffset3, slaveMask);
   return 0;
 }
 
-int comboTrig(u32 enableMask, u32 logicMask)
+int checkComboTrig(u32 enableMask, u32 logicMask)
 {
   if(logicMask<0 || logicMask>65535 || enableMask<0 || enableMask>65535){
 	  Log(WARNING, "TUBii: Choose a combo trigger mask between 0 and 65535.");
 	  sprintf(tubii_err, "TUBii: Choose a combo trigger mask between 0 and 65535.");
 	  return -1;
   }
+  return 0;
+}
+
+int comboTrig(u32 enableMask, u32 logicMask)
+{
+  if(checkComboTrig(enableMask, logicMask)) return -1;
 
   Log(VERBOSE, "TUBii: Set mask for combo trigger: %d (%d)",logicMask,enableMask);
-  mWriteReg((u32) MappedComboBaseAddress, RegOffset2, enableMask);
-  mWriteReg((u32) MappedComboBaseAddress, RegOffset3, logicMask);
+  sWriteReg((u32) MappedComboBaseAddress, RegOffset2, enableMask);
+  sWriteReg((u32) MappedComboBaseAddress, RegOffset3, logicMask);
   return 0;
 }
 
-int prescaleTrig(float rate, int bit)
+int checkPrescaleTrig(int bit)
 {
   if(bit<0 || bit>15){
 	  Log(WARNING, "TUBii: Choose a prescale trigger bit between 0 and 15.");
 	  sprintf(tubii_err, "TUBii: Choose a prescale trigger bit between 0 and 15.");
 	  return -1;
   }
+  return 0;
+}
+
+int prescaleTrig(float rate, int bit)
+{
+  if(checkPrescaleTrig(bit)) return -1;
 
   int mask = pow(2,bit);
   Log(VERBOSE, "TUBii: Set rate for prescale trigger: %lf on bit %i",rate,bit);
-  mWriteReg((u32) MappedPrescaleBaseAddress, RegOffset2, rate);
-  mWriteReg((u32) MappedPrescaleBaseAddress, RegOffset3, mask);
+  sWriteReg((u32) MappedPrescaleBaseAddress, RegOffset2, rate);
+  sWriteReg((u32) MappedPrescaleBaseAddress, RegOffset3, mask);
   return 0;
 }
 
@@ -117,59 +135,69 @@ void GetCounterRate()
 
 int counterMask(u32 mask)
 {
-  mWriteReg((u32) MappedCountLengthenBaseAddress, RegOffset1,200); // Fix the pulse length
-  mWriteReg((u32) MappedCountLengthenBaseAddress, RegOffset2,400); // And deadtime
-  mWriteReg((u32) MappedTrigBaseAddress, RegOffset1,mask);
+  sWriteReg((u32) MappedCountLengthenBaseAddress, RegOffset1,200); // Fix the pulse length
+  sWriteReg((u32) MappedCountLengthenBaseAddress, RegOffset2,400); // And deadtime
+  sWriteReg((u32) MappedTrigBaseAddress, RegOffset1,mask);
 
   return mask;
 }
 
 int getCounterMask()
 {
-  return mReadReg((u32) MappedTrigBaseAddress, RegOffset1);
+  return sReadReg((u32) MappedTrigBaseAddress, RegOffset1);
 }
 
 int speakerMask(u32 mask)
 {
   //mWriteReg((u32) MappedSpeakLengthenBaseAddress, RegOffset1,200); // Fix the pulse length
   //mWriteReg((u32) MappedSpeakLengthenBaseAddress, RegOffset2,400); // And deadtime
-  mWriteReg((u32) MappedTrigBaseAddress, RegOffset2,mask);
+  sWriteReg((u32) MappedTrigBaseAddress, RegOffset2,mask);
   return mask;
 }
 
 int speakerScale(u32 rate)
 {
   Log(VERBOSE, "TUBii: Scaling the speaker by a factor of %d",rate);
-  mWriteReg((u32) MappedTrigBaseAddress, RegOffset5, rate);
+  sWriteReg((u32) MappedTrigBaseAddress, RegOffset5, rate);
   return 0;
 }
 
 int getSpeakerMask()
 {
-  return mReadReg((u32) MappedTrigBaseAddress, RegOffset2);
+  return sReadReg((u32) MappedTrigBaseAddress, RegOffset2);
+}
+
+int checkTriggerMask(u32 mask, u32 mask_async)
+{
+  if((mask & mask_async)!=0){
+	  Log(WARNING, "TUBii: A trigger can't be in both the sync and async masks.");
+	  sprintf(tubii_err, "TUBii: A trigger can't be in both the sync and async masks.");
+	  return -1;
+  }
+  return 0;
 }
 
 int triggerMask(u32 mask, u32 mask_async)
 {
-  if((mask & mask_async)!=0) return -1;
-  mWriteReg((u32) MappedTrigBaseAddress, RegOffset3,mask);
-  mWriteReg((u32) MappedTrigBaseAddress, RegOffset8,mask_async);
+  if(checkTriggerMask(mask, mask_async)) return -1;
+  sWriteReg((u32) MappedTrigBaseAddress, RegOffset3,mask);
+  sWriteReg((u32) MappedTrigBaseAddress, RegOffset8,mask_async);
   return mask;
 }
 
 int individualTriggerMask(u32 mask, char* type)
 {
   if(type=="sync"){
-    mWriteReg((u32) MappedTrigBaseAddress, RegOffset3, mask);
-    u32 async= mReadReg((u32) MappedTrigBaseAddress, RegOffset8);
+    sWriteReg((u32) MappedTrigBaseAddress, RegOffset3, mask);
+    u32 async= sReadReg((u32) MappedTrigBaseAddress, RegOffset8);
     async = async - (async & mask);
-    mWriteReg((u32) MappedTrigBaseAddress, RegOffset8, async);
+    sWriteReg((u32) MappedTrigBaseAddress, RegOffset8, async);
   }
   else if(type=="async"){
-    mWriteReg((u32) MappedTrigBaseAddress, RegOffset8, mask);
-    u32 sync= mReadReg((u32) MappedTrigBaseAddress, RegOffset3);
+    sWriteReg((u32) MappedTrigBaseAddress, RegOffset8, mask);
+    u32 sync= sReadReg((u32) MappedTrigBaseAddress, RegOffset3);
     sync = sync - (sync & mask);
-    mWriteReg((u32) MappedTrigBaseAddress, RegOffset3, sync);
+    sWriteReg((u32) MappedTrigBaseAddress, RegOffset3, sync);
   }
 
   return mask;
@@ -177,12 +205,12 @@ int individualTriggerMask(u32 mask, char* type)
 
 int getSyncTriggerMask()
 {
-  return mReadReg((u32) MappedTrigBaseAddress,RegOffset3);
+  return sReadReg((u32) MappedTrigBaseAddress,RegOffset3);
 }
 
 int getAsyncTriggerMask()
 {
-  return mReadReg((u32) MappedTrigBaseAddress,RegOffset8);
+  return sReadReg((u32) MappedTrigBaseAddress,RegOffset8);
 }
 
 void softGT()
@@ -228,6 +256,33 @@ u32 fifoStatus()
   return error;
 }
 
+// Number of records waiting in the FIFO
+u32 fifoOccupancy()
+{
+  return mReadReg((u32) MappedFifoBaseAddress, RegOffset3);
+}
+
+// Read every record currently in the FIFO (up to max) into records.
+// The occupancy is read once up front, so each record only costs the
+// strobe and the two data reads, and nothing is read from an empty FIFO.
+int fifoDrain(struct TubiiRecord* records, int max)
+{
+  u32 base = (u32) MappedFifoBaseAddress;
+  u32 n = fifoOccupancy();
+  u32 i;
+
+  if(n > max) n = max;
+
+  for(i=0; i<n; i++){
+    mWriteReg(base, RegOffset0, 1);
+    records[i].TrigWord = mReadReg(base, RegOffset1) & 0xFFFFFF;
+    records[i].GTID = mReadReg(base, RegOffset2) & 0xFFFFFF;
+    mWriteReg(base, RegOffset0, 0);
+  }
+
+  return n;
+}
+
 void resetFIFO()
 {
   mWriteReg((u32) MappedFifoBaseAddress, RegOffset0,2);
@@ -248,13 +303,13 @@ int TrigWordDelay(u32 delay)
   usleep(1000);
   mWriteReg((u32) MappedTrigWordDelayBaseAddress, RegOffset1, 0); // Reset
   usleep(1000);
-  mWriteReg((u32) MappedTrigWordDelayBaseAddress, RegOffset0, delay);
+  sWriteReg((u32) MappedTrigWordDelayBaseAddress, RegOffset0, delay);
   return 0;
 }
 
 int TrigWordLength(u32 delay)
 {
-  mWriteReg((u32) MappedTrigWordDelayBaseAddress, RegOffset2, delay);
+  sWriteReg((u32) MappedTrigWordDelayBaseAddress, RegOffset2, delay);
   return 0;
 }
 
@@ -5,6 +5,8 @@
  */
 #include "sys/mman.h"
 #include <fcntl.h>
+#include "tubiiAddresses.h"
+#include "regsim.h"
 
 #ifndef TUBIIUTIL_H_
 #define TUBIIUTIL_H_
@@ -65,50 +67,186 @@ u32 RegOffset15= REG15_OFFSET;
 #define mReadReg(BaseAddress, RegOffset) \
     Xil_In32((BaseAddress) + (RegOffset))
 
-// Read to and from addresses
+// The AXI peripheral window, 4 KB per block
+#define AXI_BLOCK_SIZE 0x1000
+#define AXI_WINDOW_SIZE (AXI_HIGHADDR - AXI_BASEADDR + 1)
+#define AXI_BLOCKS (AXI_WINDOW_SIZE/AXI_BLOCK_SIZE)
+
+void *MappedAxiBaseAddress = NULL;
+
+// Mapped address of the block at physical address BaseAddress
+#define AxiBlock(BaseAddress) \
+    ((void *)((char *) MappedAxiBaseAddress + ((BaseAddress) - AXI_BASEADDR)))
+
+// Register backend standing in for the hardware, see regsim.h
+regBackend *reg_backend = NULL;
+
+// Read to and from addresses. The registers are 32 bits wide, which isn't
+// the size of a u32 on a 64 bit host.
 u32 Xil_In32(u32 Addr)
 {
-  return *(volatile u32 *) Addr;
+  if(reg_backend) return reg_backend->read(reg_backend, Addr - (u32) MappedAxiBaseAddress);
+  return *(volatile uint32_t *) Addr;
 }
 
 void Xil_Out32(u32 OutAddress, u32 Value)
 {
-  *(volatile u32 *) OutAddress = Value;
+  if(reg_backend) reg_backend->write(reg_backend, OutAddress - (u32) MappedAxiBaseAddress, Value);
+  else *(volatile uint32_t *) OutAddress = Value;
+}
+
+// Register shadow
+//
+// Every read of a register goes out over the AXI bus, and the getters and
+// the database snapshots read the same few dozen configuration registers
+// again and again. The configuration registers are written with sWriteReg,
+// which keeps a copy of the value, and read with sReadReg, which returns the
+// copy without touching the bus. A register which hasn't been written since
+// the window was mapped is read from the hardware once and then remembered.
+//
+// Status registers (FIFO, GTID, counters, clock status) and strobes change
+// underneath us, so they must keep using mReadReg and mWriteReg.
+#define SHADOW_REGS 16
+
+struct RegShadow {
+  u32 valid; // bit n is set if value[n] is known
+  u32 value[SHADOW_REGS];
+};
+
+struct RegShadow reg_shadow[AXI_BLOCKS];
+
+// A register which doesn't match its shadow
+struct ShadowDrift {
+  u32 addr;
+  u32 shadow;
+  u32 hw;
+};
+
+// Write a configuration register, keeping a copy in the shadow
+#define sWriteReg(BaseAddress, RegOffset, Data) \
+  	Shadow_Out32((BaseAddress), (RegOffset), (u32)(Data))
+
+// Read a configuration register from the shadow
+#define sReadReg(BaseAddress, RegOffset) \
+    Shadow_In32((BaseAddress), (RegOffset))
+
+// Find the shadow of the block mapped at BaseAddress
+static struct RegShadow *ShadowBlock(u32 BaseAddress)
+{
+  u32 offset = BaseAddress - (u32) MappedAxiBaseAddress;
+
+  if(MappedAxiBaseAddress == NULL || offset >= AXI_WINDOW_SIZE) return NULL;
+  return &reg_shadow[offset/AXI_BLOCK_SIZE];
+}
+
+u32 Shadow_In32(u32 BaseAddress, u32 RegOffset)
+{
+  struct RegShadow *s = ShadowBlock(BaseAddress);
+  u32 n = RegOffset/4;
+
+  if(s == NULL || n >= SHADOW_REGS) return Xil_In32(BaseAddress + RegOffset);
+
+  if(!(s->valid & (1 << n))){
+    s->value[n] = Xil_In32(BaseAddress + RegOffset);
+    s->valid |= 1 << n;
+  }
+
+  return s->value[n];
+}
+
+void Shadow_Out32(u32 BaseAddress, u32 RegOffset, u32 Value)
+{
+  struct RegShadow *s = ShadowBlock(BaseAddress);
+  u32 n = RegOffset/4;
+
+  Xil_Out32(BaseAddress + RegOffset, Value);
+
+  if(s == NULL || n >= SHADOW_REGS) return;
+  s->value[n] = Value;
+  s->valid |= 1 << n;
+}
+
+// Read back every register held in the shadow and compare it with the
+// hardware. Fills in up to max mismatches and returns how many there were.
+int ShadowVerify(struct ShadowDrift *drift, int max)
+{
+  int i, n, ndrift = 0;
+  u32 hw;
+
+  if(MappedAxiBaseAddress == NULL) return 0;
+
+  for(i=0; i<AXI_BLOCKS; i++){
+    struct RegShadow *s = &reg_shadow[i];
+    u32 block = i*AXI_BLOCK_SIZE;
+
+    for(n=0; n<SHADOW_REGS; n++){
+      if(!(s->valid & (1 << n))) continue;
+
+      hw = Xil_In32((u32) MappedAxiBaseAddress + block + 4*n);
+      if(hw == s->value[n]) continue;
+
+      if(ndrift < max){
+        drift[ndrift].addr = AXI_BASEADDR + block + 4*n;
+        drift[ndrift].shadow = s->value[n];
+        drift[ndrift].hw = hw;
+      }
+      ndrift++;
+    }
+  }
+
+  return ndrift;
 }
 
-// Memory Mapping Method
-void* MemoryMapping(u32 BaseAddress, u32 HighAddress)
+// Memory Mapping
+//
+// All of the AXI peripherals sit in one window, a 4 KB block each, so the
+// whole window is mapped once and each block is found by its offset from
+// the start. Mapping /dev/mem can't use huge pages, but one mapping still
+// means one VMA and far fewer TLB entries than a page per block. With
+// REGS_ANON the window is ordinary memory instead, which lets everything
+// above the registers run on a machine without the hardware. With REGS_SIM
+// the mapping only provides the addresses, and the accesses go to the
+// register model.
+int MapAxiWindow(int backing)
 {
-  //Begin memory mapping
   int memfd;
-  void *MappedBaseAddress;
-  off_t dev_base = BaseAddress;
-
-  // Open Memory location
-  memfd = open("/dev/mem", O_RDWR | O_SYNC);
-  if (memfd == -1){
-	Log(WARNING, "TUBii: Can't open memory location.");
-   	exit(0);
+  void *base;
+
+  if(MappedAxiBaseAddress != NULL) return 0;
+
+  if(backing != REGS_DEVMEM){
+    base = mmap(0, AXI_WINDOW_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  }
+  else{
+    // Open Memory location
+    memfd = open("/dev/mem", O_RDWR | O_SYNC);
+    if (memfd == -1){
+	  Log(WARNING, "TUBii: Can't open memory location.");
+   	  exit(0);
+    }
+
+    // Map into user space the area of memory containing the devices
+    base = mmap(0, AXI_WINDOW_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, AXI_BASEADDR);
+    close(memfd);
   }
 
-  // Map into user space the area of memory containing the device
-  MappedBaseAddress = mmap(0, (HighAddress-BaseAddress), PROT_READ | PROT_WRITE, MAP_SHARED, memfd, dev_base & ~(HighAddress-BaseAddress-1));
-  if (MappedBaseAddress == (void *) -1){
+  if (base == MAP_FAILED){
 	Log(WARNING, "TUBii: Can't map the memory to user space");
     exit(0);
   }
 
-  close(memfd);
-  return MappedBaseAddress;
+  MappedAxiBaseAddress = base;
+  memset(reg_shadow, 0, sizeof(reg_shadow));
+  return 0;
 }
 
 void InitialiseRegs(void* MappedBaseAddress)
 {
   // Set all regs to zero...
-  mWriteReg((u32) MappedBaseAddress, RegOffset0, 0);
-  mWriteReg((u32) MappedBaseAddress, RegOffset1, 0);
-  mWriteReg((u32) MappedBaseAddress, RegOffset2, 0);
-  mWriteReg((u32) MappedBaseAddress, RegOffset3, 0);
+  sWriteReg((u32) MappedBaseAddress, RegOffset0, 0);
+  sWriteReg((u32) MappedBaseAddress, RegOffset1, 0);
+  sWriteReg((u32) MappedBaseAddress, RegOffset2, 0);
+  sWriteReg((u32) MappedBaseAddress, RegOffset3, 0);
 }
 
 // For error messages
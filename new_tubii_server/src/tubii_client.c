@@ -3,11 +3,17 @@
 #include "data.h"
 #include "logging.h"
 #include <stdlib.h>
+#include <string.h>
 #include <arpa/inet.h>
 #include <errno.h>
 #include "ae.h"
 #include "server.h"
 #include "db.h"
+#include "readout.h"
+#include "byteorder.h"
+#include "readout_thread.h"
+#include "stats.h"
+#include "journal.h"
 
 // tubii headers
 #include "tubiiAddresses.h"
@@ -22,15 +28,39 @@
 extern aeEventLoop *el;
 extern database *detector_db;
 long long tubii_readout_id = AE_ERR;
+readoutSource *readout_source = NULL;
 int last_gtid=0;
 int spam_flag=0;
+// GTID gaps seen since the last status record, and since startup
+struct TubiiGaps gaps_interval;
+struct TubiiGaps gaps_total;
+// Records are left in the FIFO until there are bundle_max of them or the
+// oldest has been waiting bundle_deadline ms, then sent as one MEGA_RECORD
+int bundle_max=MEGA_RECORD_MAX;
+int bundle_deadline=1;
+long long bundle_first=0; // when the FIFO was first seen non-empty (us)
+// bundle_hist[i] counts bundles with between 2^i and 2^(i+1)-1 records
+#define BUNDLE_HIST_BINS 10
+unsigned long long bundle_hist[BUNDLE_HIST_BINS];
 
 static void save_db_callback(PGresult *res, PGconn *conn, void *data);
 static void save_db_client_callback(PGresult *res, PGconn *conn, void *data);
 static void load_db_callback(PGresult *res, PGconn *conn, void *data);
 static void client_disconnect(void *data);
+static void load_shift_done(void *data);
+static int check_gtid(uint32_t gtid);
 void save_tubii_state();
 long long save_tubii_id = -1;
+int register_backing = REGS_DEVMEM;
+
+int register_backing_from_string(const char *s)
+{
+  if(!strcmp(s, "devmem")) return REGS_DEVMEM;
+  if(!strcmp(s, "anon")) return REGS_ANON;
+  if(!strcmp(s, "sim")) return REGS_SIM;
+
+  return -1;
+}
 
 // Initialisation functions
 void initialise(client *c, int argc, sds *argv)
@@ -47,46 +77,47 @@ void initialise(client *c, int argc, sds *argv)
 int InitMapping()
 {
   // Ian: Do all the memory mappings on start up as it'll save time during each function call
+  MapAxiWindow(register_backing);
 
   // Shift Registers
-  MappedRegsBaseAddress= MemoryMapping(SHIFTREGS_BASEADDR,SHIFTREGS_HIGHADDR);
+  MappedRegsBaseAddress= AxiBlock(SHIFTREGS_BASEADDR);
 
   // Clocks
-  MappedClocksBaseAddress= MemoryMapping(CLOCKLOGIC_BASEADDR,CLOCKLOGIC_HIGHADDR);
+  MappedClocksBaseAddress= AxiBlock(CLOCKLOGIC_BASEADDR);
 
   // Counter Latch & Reset
-  MappedCountBaseAddress= MemoryMapping(COUNTDISP_BASEADDR,COUNTDISP_HIGHADDR);
-  MappedCountLengthenBaseAddress= MemoryMapping(COUNTLENGTHEN_BASEADDR,COUNTLENGTHEN_HIGHADDR);
-  //MappedSpeakLengthenBaseAddress= MemoryMapping(COUNTLENGTHEN_BASEADDR,COUNTLENGTHEN_HIGHADDR);
+  MappedCountBaseAddress= AxiBlock(COUNTDISP_BASEADDR);
+  MappedCountLengthenBaseAddress= AxiBlock(COUNTLENGTHEN_BASEADDR);
+  //MappedSpeakLengthenBaseAddress= AxiBlock(COUNTLENGTHEN_BASEADDR);
 
   // Trigger, Counter & Speaker Masks
-  MappedTrigBaseAddress= MemoryMapping(TRIGGEROUT_BASEADDR,TRIGGEROUT_HIGHADDR);
-  MappedGTIDBaseAddress= MemoryMapping(GTID_BASEADDR,GTID_HIGHADDR);
-  MappedFifoBaseAddress= MemoryMapping(FIFOREADOUT_BASEADDR,FIFOREADOUT_HIGHADDR);
-  MappedSpeakerScaleBaseAddress= MemoryMapping(SPEAKERSCALE_BASEADDR,SPEAKERSCALE_HIGHADDR);
+  MappedTrigBaseAddress= AxiBlock(TRIGGEROUT_BASEADDR);
+  MappedGTIDBaseAddress= AxiBlock(GTID_BASEADDR);
+  MappedFifoBaseAddress= AxiBlock(FIFOREADOUT_BASEADDR);
+  MappedSpeakerScaleBaseAddress= AxiBlock(SPEAKERSCALE_BASEADDR);
 
   // Meta-Triggers
-  MappedBurstBaseAddress= MemoryMapping(BURSTTRIG_BASEADDR,BURSTTRIG_HIGHADDR);
-  MappedTUBiiPGTBaseAddress= MemoryMapping(TUBIIPGT_BASEADDR,TUBIIPGT_HIGHADDR);
-  MappedComboBaseAddress= MemoryMapping(COMBOTRIG_BASEADDR,COMBOTRIG_HIGHADDR);
-  MappedPrescaleBaseAddress= MemoryMapping(PRESCALETRIG_BASEADDR,PRESCALETRIG_HIGHADDR);
+  MappedBurstBaseAddress= AxiBlock(BURSTTRIG_BASEADDR);
+  MappedTUBiiPGTBaseAddress= AxiBlock(TUBIIPGT_BASEADDR);
+  MappedComboBaseAddress= AxiBlock(COMBOTRIG_BASEADDR);
+  MappedPrescaleBaseAddress= AxiBlock(PRESCALETRIG_BASEADDR);
 
   // Pulsers
-  MappedPulserBaseAddress= MemoryMapping(GENERICPULSER_BASEADDR,GENERICPULSER_HIGHADDR);
-  MappedSPulserBaseAddress= MemoryMapping(SMELLIEPULSER_BASEADDR,SMELLIEPULSER_HIGHADDR);
-  MappedTPulserBaseAddress= MemoryMapping(TELLIEPULSER_BASEADDR,TELLIEPULSER_HIGHADDR);
-  MappedHappyBaseAddress= MemoryMapping(MZHAPPY_BASEADDR,MZHAPPY_HIGHADDR);
+  MappedPulserBaseAddress= AxiBlock(GENERICPULSER_BASEADDR);
+  MappedSPulserBaseAddress= AxiBlock(SMELLIEPULSER_BASEADDR);
+  MappedTPulserBaseAddress= AxiBlock(TELLIEPULSER_BASEADDR);
+  MappedHappyBaseAddress= AxiBlock(MZHAPPY_BASEADDR);
 
   // Delays
-  MappedDelayBaseAddress= MemoryMapping(GENERICDELAY_BASEADDR,GENERICDELAY_HIGHADDR);
-  MappedDelayLengthenBaseAddress= MemoryMapping(DELAYLENGTHEN_BASEADDR,DELAYLENGTHEN_HIGHADDR);
-  MappedSDelayBaseAddress= MemoryMapping(SMELLIEDELAY_BASEADDR,SMELLIEDELAY_HIGHADDR);
-  MappedTDelayBaseAddress= MemoryMapping(TELLIEDELAY_BASEADDR,TELLIEDELAY_HIGHADDR);
-  MappedGTDelayBaseAddress= MemoryMapping(GTDELAY_BASEADDR,GTDELAY_HIGHADDR);
-  MappedTrigWordDelayBaseAddress= MemoryMapping(TRIGWORDDELAY_BASEADDR,TRIGWORDDELAY_HIGHADDR);
+  MappedDelayBaseAddress= AxiBlock(GENERICDELAY_BASEADDR);
+  MappedDelayLengthenBaseAddress= AxiBlock(DELAYLENGTHEN_BASEADDR);
+  MappedSDelayBaseAddress= AxiBlock(SMELLIEDELAY_BASEADDR);
+  MappedTDelayBaseAddress= AxiBlock(TELLIEDELAY_BASEADDR);
+  MappedGTDelayBaseAddress= AxiBlock(GTDELAY_BASEADDR);
+  MappedTrigWordDelayBaseAddress= AxiBlock(TRIGWORDDELAY_BASEADDR);
 
   // EllieControl
-  MappedEllieControlBaseAddress= MemoryMapping(ELLIECONTROL_BASEADDR,ELLIECONTROL_HIGHADDR);
+  MappedEllieControlBaseAddress= AxiBlock(ELLIECONTROL_BASEADDR);
 
   return 0;
 }
@@ -102,14 +133,19 @@ int auto_init()
   // Reset the FIFO
   resetFIFO();
 
+  // The shift registers are loaded once the event loop starts
   //Put caen in attenuating mode
-  CAENWords(255, 255);
+  shift_stage_caen(255, 255);
   //setup DGT and LO* delay lengths
-  GTDelays(153, 153);
+  shift_stage_gt(153, 153);
   //Set MTCA MIMIC DAC value
-  DACThresholds(4095);
+  shift_stage_dac(4095);
   //Set Control Reg Value
-  ControlReg(58);
+  shift_stage_control(58);
+  // Load them even if they match what was last shifted out, since the board
+  // may have been reset since
+  shift_force(SHIFT_CONTROL | SHIFT_CAEN | SHIFT_DAC | SHIFT_GT);
+  shift_commit(NULL, NULL);
   // Speaker mask to GT
   speakerMask(0x1000000);
   // Counter mask to GT
@@ -154,7 +190,7 @@ void clockstatus(client *c, int argc, sds *argv)
   // do something with ret which is the status of the backup clock
   // add to the datastream?
 
-  addReply(c, ":%d", status);
+  addReplyLongLong(c, status);
 }
 
 // Utility commands
@@ -329,12 +365,12 @@ void GetSmelliePulseWidth(client *c, int argc, sds *argv)
 
 void GetSmellieNPulses(client *c, int argc, sds *argv)
 {
-  addReply(c, ":%d", GetNPulses(MappedSPulserBaseAddress));
+  addReplyLongLong(c, GetNPulses(MappedSPulserBaseAddress));
 }
 
 void GetSmellieDelay(client *c, int argc, sds *argv)
 {
-  addReply(c, ":%d", GetDelayLength(MappedSDelayBaseAddress));
+  addReplyLongLong(c, GetDelayLength(MappedSDelayBaseAddress));
 }
 
 void GetTellieRate(client *c, int argc, sds *argv)
@@ -349,12 +385,12 @@ void GetTelliePulseWidth(client *c, int argc, sds *argv)
 
 void GetTellieNPulses(client *c, int argc, sds *argv)
 {
-  addReply(c, ":%d", GetNPulses(MappedTPulserBaseAddress));
+  addReplyLongLong(c, GetNPulses(MappedTPulserBaseAddress));
 }
 
 void GetTellieDelay(client *c, int argc, sds *argv)
 {
-  addReply(c, ":%d", GetDelayLength(MappedTDelayBaseAddress));
+  addReplyLongLong(c, GetDelayLength(MappedTDelayBaseAddress));
 }
 
 void GetPulserRate(client *c, int argc, sds *argv)
@@ -369,12 +405,12 @@ void GetPulserWidth(client *c, int argc, sds *argv)
 
 void GetPulserNPulses(client *c, int argc, sds *argv)
 {
-  addReply(c, ":%d", GetNPulses(MappedPulserBaseAddress));
+  addReplyLongLong(c, GetNPulses(MappedPulserBaseAddress));
 }
 
 void GetDelay(client *c, int argc, sds *argv)
 {
-  addReply(c, ":%d", GetDelayLength(MappedDelayBaseAddress));
+  addReplyLongLong(c, GetDelayLength(MappedDelayBaseAddress));
 }
 
 //// DAQ Connection and emergency stop functions
@@ -425,13 +461,223 @@ void dataready(client *c, int argc, sds *argv)
   else addReplyError(c, tubii_err);
 }
 
+// Reply to a client blocked on a shift register load once it's done
+static void shift_reply(void *data)
+{
+  client *c = (client *) data;
+  addReplyStatus(c, "+OK");
+  unblockClient(c);
+}
+
+// Wait for a shift register load to finish before replying. Inside a batch
+// nothing is loaded until EXEC, so reply straight away.
+static void shift_wait(client *c)
+{
+  if(shift_batch) addReplyStatus(c, "+OK");
+  else blockClient(c, client_disconnect, c);
+}
+
+// MULTI/EXEC hooks. The shift register setters in the batch only stage
+// their chains, then every chain which changed is loaded in a single pass
+// and EXEC replies once that's done.
+void tubii_exec_begin(client *c)
+{
+  shift_batch = 1;
+}
+
+static void exec_shift_done(void *data)
+{
+  client *c = (client *) data;
+  execReply(c);
+  unblockClient(c);
+}
+
+int tubii_exec_end(client *c, int failed)
+{
+  shift_batch = 0;
+  if(failed){
+    // Don't load half a batch
+    shift_rollback();
+    return 0;
+  }
+  if(!shift_dirty) return 0;
+
+  if(shift_commit(exec_shift_done, c)){
+    Log(WARNING, "TUBii: failed to load the shift registers for a batch");
+    return 0;
+  }
+  blockClient(c, client_disconnect, c);
+  return 1;
+}
+
+// Argument checks for MULTI, see multi.c. Each takes the arguments of a
+// command and returns NULL if they're fine, or the error if running it would
+// fail.
+const char *CheckDataReady(int argc, sds *argv)
+{
+  uint32_t dReg;
+  safe_strtoul(argv[1],&dReg);
+  return checkDataReady(dReg) ? tubii_err : NULL;
+}
+
+const char *CheckMuxEnable(int argc, sds *argv)
+{
+  uint32_t muxEn;
+  safe_strtoul(argv[1],&muxEn);
+  return checkMuxEnable(muxEn) ? tubii_err : NULL;
+}
+
+const char *CheckMuxer(int argc, sds *argv)
+{
+  uint32_t mux;
+  safe_strtoul(argv[1],&mux);
+  return checkMuxer(mux) ? tubii_err : NULL;
+}
+
+// <rate> <width> <npulses>
+const char *CheckPulser(int argc, sds *argv)
+{
+  float rate=0, length=0;
+  safe_strtof(argv[1],&rate);
+  safe_strtof(argv[2],&length);
+  return checkPulser(rate, length) ? tubii_err : NULL;
+}
+
+const char *CheckTUBiiPGT(int argc, sds *argv)
+{
+  float rate=0;
+  safe_strtof(argv[1],&rate);
+  return checkPulser(rate, 50) ? tubii_err : NULL;
+}
+
+const char *CheckControlReg(int argc, sds *argv)
+{
+  uint32_t cReg;
+  safe_strtoul(argv[1],&cReg);
+  return shift_check_byte("Control register", cReg) ? tubii_err : NULL;
+}
+
+const char *CheckECalBit(int argc, sds *argv)
+{
+  uint32_t cReg;
+  safe_strtoul(argv[1],&cReg);
+  if(cReg!=1 && cReg!=0) return "ECals can only be set on (1) or off (0).";
+  return NULL;
+}
+
+const char *CheckCaenWords(int argc, sds *argv)
+{
+  uint32_t gPath, cSelect;
+  safe_strtoul(argv[1],&gPath);
+  safe_strtoul(argv[2],&cSelect);
+  if(shift_check_byte("CAEN gain path", gPath)) return tubii_err;
+  if(shift_check_byte("CAEN channel select", cSelect)) return tubii_err;
+  return NULL;
+}
+
+const char *CheckDACThreshold(int argc, sds *argv)
+{
+  uint32_t dacThresh;
+  safe_strtoul(argv[1],&dacThresh);
+  return shift_check_dac(dacThresh) ? tubii_err : NULL;
+}
+
+const char *CheckGTDelays(int argc, sds *argv)
+{
+  uint32_t loDelay, dgtDelay;
+  safe_strtoul(argv[1],&loDelay);
+  safe_strtoul(argv[2],&dgtDelay);
+  if(shift_check_byte("LO* delay", loDelay)) return tubii_err;
+  if(shift_check_byte("DGT delay", dgtDelay)) return tubii_err;
+  return NULL;
+}
+
+const char *CheckAllowableClockMisses(int argc, sds *argv)
+{
+  uint32_t nMisses;
+  safe_strtoul(argv[1],&nMisses);
+  return shift_check_byte("Allowable clock misses", nMisses) ? tubii_err : NULL;
+}
+
+const char *CheckTriggerMask(int argc, sds *argv)
+{
+  uint32_t mask, mask_async;
+  safe_strtoul(argv[1],&mask);
+  safe_strtoul(argv[2],&mask_async);
+  return checkTriggerMask(mask, mask_async) ? tubii_err : NULL;
+}
+
+const char *CheckBurstTrigger(int argc, sds *argv)
+{
+  uint32_t masterBit, slaveBit;
+  safe_strtoul(argv[2],&masterBit);
+  safe_strtoul(argv[3],&slaveBit);
+  return checkBurstTrig(masterBit, slaveBit) ? tubii_err : NULL;
+}
+
+const char *CheckComboTrigger(int argc, sds *argv)
+{
+  uint32_t enableMask, logicMask;
+  safe_strtoul(argv[1],&enableMask);
+  safe_strtoul(argv[2],&logicMask);
+  return checkComboTrig(enableMask, logicMask) ? tubii_err : NULL;
+}
+
+const char *CheckPrescaleTrigger(int argc, sds *argv)
+{
+  uint32_t bit;
+  safe_strtoul(argv[2],&bit);
+  return checkPrescaleTrig(bit) ? tubii_err : NULL;
+}
+
+const char *CheckBundleSize(int argc, sds *argv)
+{
+  uint32_t size;
+  if(safe_strtoul(argv[1],&size) || size<1 || size>MEGA_RECORD_MAX){
+    sprintf(tubii_err, "bundle size must be between 1 and %i", MEGA_RECORD_MAX);
+    return tubii_err;
+  }
+  return NULL;
+}
+
+const char *CheckBundleDeadline(int argc, sds *argv)
+{
+  uint32_t ms;
+  if(safe_strtoul(argv[1],&ms) || ms>1000)
+    return "bundle deadline must be between 0 and 1000 ms";
+  return NULL;
+}
+
+const char *CheckSimRate(int argc, sds *argv)
+{
+  float rate=0;
+  if(safe_strtof(argv[1],&rate) || rate<0){
+    snprintf(tubii_err, sizeof(tubii_err), "'%.200s' is not a valid rate", argv[1]);
+    return tubii_err;
+  }
+  if(!reg_backend && (readout_source == NULL || readout_source->mode != READOUT_SIM))
+    return "TUBii: neither the registers nor the FIFO are simulated";
+  return NULL;
+}
+
+const char *CheckSimBurst(int argc, sds *argv)
+{
+  uint32_t burst;
+  if(safe_strtoul(argv[1],&burst) || burst<1){
+    snprintf(tubii_err, sizeof(tubii_err), "'%.200s' is not a valid burst size", argv[1]);
+    return tubii_err;
+  }
+  if(!reg_backend) return "TUBii: registers aren't simulated";
+  return NULL;
+}
+
 void loadShift(client *c, int argc, sds *argv)
 {
   uint32_t lShift;
   safe_strtoul(argv[1],&lShift);
-  int ret= LoadShift(lShift);
+  int ret= LoadShift(lShift, shift_reply, c);
 
-  if(ret == 0) addReplyStatus(c, "+OK");
+  if(ret == 0) blockClient(c, client_disconnect, c);
   else addReplyError(c, tubii_err);
 }
 
@@ -460,29 +706,35 @@ void SetControlReg(client *c, int argc, sds *argv)
 {
   uint32_t cReg;
   safe_strtoul(argv[1],&cReg);
-  ControlReg(cReg);
+  if(ControlReg(cReg, shift_reply, c)){
+    addReplyError(c, tubii_err);
+    return;
+  }
   save_tubii_state();
-  addReplyStatus(c, "+OK");
+  shift_wait(c);
 }
 
 void GetControlReg(client *c, int argc, sds *argv)
 {
   // This won't be done by ReadShift due to a bug in the hardware
-  addReply(c, ":%d", mReadReg((u32) MappedRegsBaseAddress, RegOffset10));
+  addReplyLongLong(c, sReadReg((u32) MappedRegsBaseAddress, RegOffset10));
 }
 
 void SetECalBit(client *c, int argc, sds *argv)
 {
   uint32_t cReg;
-  safe_strtoul(argv[1],&cReg);
-  if(cReg==1 || cReg==0){
-	  ControlReg((mReadReg((u32) MappedRegsBaseAddress, RegOffset10) & 4294967291) + 4*cReg);
-	  save_tubii_state();
-	  addReplyStatus(c, "+OK");
+  const char *err= CheckECalBit(argc, argv);
+  if(err){
+	  addReplyError(c, err);
+	  return;
   }
-  else{
-	  addReplyError(c, "ECals can only be set on (1) or off (0).");
+  safe_strtoul(argv[1],&cReg);
+  if(ControlReg((shift_staged.control & 4294967291) + 4*cReg, shift_reply, c)){
+	  addReplyError(c, tubii_err);
+	  return;
   }
+  save_tubii_state();
+  shift_wait(c);
 }
 
 // CAEN Settings
@@ -491,19 +743,22 @@ void SetCaenWords(client *c, int argc, sds *argv)
   uint32_t gPath, cSelect;
   safe_strtoul(argv[1],&gPath);
   safe_strtoul(argv[2],&cSelect);
-  CAENWords(gPath, cSelect);
+  if(CAENWords(gPath, cSelect, shift_reply, c)){
+    addReplyError(c, tubii_err);
+    return;
+  }
   save_tubii_state();
-  addReplyStatus(c, "+OK");
+  shift_wait(c);
 }
 
 void GetCAENGainPathWord(client *c, int argc, sds *argv)
 {
-  addReply(c, ":%d", mReadReg((u32) MappedRegsBaseAddress, RegOffset11));
+  addReplyLongLong(c, sReadReg((u32) MappedRegsBaseAddress, RegOffset11));
 }
 
 void GetCAENChannelSelectWord(client *c, int argc, sds *argv)
 {
-  addReply(c, ":%d", mReadReg((u32) MappedRegsBaseAddress, RegOffset12));
+  addReplyLongLong(c, sReadReg((u32) MappedRegsBaseAddress, RegOffset12));
 }
 
 // DAC Settings
@@ -511,14 +766,17 @@ void SetDACThreshold(client *c, int argc, sds *argv)
 {
   uint32_t dacThresh;
   safe_strtoul(argv[1],&dacThresh);
-  DACThresholds(dacThresh);
+  if(DACThresholds(dacThresh, shift_reply, c)){
+    addReplyError(c, tubii_err);
+    return;
+  }
   save_tubii_state();
-  addReplyStatus(c, "+OK");
+  shift_wait(c);
 }
 
 void GetDACThreshold(client *c, int argc, sds *argv)
 {
-  addReply(c, ":%d", mReadReg((u32) MappedRegsBaseAddress, RegOffset13));
+  addReplyLongLong(c, sReadReg((u32) MappedRegsBaseAddress, RegOffset13));
 }
 
 // DGT & LO
@@ -527,27 +785,33 @@ void SetGTDelays(client *c, int argc, sds *argv)
   uint32_t loDelay, dgtDelay;
   safe_strtoul(argv[1],&loDelay);
   safe_strtoul(argv[2],&dgtDelay);
-  GTDelays(loDelay, dgtDelay);
+  if(GTDelays(loDelay, dgtDelay, shift_reply, c)){
+    addReplyError(c, tubii_err);
+    return;
+  }
   save_tubii_state();
-  addReplyStatus(c, "+OK");
+  shift_wait(c);
 }
 
 void GetLODelay(client *c, int argc, sds *argv)
 {
-  addReply(c, ":%d", mReadReg((u32) MappedRegsBaseAddress, RegOffset14));
+  addReplyLongLong(c, sReadReg((u32) MappedRegsBaseAddress, RegOffset14));
 }
 
 void GetDGTDelay(client *c, int argc, sds *argv)
 {
-  addReply(c, ":%d", mReadReg((u32) MappedRegsBaseAddress, RegOffset15));
+  addReplyLongLong(c, sReadReg((u32) MappedRegsBaseAddress, RegOffset15));
 }
 
 void SetAllowableClockMisses(client *c, int argc, sds *argv)
 {
   uint32_t nMisses;
   safe_strtoul(argv[1],&nMisses);
-  ClockMisses(nMisses);
-  addReplyStatus(c, "+OK");
+  if(ClockMisses(nMisses, shift_reply, c)){
+    addReplyError(c, tubii_err);
+    return;
+  }
+  shift_wait(c);
 }
 
 // Trigger Commands
@@ -587,7 +851,7 @@ void SetCounterMask(client *c, int argc, sds *argv)
 
 void GetCounterMask(client *c, int argc, sds *argv)
 {
-  addReply(c, ":%u", getCounterMask());
+  addReplyLongLong(c, getCounterMask());
 }
 
 void SetSpeakerMask(client *c, int argc, sds *argv)
@@ -610,7 +874,7 @@ void SetSpeakerScale(client *c, int argc, sds *argv)
 
 void GetSpeakerMask(client *c, int argc, sds *argv)
 {
-  addReply(c, ":%u", getSpeakerMask());
+  addReplyLongLong(c, getSpeakerMask());
 }
 
 void SetTriggerMask(client *c, int argc, sds *argv)
@@ -618,19 +882,22 @@ void SetTriggerMask(client *c, int argc, sds *argv)
   uint32_t mask, mask_async;
   safe_strtoul(argv[1],&mask);
   safe_strtoul(argv[2],&mask_async);
-  triggerMask(mask,mask_async);
+  if(triggerMask(mask,mask_async) < 0){
+    addReplyError(c, tubii_err);
+    return;
+  }
   save_tubii_state();
   addReplyStatus(c, "+OK");
 }
 
 void GetSyncTriggerMask(client *c, int argc, sds *argv)
 {
-  addReply(c, ":%u", getSyncTriggerMask());
+  addReplyLongLong(c, getSyncTriggerMask());
 }
 
 void GetAsyncTriggerMask(client *c, int argc, sds *argv)
 {
-  addReply(c, ":%u", getAsyncTriggerMask());
+  addReplyLongLong(c, getAsyncTriggerMask());
 }
 
 void SetBurstTrigger(client *c, int argc, sds *argv)
@@ -757,7 +1024,7 @@ void GetGTID(client *c, int argc, sds *argv)
 {
   int gtid=currentgtid();
   Log(NOTICE, "TUBii: Current GTID: %lu\n", gtid);
-  addReply(c, ":%u", gtid);
+  addReplyLongLong(c, gtid);
 }
 
 void GetFifoTrigger(client *c, int argc, sds *argv)
@@ -766,31 +1033,31 @@ void GetFifoTrigger(client *c, int argc, sds *argv)
 	struct GenericRecordHeader header;
 
     int size=0;
-    int loop=0;
-	while(loop<1000){ //empty==0){
-	//usleep(100);
-    loop++;
-	/* Send a TUBii_RECORD to the data stream server */
-    struct TubiiRecord trec;
-    fifoTrigger(&trec);
+    int i, n;
 
-    printf("GTID %i Word %i\n",trec.GTID,trec.TrigWord);
-    if(last_gtid!=trec.GTID){
-      if(last_gtid!=trec.GTID-1 && trec.GTID!=0) printf("Missed one! %i --> %i\n",last_gtid,trec.GTID);
+    if(readout_thread_running()){
+      // The FIFO can only be read from one thread at a time
+      addReplyError(c, "TUBii: FIFO is being read out by the readout thread");
+      return;
+    }
+
+    n= fifoDrain(mega.array, MEGA_RECORD_MAX);
+	for(i=0; i<n; i++){
+    struct TubiiRecord trec=mega.array[i];
 
-      last_gtid=trec.GTID;
-      printf("GTID %i Word %i\n",trec.GTID,trec.TrigWord);
+    printf("GTID %i Word %i\n",trec.GTID,trec.TrigWord);
+    int prev_gtid=last_gtid;
+    if(check_gtid(trec.GTID)){
+      if(prev_gtid!=trec.GTID-1 && trec.GTID!=0) printf("Missed one! %i --> %i\n",prev_gtid,trec.GTID);
 
-	  /* convert to big endian */
-      int i;
-      for (i = 0; i < sizeof(trec)/4; i++) {
-        ((uint32_t *)&trec)[i] = htonl(((uint32_t *)&trec)[i]);
-      }
       mega.array[size]=trec;
       size = size+1;
     }
 	}
 
+	/* convert to big endian */
+	records_to_big_endian(mega.array, size);
+
 	if(size>0){
     printf("Bundle!\n");
     printf("%i events!\n",size);
@@ -805,6 +1072,34 @@ void GetFifoTrigger(client *c, int argc, sds *argv)
     addReplyStatus(c, "+OK");
 }
 
+static void send_gap_record()
+{
+    struct GenericRecordHeader header;
+    struct TubiiGaps gaps = gaps_interval;
+    int j;
+
+    if(gaps.Gaps){
+      Log(WARNING, "TUBII: FIFO skipped %u GTIDs in %u gaps\n", gaps.Missed, gaps.Gaps);
+    }
+
+    gaps_total.Gaps += gaps.Gaps;
+    gaps_total.Missed += gaps.Missed;
+    gaps_total.Wraps += gaps.Wraps;
+    gaps_total.Resets += gaps.Resets;
+    memset(&gaps_interval, 0, sizeof(gaps_interval));
+
+    /* convert to big endian */
+    for (j = 0; j < sizeof(gaps)/4; j++) {
+      ((uint32_t *)&gaps)[j] = htonl(((uint32_t *)&gaps)[j]);
+    }
+
+    header.RecordID = htonl(TUBII_GAPS);
+    header.RecordLength = htonl(sizeof(gaps));
+    header.RecordVersion = htonl(RECORD_VERSION);
+
+    write_to_data_stream(&header, &gaps);
+}
+
 int tubii_status(aeEventLoop *el, long long id, void *data)
 {
     if(getStatusReadout() == 0) return 1000;
@@ -818,6 +1113,9 @@ int tubii_status(aeEventLoop *el, long long id, void *data)
 	// Reset flag to prevent spamming warnings
 	spam_flag=0;
 
+	/* Sends the GTID gaps for this interval to the data stream */
+	send_gap_record();
+
 	// Renew the MZHappy Pulser
 	//Pulser(1,0.5,100,MappedHappyBaseAddress);
 
@@ -874,161 +1172,1083 @@ int getStatusReadout()
 	return status_readout;
 }
 
-int start_tubii_readout(long long milliseconds)
+// Account for the jump from last_gtid to gtid. GTIDs are 24 bits, so the
+// size of a gap is the distance between them modulo 2^24. Returns 1 if the
+// GTID has advanced (i.e. this isn't a repeat of the last record).
+static int check_gtid(uint32_t gtid)
 {
-    if (tubii_readout_id != AE_ERR) {
-        sprintf(tubii_err, "TUBii: readout already running!");
-        return -1;
-    }
-    //if(getDataReadout() == 0) return 0;
+	uint32_t last = last_gtid;
+	uint32_t dist = (gtid - last) & 0xFFFFFF;
 
-    // set up read out event
-    if ((tubii_readout_id = aeCreateTimeEvent(el, milliseconds, tubii_readout, NULL, NULL)) == AE_ERR) {
-        sprintf(tubii_err, "failed to set up tubii readout");
-        return -1;
-    }
+	if(gtid==last) return 0;
 
-    return 0;
+	if(gtid<last){
+		if(dist<0x800000){
+			gaps_interval.Wraps++;
+		}
+		else{
+			// Went backwards, so don't count it as a gap
+			gaps_interval.Resets++;
+			last_gtid=gtid;
+			return 1;
+		}
+	}
+
+	// Have we missed a tick
+	if(dist>1 && gtid!=0 && gtid!=1 && (last & 0xFFFF)!=0xFFFE){
+		gaps_interval.Gaps++;
+		gaps_interval.Missed+=dist-1;
+		if(spam_flag==0){
+			Log(WARNING, "TUBII: FIFO skipped %u GTIDs (%u -> %u)\n", dist-1, last, gtid);
+			spam_flag=1;
+		}
+	}
+
+	last_gtid=gtid;
+	return 1;
 }
 
-int tubii_readout(aeEventLoop *el, long long id, void *data)
+static int fifo_read_hw(readoutSource *src, struct TubiiRecord *rec, int max)
 {
-	// Check if we want to read data
-    if(getDataReadout() == 0) return 1000;
+	// Pull exactly what's in the hardware FIFO straight into the bundle
+	return fifoDrain(rec, max);
+}
 
-	struct MegaRecord mega;
-	struct GenericRecordHeader header;
+static int fifo_count_hw(readoutSource *src)
+{
+	return fifoOccupancy();
+}
 
-    int size=0;
-    int loop=0;
-    struct TubiiRecord trec;
-	for(loop=0; loop<1000; loop++){
-		/* Send a TUBii_RECORD to the data stream server */
-		fifoTrigger(&trec);
+// Returns -1 if the FIFO is empty, 0 if a bundle is still building up in
+// it, and 1 if it's full enough (or old enough) to be read out.
+static int bundle_ready()
+{
+	int n= readout_source->count(readout_source);
+	long long now;
+
+	if(n==0){
+		bundle_first=0;
+		return -1;
+	}
+
+	now= ustime();
+	if(bundle_first==0) bundle_first=now;
+
+	if(n<bundle_max && now-bundle_first<bundle_deadline*1000LL) return 0;
+
+	// Start the deadline again for anything left behind
+	bundle_first=0;
+	return 1;
+}
+
+// Drop repeated records, check for gaps and convert the n records read out
+// of the FIFO to big endian. Returns the number of records left.
+static int process_bundle(struct TubiiRecord *bundle, int n)
+{
+	int size=0;
+	int i;
+	struct TubiiRecord trec;
+
+	for(i=0; i<n; i++){
+		trec=bundle[i];
 
 		// Have we advanced?
-		if(last_gtid!=trec.GTID){
-			// Have we missed a tick
-			if(last_gtid!=trec.GTID-1 && trec.GTID!=0 && trec.GTID!=1 && (last_gtid & 0xFFFF)!=0xFFFE){
-				if(spam_flag==0){
-					Log(WARNING, "TUBII: FIFO skipped GTIDs\n");
-					spam_flag=1;
-				}
-			}
-			last_gtid=trec.GTID;
-
-			/* convert to big endian */
-		    int i;
-		    for (i = 0; i < sizeof(trec)/4; i++) {
-		      ((uint32_t *)&trec)[i] = htonl(((uint32_t *)&trec)[i]);
-		    }
-
-			mega.array[size]=trec;
-			//printf("%i \t %i\n",mega.size, last_gtid);
+		if(check_gtid(trec.GTID)){
+			bundle[size]=trec;
 			size=size+1;
 		}
 	}
 
-	if(size>0){
-		//printf("Bundle! %i events!\n",mega.size);
-		header.RecordID = htonl(MEGA_RECORD);
-		header.RecordLength = htonl(sizeof(u32)*(2*size));
-		header.RecordVersion = htonl(RECORD_VERSION);
+	if(size==0) return 0;
 
-		write_to_data_stream(&header, &mega);
-    }
+	for(i=0; (size>>(i+1)) && i<BUNDLE_HIST_BINS-1; i++);
+	bundle_hist[i]++;
 
-    return 1;
+	// Convert the whole bundle to big endian in one go
+	records_to_big_endian(bundle, size);
+
+	return size;
 }
 
-// Read the database configuration details from a config file
-void auto_load_config(char* file)
+static void readout_bundle()
 {
-	FILE *fp=fopen(file,"r");
-	if(fp!=0){
-    	char call[255];
-    	while(fscanf(fp,"%s",call)!=EOF){
-    		if(strcmp(call,"user")==0) fscanf(fp,"%s",dbconfig.user);
-    		else if(strcmp(call,"pass")==0) fscanf(fp,"%s",dbconfig.password);
-    		else if(strcmp(call,"dbname")==0) fscanf(fp,"%s",dbconfig.name);
-    		else if(strcmp(call,"dbhost")==0) fscanf(fp,"%s",dbconfig.host);
-    		else printf("TUBii: Unrecognised data type in config file, %s\n\n",call);
-    	}
+	// The bundle is built in place in the data stream buffer. If there's no
+	// contiguous room there (or no data stream) fall back to a local buffer.
+	static struct MegaRecord scratch;
+	struct GenericRecordHeader header;
+	struct TubiiRecord *bundle;
+	int reserved=1;
+	int n, size;
+	long long start= stat_time();
+
+	bundle= data_stream_reserve(sizeof(struct MegaRecord));
+	if(bundle==NULL){
+		bundle=scratch.array;
+		reserved=0;
 	}
 
-	fclose(fp);
-}
+	n= readout_source->read(readout_source, bundle, bundle_max);
+	hist_record(&stat_readout_events, n);
 
-void load_new_config(client *c, int argc, sds *argv)
-{
-	auto_load_config(argv[1]);
-    addReplyStatus(c, "+OK");
-}
+	size= process_bundle(bundle, n);
+	if(size==0) goto done;
 
+	if(reserved){
+		data_stream_commit(MEGA_RECORD, sizeof(u32)*(2*size));
+	}
+	else{
+		header.RecordID = htonl(MEGA_RECORD);
+		header.RecordLength = htonl(sizeof(u32)*(2*size));
+		header.RecordVersion = htonl(RECORD_VERSION);
 
-// There are two sets of functions for the database.
-// - One writes to the database on command at the start of a run. This uses the functions:
-//     save_TUBii_command, load_TUBii_command, save_db_client_callback, client disconnect
-// - The second aims to give the current status of TUBii by writing to the row with key=0.
-// This works from by calling the save_tubii_state function in any command which could change
-// a database value. It then waits one second (in case multiple changes are being made) and
-// the writes to the database. It uses the functions:
-//     save_tubii_state, save_tubii, save_db_callback
+		write_to_data_stream(&header, bundle);
+	}
 
-void save_TUBii_command(client *c, int argc, sds *argv)
+done:
+	hist_record(&stat_readout, stat_time() - start);
+}
+
+// Called from the readout thread
+static int thread_ready()
 {
-    /* Update the TUBii state. */
-    char command[2048];// = sdsempty();
+	if(__atomic_load_n(&data_readout, __ATOMIC_RELAXED) == 0) return 0;
 
-    // SELECT save_tubii
-    // Writes to the next free row or (if settings match previous, returns that instead)
-    sprintf(command, "SELECT save_tubii ("
-                     "%u, %u, %u, %u, %u, %u, %u, %u, %u, %u, %u, %u, %u, %u, %u, %u, %u,"
-                     "%u, %u, %f, %f, %f, %u, %u, %f, %f, %u, %u, %f, %f, %u, %u"
-           	         ");",
-                     mReadReg((u32) MappedRegsBaseAddress, RegOffset10),
-                     getSyncTriggerMask(), getAsyncTriggerMask(),
-                     getSpeakerMask(), getCounterMask(),
-                     mReadReg((u32) MappedRegsBaseAddress, RegOffset11),
-                     mReadReg((u32) MappedRegsBaseAddress, RegOffset12),
-                     mReadReg((u32) MappedRegsBaseAddress, RegOffset14),
-                     mReadReg((u32) MappedRegsBaseAddress, RegOffset15),
-                     mReadReg((u32) MappedRegsBaseAddress, RegOffset13),
-                     mReadReg((u32) MappedComboBaseAddress, RegOffset2),
-                     mReadReg((u32) MappedComboBaseAddress, RegOffset3),
-                     counter_mode, clockStatus(),
-                     mReadReg((u32) MappedPrescaleBaseAddress, RegOffset2),
-                     mReadReg((u32) MappedPrescaleBaseAddress, RegOffset3),
-                     mReadReg((u32) MappedBurstBaseAddress, RegOffset0),
-                     mReadReg((u32) MappedBurstBaseAddress, RegOffset2),
-                     mReadReg((u32) MappedBurstBaseAddress, RegOffset3),
-                     GetRate(MappedTUBiiPGTBaseAddress),
-                     GetRate(MappedSPulserBaseAddress),GetWidth(MappedSPulserBaseAddress),
-                     GetNPulses(MappedSPulserBaseAddress),GetDelayLength(MappedSDelayBaseAddress),
-                     GetRate(MappedTPulserBaseAddress),GetWidth(MappedTPulserBaseAddress),
-                     GetNPulses(MappedTPulserBaseAddress),GetDelayLength(MappedTDelayBaseAddress),
-                     GetRate(MappedPulserBaseAddress),GetWidth(MappedPulserBaseAddress),
-                     GetNPulses(MappedPulserBaseAddress),GetDelayLength(MappedDelayBaseAddress)
-                     );
-
-    if (db_exec_async(detector_db, command, save_db_client_callback, c)) {
-        addReplyError(c, "TUBii: database isn't connected");
-        return;
-    }
+	if(bundle_ready() <= 0) return 0;
 
-    blockClient(c, client_disconnect, c);
-    return;
+	return __atomic_load_n(&bundle_max, __ATOMIC_RELAXED);
 }
 
-void load_TUBii_command(client *c, int argc, sds *argv)
+// Called from the event loop with each bundle the readout thread reads
+static void thread_emit(struct TubiiRecord *bundle, int n)
 {
-    /* Load TUBii hardware settings from the database. */
-	uint32_t key;
-    char command[3072];
+	struct GenericRecordHeader header;
+	int size;
+	long long start= stat_time();
 
-    if (safe_strtoul(argv[1], &key)) {
-        addReplyErrorFormat(c, "'%s' is not a valid uint32_t", argv[1]);
-        return;
+	hist_record(&stat_readout_events, n);
+
+	size= process_bundle(bundle, n);
+	if(size>0){
+		header.RecordID = htonl(MEGA_RECORD);
+		header.RecordLength = htonl(sizeof(u32)*(2*size));
+		header.RecordVersion = htonl(RECORD_VERSION);
+
+		write_to_data_stream(&header, bundle);
+	}
+
+	// The FIFO read itself happened in the readout thread, so this only
+	// covers the part of the readout done in the event loop
+	hist_record(&stat_readout, stat_time() - start);
+}
+
+static int readout_pending(aeEventLoop *el, long long id, void *data)
+{
+	// The FIFO wakeup has fired but readout is switched off or the bundle
+	// hasn't filled up yet. Keep checking until it's time to drain the FIFO,
+	// then re-arm the wakeup.
+	int ready;
+
+	if(getDataReadout() == 0) return 1000;
+
+	ready= bundle_ready();
+	if(ready==0) return 1;
+	if(ready>0) readout_bundle();
+
+	if(readout_source->arm(readout_source)){
+		Log(WARNING, "TUBii: %s", readout_err);
+	}
+
+	return AE_NOMORE;
+}
+
+static void tubii_readout_wake(aeEventLoop *el, int fd, void *data, int mask)
+{
+	if(readout_source->ack(readout_source)){
+		Log(WARNING, "TUBii: %s", readout_err);
+		return;
+	}
+
+	if(getDataReadout() == 0 || bundle_ready() == 0){
+		// Leave the wakeup disabled until the bundle is ready
+		if(aeCreateTimeEvent(el, getDataReadout() ? 1 : 1000, readout_pending, NULL, NULL) == AE_ERR){
+			Log(WARNING, "TUBii: failed to set up readout re-arm event");
+		}
+		return;
+	}
+
+	readout_bundle();
+
+	if(readout_source->arm(readout_source)){
+		Log(WARNING, "TUBii: %s", readout_err);
+	}
+}
+
+int start_tubii_readout(int mode, const char *dev, double sim_rate, int rt_cpu, int rt_prio)
+{
+    if (readout_source != NULL) {
+        sprintf(tubii_err, "TUBii: readout already running!");
+        return -1;
+    }
+
+    switch (mode) {
+    case READOUT_POLL:
+        readout_source = readout_poll_create(fifo_read_hw, fifo_count_hw);
+        break;
+    case READOUT_UIO:
+        readout_source = readout_uio_create(dev, fifo_read_hw, fifo_count_hw);
+        break;
+    case READOUT_SIM:
+        readout_source = readout_sim_create(el, sim_rate);
+        break;
+    default:
+        sprintf(tubii_err, "TUBii: unknown readout mode %i", mode);
+        return -1;
+    }
+
+    if (readout_source == NULL) {
+        snprintf(tubii_err, sizeof(tubii_err), "TUBii: %.240s", readout_err);
+        return -1;
+    }
+
+    if (rt_cpu != READOUT_NO_THREAD) {
+        // Read the FIFO out from its own thread
+        if (readout_thread_start(el, readout_source, thread_ready, thread_emit, rt_cpu, rt_prio)) {
+            snprintf(tubii_err, sizeof(tubii_err), "TUBii: %.240s", readout_thread_err);
+            goto err;
+        }
+        Log(NOTICE, "TUBii: readout thread started on cpu %i", rt_cpu);
+    } else if (readout_source->fd == -1) {
+        // No wakeup available, so poll the FIFO
+        if ((tubii_readout_id = aeCreateTimeEvent(el, 1000, tubii_readout, NULL, NULL)) == AE_ERR) {
+            sprintf(tubii_err, "failed to set up tubii readout");
+            goto err;
+        }
+    } else {
+        if (aeCreateFileEvent(el, readout_source->fd, AE_READABLE, tubii_readout_wake, NULL) == AE_ERR) {
+            sprintf(tubii_err, "failed to set up tubii readout wakeup");
+            goto err;
+        }
+    }
+
+    Log(NOTICE, "TUBii: %s readout started", readout_mode_name(mode));
+
+    return 0;
+
+err:
+    readout_free(readout_source);
+    readout_source = NULL;
+    return -1;
+}
+
+int tubii_readout(aeEventLoop *el, long long id, void *data)
+{
+	// Check if we want to read data
+    if(getDataReadout() == 0) return 1000;
+
+    if(bundle_ready() > 0) readout_bundle();
+
+    return 1;
+}
+
+void GetReadoutLatency(client *c, int argc, sds *argv)
+{
+  readoutThreadStats stats;
+  int i;
+
+  if(!readout_thread_running()){
+    addReplyError(c, "TUBii: readout thread isn't running");
+    return;
+  }
+
+  readout_thread_get_stats(&stats);
+
+  addReplyMultiBulkLen(c, 12);
+  addReplyBulkCString(c, "bundles");
+  addReplyLongLong(c, stats.bundles);
+  addReplyBulkCString(c, "avg_us");
+  addReplyLongLong(c, stats.bundles ? stats.latency_sum/stats.bundles : 0);
+  addReplyBulkCString(c, "max_us");
+  addReplyLongLong(c, stats.latency_max);
+  addReplyBulkCString(c, "ring_full");
+  addReplyLongLong(c, stats.ring_full);
+  addReplyBulkCString(c, "ring_max");
+  addReplyLongLong(c, stats.ring_max);
+  // One count per power of two bin: <2 us, 2-3 us, 4-7 us, ...
+  addReplyBulkCString(c, "hist");
+  addReplyMultiBulkLen(c, READOUT_LATENCY_BINS);
+  for(i=0; i<READOUT_LATENCY_BINS; i++) addReplyLongLong(c, stats.latency_hist[i]);
+}
+
+void ResetReadoutLatency(client *c, int argc, sds *argv)
+{
+  readout_thread_reset_stats();
+  addReplyStatus(c, "+OK");
+}
+
+void GetReadoutMode(client *c, int argc, sds *argv)
+{
+  addReplyStatus(c, readout_mode_name(readout_source->mode));
+}
+
+void GetGapCounts(client *c, int argc, sds *argv)
+{
+  // Counts since startup, including the interval in progress
+  addReplyMultiBulkLen(c, 8);
+  addReplyBulkCString(c, "gaps");
+  addReplyLongLong(c, gaps_total.Gaps + gaps_interval.Gaps);
+  addReplyBulkCString(c, "missed");
+  addReplyLongLong(c, gaps_total.Missed + gaps_interval.Missed);
+  addReplyBulkCString(c, "wraps");
+  addReplyLongLong(c, gaps_total.Wraps + gaps_interval.Wraps);
+  addReplyBulkCString(c, "resets");
+  addReplyLongLong(c, gaps_total.Resets + gaps_interval.Resets);
+}
+
+void SetBundleSize(client *c, int argc, sds *argv)
+{
+  uint32_t size;
+  const char *err= CheckBundleSize(argc, argv);
+  if(err){
+    addReplyError(c, err);
+    return;
+  }
+  safe_strtoul(argv[1],&size);
+
+  bundle_max=size;
+  addReplyStatus(c, "+OK");
+}
+
+void SetBundleDeadline(client *c, int argc, sds *argv)
+{
+  uint32_t ms;
+  const char *err= CheckBundleDeadline(argc, argv);
+  if(err){
+    addReplyError(c, err);
+    return;
+  }
+  safe_strtoul(argv[1],&ms);
+
+  bundle_deadline=ms;
+  addReplyStatus(c, "+OK");
+}
+
+void GetBundleHist(client *c, int argc, sds *argv)
+{
+  // One count per power of two bin: 1, 2-3, 4-7, ... records per bundle
+  int i;
+  addReplyMultiBulkLen(c, BUNDLE_HIST_BINS);
+  for(i=0; i<BUNDLE_HIST_BINS; i++) addReplyLongLong(c, bundle_hist[i]);
+}
+
+void ResetBundleHist(client *c, int argc, sds *argv)
+{
+  memset(bundle_hist, 0, sizeof(bundle_hist));
+  addReplyStatus(c, "+OK");
+}
+
+void SetSimRate(client *c, int argc, sds *argv)
+{
+  float rate=0;
+  const char *err= CheckSimRate(argc, argv);
+  if(err){
+    addReplyError(c, err);
+    return;
+  }
+  safe_strtof(argv[1],&rate);
+
+  if(reg_backend) regsim_set_rate(reg_backend, rate);
+  else readout_sim_set_rate(readout_source, rate);
+
+  addReplyStatus(c, "+OK");
+}
+
+void SetSimBurst(client *c, int argc, sds *argv)
+{
+  uint32_t burst;
+  const char *err= CheckSimBurst(argc, argv);
+  if(err){
+    addReplyError(c, err);
+    return;
+  }
+  safe_strtoul(argv[1],&burst);
+
+  regsim_set_burst(reg_backend, burst);
+  addReplyStatus(c, "+OK");
+}
+
+// Triggers the register model has generated, and how many of them were
+// lost because the FIFO was full
+void GetSimCounts(client *c, int argc, sds *argv)
+{
+  uint64_t triggers, lost;
+
+  if(!reg_backend){
+    addReplyError(c, "TUBii: registers aren't simulated");
+    return;
+  }
+
+  regsim_counts(reg_backend, &triggers, &lost);
+  addReplyMultiBulkLen(c, 2);
+  addReplyLongLong(c, triggers);
+  addReplyLongLong(c, lost);
+}
+
+// Read the database configuration details from a config file
+void auto_load_config(char* file)
+{
+	FILE *fp=fopen(file,"r");
+	if(fp!=0){
+    	char call[255];
+    	while(fscanf(fp,"%s",call)!=EOF){
+    		if(strcmp(call,"user")==0) fscanf(fp,"%s",dbconfig.user);
+    		else if(strcmp(call,"pass")==0) fscanf(fp,"%s",dbconfig.password);
+    		else if(strcmp(call,"dbname")==0) fscanf(fp,"%s",dbconfig.name);
+    		else if(strcmp(call,"dbhost")==0) fscanf(fp,"%s",dbconfig.host);
+    		else printf("TUBii: Unrecognised data type in config file, %s\n\n",call);
+    	}
+    	fclose(fp);
+	}
+}
+
+void load_new_config(client *c, int argc, sds *argv)
+{
+	auto_load_config(argv[1]);
+    addReplyStatus(c, "+OK");
+}
+
+
+//// Register shadow
+// Mismatches seen by the last periodic check, so they're only logged once
+int shadow_drift=0;
+
+// Reply with an "address shadow hardware" line for every configuration
+// register which no longer holds the value last written to it
+void VerifyShadow(client *c, int argc, sds *argv)
+{
+  struct ShadowDrift drift[AXI_BLOCKS*SHADOW_REGS];
+  char line[64];
+  int i, n;
+
+  n= ShadowVerify(drift, AXI_BLOCKS*SHADOW_REGS);
+  addReplyMultiBulkLen(c, n);
+  for(i=0; i<n; i++){
+    sprintf(line, "0x%08lx 0x%08lx 0x%08lx", drift[i].addr, drift[i].shadow, drift[i].hw);
+    addReplyBulkCString(c, line);
+  }
+}
+
+int shadow_verify(aeEventLoop *el, long long id, void *data)
+{
+  struct ShadowDrift drift[AXI_BLOCKS*SHADOW_REGS];
+  int i, n;
+
+  n= ShadowVerify(drift, AXI_BLOCKS*SHADOW_REGS);
+  if(n != shadow_drift){
+    if(n == 0) Log(NOTICE, "TUBii: registers match their shadow again");
+    for(i=0; i<n; i++){
+      Log(WARNING, "TUBii: register 0x%08lx reads 0x%08lx but was set to 0x%08lx",
+          drift[i].addr, drift[i].hw, drift[i].shadow);
+    }
+  }
+  shadow_drift= n;
+
+  return SHADOW_VERIFY_PERIOD;
+}
+
+// There are two sets of functions for the database.
+// - One writes to the database on command at the start of a run. This uses the functions:
+//     save_TUBii_command, load_TUBii_command, save_db_client_callback, client disconnect
+// - The second aims to give the current status of TUBii by writing to the row with key=0.
+// This works from by calling the save_tubii_state function in any command which could change
+// a database value. It then waits one second (in case multiple changes are being made) and
+// the writes to the database. It uses the functions:
+//     save_tubii_state, save_tubii, save_db_callback
+
+// Both saves send the same 32 values as binary parameters to a statement
+// prepared once per database connection. The statements are built from
+// tubii_state_columns, and tubii_state_params() fills in the values in the
+// same order.
+#define TUBII_STATE_PARAMS 32
+
+static const char *tubii_state_columns[TUBII_STATE_PARAMS] = {
+    "control_reg", "trigger_mask", "async_trigger_mask",
+    "speaker_mask", "counter_mask",
+    "caen_gain_reg", "caen_channel_reg", "lockout_reg", "dgt_reg", "dac_reg",
+    "combo_enable_mask", "combo_mask", "counter_mode", "clock_status",
+    "prescale_value", "prescale_channel",
+    "burst_rate", "burst_channel", "burst_slave", "pgt_rate",
+    "smellie_pulse_rate", "smellie_pulse_width", "smellie_npulses", "smellie_delay_length",
+    "tellie_pulse_rate", "tellie_pulse_width", "tellie_npulses", "tellie_delay_length",
+    "pulse_rate", "pulse_width", "npulses", "delay_length"
+};
+
+// The columns load applies, as indices into tubii_state_columns
+enum {
+    FIELD_CONTROL_REG, FIELD_TRIGGER_MASK, FIELD_ASYNC_TRIGGER_MASK,
+    FIELD_SPEAKER_MASK, FIELD_COUNTER_MASK,
+    FIELD_CAEN_GAIN_REG, FIELD_CAEN_CHANNEL_REG, FIELD_LOCKOUT_REG, FIELD_DGT_REG, FIELD_DAC_REG,
+    FIELD_COMBO_ENABLE_MASK, FIELD_COMBO_MASK, FIELD_COUNTER_MODE, FIELD_CLOCK_STATUS,
+    FIELD_PRESCALE_VALUE, FIELD_PRESCALE_CHANNEL,
+    FIELD_BURST_RATE, FIELD_BURST_CHANNEL, FIELD_BURST_SLAVE,
+    TUBII_LOAD_FIELDS
+};
+
+static const Oid tubii_state_types[TUBII_STATE_PARAMS] = {
+    DB_INT4, DB_INT4, DB_INT4, DB_INT4, DB_INT4, DB_INT4, DB_INT4, DB_INT4,
+    DB_INT4, DB_INT4, DB_INT4, DB_INT4, DB_INT4, DB_INT4, DB_INT4, DB_INT4,
+    DB_INT4, DB_INT4, DB_INT4, DB_FLOAT4, DB_FLOAT4, DB_FLOAT4, DB_INT4, DB_INT4,
+    DB_FLOAT4, DB_FLOAT4, DB_INT4, DB_INT4, DB_FLOAT4, DB_FLOAT4, DB_INT4, DB_INT4
+};
+
+static dbStatement *save_tubii_stmt;
+static dbStatement *save_state_stmt;
+
+// The state last sent to row 0. save_tubii() only writes the columns which
+// differ from it, and skips the save if nothing does.
+static dbParam saved_state[TUBII_STATE_PARAMS];
+static int saved_state_valid = 0;
+
+static long long saves_full = 0;
+static long long saves_partial = 0;
+static long long saves_skipped = 0;
+
+// While the database can't be reached, snapshots of the state for row 0 and
+// save commands go to a journal on the SD card instead. Whenever the
+// database connection comes back up the journal is replayed, see
+// replay_tubii_journal(). Saves the database refuses are moved to a second
+// journal next to it (<journal>.failed) so they can't hold up the rest.
+#define JOURNAL_STATE 1
+#define JOURNAL_SAVE 2
+
+static journal *tubii_journal = NULL;
+static journal *tubii_journal_failed = NULL;
+
+typedef struct {
+    client *c;
+    dbParam params[TUBII_STATE_PARAMS];
+} save_db_args;
+
+typedef struct {
+    int nsaves;
+    dbParam (*saves)[TUBII_STATE_PARAMS];
+    // journal offset just past each save
+    long *ends;
+    int state;
+    // offset just past the last record
+    long end;
+    // saves sent, and saves the database has answered
+    int sent;
+    int done;
+    // set if a save got no answer, so it and everything after it stay in
+    // the journal
+    int stopped;
+} journal_replay;
+
+static void replay_tubii_journal(database *db, void *data);
+
+int prepare_tubii_statements(database *db)
+{
+    /* Register the statements used to save TUBii's state. They are
+     * prepared again by the database layer whenever it reconnects. */
+    sds columns = sdsempty();
+    sds values = sdsempty();
+    sds updates = sdsempty();
+    sds command;
+    int i;
+
+    for (i = 0; i < TUBII_STATE_PARAMS; i++) {
+        const char *sep = i ? ", " : "";
+
+        columns = sdscatprintf(columns, "%s%s", sep, tubii_state_columns[i]);
+        values = sdscatprintf(values, "%s$%i", sep, i+1);
+        updates = sdscatprintf(updates, "%s%s = EXCLUDED.%s", sep,
+                               tubii_state_columns[i], tubii_state_columns[i]);
+    }
+
+    // Writes to the next free row or (if settings match previous, returns that instead)
+    command = sdscatprintf(sdsempty(), "SELECT save_tubii (%s)", values);
+    save_tubii_stmt = db_prepare(db, "save_tubii", command,
+                                 TUBII_STATE_PARAMS, tubii_state_types);
+    sdsfree(command);
+
+    // Inserts the current state into row 0
+    command = sdscatprintf(sdsempty(), "INSERT INTO TUBii (key, %s) VALUES (0, %s)"
+                           " ON CONFLICT (key) DO UPDATE SET %s RETURNING key",
+                           columns, values, updates);
+    save_state_stmt = db_prepare(db, "save_tubii_state", command,
+                                 TUBII_STATE_PARAMS, tubii_state_types);
+    sdsfree(command);
+
+    sdsfree(columns);
+    sdsfree(values);
+    sdsfree(updates);
+
+    if (save_tubii_stmt == NULL || save_state_stmt == NULL) return -1;
+
+    return 0;
+}
+
+int open_tubii_journal(database *db, const char *path)
+{
+    /* Open the journal and replay it each time the database connects. */
+    sds failed;
+
+    tubii_journal = journal_open(el, path);
+
+    if (tubii_journal == NULL) return -1;
+
+    failed = sdscatprintf(sdsempty(), "%s.failed", path);
+    tubii_journal_failed = journal_open(el, failed);
+    sdsfree(failed);
+
+    db_on_connect(db, replay_tubii_journal, NULL);
+
+    return 0;
+}
+
+static int journal_tubii(uint32_t type, const dbParam *params)
+{
+    if (tubii_journal == NULL) return -1;
+
+    return journal_append(tubii_journal, type, params, sizeof(dbParam)*TUBII_STATE_PARAMS);
+}
+
+static void journal_replay_record(uint32_t type, const void *data, uint32_t len, long end, void *privdata)
+{
+    journal_replay *r = (journal_replay *) privdata;
+
+    if (len != sizeof(dbParam)*TUBII_STATE_PARAMS) {
+        Log(WARNING, "TUBii: skipping journal record of %u bytes", len);
+        return;
+    }
+
+    if (type == JOURNAL_SAVE) {
+        r->saves = realloc(r->saves, sizeof(*r->saves)*(r->nsaves+1));
+        r->ends = realloc(r->ends, sizeof(long)*(r->nsaves+1));
+        memcpy(r->saves[r->nsaves], data, len);
+        r->ends[r->nsaves++] = end;
+    } else if (type == JOURNAL_STATE) {
+        r->state = 1;
+    }
+}
+
+static void replay_finish(journal_replay *r)
+{
+    /* Remove everything which was dealt with from the journal. */
+    long end;
+
+    if (r->stopped) {
+        end = r->done ? r->ends[r->done-1] : 0;
+        Log(WARNING, "TUBii: %i journaled saves weren't replayed, will try again "
+            "when the database reconnects", r->nsaves - r->done);
+    } else {
+        end = r->end;
+    }
+
+    if (end) journal_consume(tubii_journal, end);
+
+    free(r->saves);
+    free(r->ends);
+    free(r);
+}
+
+static void replay_save_callback(PGresult *res, PGconn *conn, void *data)
+{
+    journal_replay *r = (journal_replay *) data;
+
+    if (res == NULL) {
+        // It may or may not have been written, so keep it in case
+        r->stopped = 1;
+    } else if (r->stopped) {
+        // Only the saves before the first unanswered one leave the journal
+    } else if (PQresultStatus(res) == PGRES_TUPLES_OK && PQntuples(res) == 1) {
+        Log(NOTICE, "TUBii: journaled save written to the database with key %s",
+            PQgetvalue(res, 0, 0));
+        r->done++;
+    } else {
+        Log(WARNING, "TUBii: database refused journaled save: %s",
+            PQresultErrorMessage(res));
+        if (tubii_journal_failed == NULL ||
+            journal_append(tubii_journal_failed, JOURNAL_SAVE, r->saves[r->done],
+                           sizeof(dbParam)*TUBII_STATE_PARAMS)) {
+            Log(WARNING, "TUBii: failed to keep the refused save, dropping it");
+        }
+        r->done++;
+    }
+
+    if (--r->sent == 0) replay_finish(r);
+}
+
+static void replay_tubii_journal(database *db, void *data)
+{
+    /* Write everything journaled while the database was away. Each save is
+     * written on its own, so one the database refuses doesn't stop the rest.
+     * The journal is cut back past every save the database has answered
+     * once they've all been answered. */
+    journal_replay *r = calloc(1, sizeof(journal_replay));
+    int i;
+
+    r->end = journal_read(tubii_journal, journal_replay_record, r);
+
+    if (r->nsaves == 0 && !r->state) {
+        free(r);
+        return;
+    }
+
+    Log(NOTICE, "TUBii: replaying %i journaled saves%s", r->nsaves,
+        r->state ? " and the TUBii state" : "");
+
+    // Row 0 is rewritten from the registers rather than the journaled
+    // snapshots, which could be older than what's there if an earlier
+    // replay failed.
+    if (r->state) {
+        saved_state_valid = 0;
+        save_tubii_state();
+    }
+
+    // A failed send resets the connection, which answers the saves already
+    // sent straight away, so hold on to r until they're all queued
+    r->sent = 1;
+
+    for (i = 0; i < r->nsaves; i++) {
+        r->sent++;
+        if (db_exec_prepared_async(db, save_tubii_stmt, r->saves[i], replay_save_callback, r)) {
+            r->sent--;
+            r->stopped = 1;
+            break;
+        }
+    }
+
+    if (--r->sent == 0) replay_finish(r);
+}
+
+static void tubii_state_params(dbParam *p)
+{
+    /* Fill in the parameters for the save statements from the current
+     * TUBii settings. */
+    p[0].u = sReadReg((u32) MappedRegsBaseAddress, RegOffset10);
+    p[1].u = getSyncTriggerMask();
+    p[2].u = getAsyncTriggerMask();
+    p[3].u = getSpeakerMask();
+    p[4].u = getCounterMask();
+    p[5].u = sReadReg((u32) MappedRegsBaseAddress, RegOffset11);
+    p[6].u = sReadReg((u32) MappedRegsBaseAddress, RegOffset12);
+    p[7].u = sReadReg((u32) MappedRegsBaseAddress, RegOffset14);
+    p[8].u = sReadReg((u32) MappedRegsBaseAddress, RegOffset15);
+    p[9].u = sReadReg((u32) MappedRegsBaseAddress, RegOffset13);
+    p[10].u = sReadReg((u32) MappedComboBaseAddress, RegOffset2);
+    p[11].u = sReadReg((u32) MappedComboBaseAddress, RegOffset3);
+    p[12].u = counter_mode;
+    p[13].u = clockStatus();
+    p[14].u = sReadReg((u32) MappedPrescaleBaseAddress, RegOffset2);
+    p[15].u = sReadReg((u32) MappedPrescaleBaseAddress, RegOffset3);
+    p[16].u = sReadReg((u32) MappedBurstBaseAddress, RegOffset0);
+    p[17].u = sReadReg((u32) MappedBurstBaseAddress, RegOffset2);
+    p[18].u = sReadReg((u32) MappedBurstBaseAddress, RegOffset3);
+    p[19].f = GetRate(MappedTUBiiPGTBaseAddress);
+    p[20].f = GetRate(MappedSPulserBaseAddress);
+    p[21].f = GetWidth(MappedSPulserBaseAddress);
+    p[22].u = GetNPulses(MappedSPulserBaseAddress);
+    p[23].u = GetDelayLength(MappedSDelayBaseAddress);
+    p[24].f = GetRate(MappedTPulserBaseAddress);
+    p[25].f = GetWidth(MappedTPulserBaseAddress);
+    p[26].u = GetNPulses(MappedTPulserBaseAddress);
+    p[27].u = GetDelayLength(MappedTDelayBaseAddress);
+    p[28].f = GetRate(MappedPulserBaseAddress);
+    p[29].f = GetWidth(MappedPulserBaseAddress);
+    p[30].u = GetNPulses(MappedPulserBaseAddress);
+    p[31].u = GetDelayLength(MappedDelayBaseAddress);
+}
+
+static void save_client_disconnect(void *data)
+{
+    /* The save is still written when the client goes away. */
+    save_db_args *args = (save_db_args *) data;
+
+    args->c = NULL;
+}
+
+void save_TUBii_command(client *c, int argc, sds *argv)
+{
+    /* Update the TUBii state. */
+    save_db_args *args = (save_db_args *) malloc(sizeof(save_db_args));
+    args->c = c;
+
+    // SELECT save_tubii
+    // Writes to the next free row or (if settings match previous, returns that instead)
+    tubii_state_params(args->params);
+
+    if (db_exec_prepared_async(detector_db, save_tubii_stmt, args->params, save_db_client_callback, args)) {
+        // Written when the database is back. There's no key yet.
+        if (journal_tubii(JOURNAL_SAVE, args->params)) {
+            addReplyError(c, "TUBii: database isn't connected");
+        } else {
+            Log(NOTICE, "TUBii: database isn't connected, save journaled");
+            addReplyLongLong(c, -1);
+        }
+        free(args);
+        return;
+    }
+
+    blockClient(c, save_client_disconnect, args);
+    return;
+}
+
+// Configurations recently loaded from or saved to the database, so loading
+// one of the standard run configurations again doesn't need the database.
+// Rows never change once they're written, apart from row 0 which holds the
+// current state and is never cached.
+#define CONFIG_CACHE_SIZE 16
+
+typedef struct {
+    uint32_t key;
+    uint64_t used;     // when it was last used, 0 if the slot is empty
+    uint32_t present;  // bit mask of the fields in the row
+    uint32_t value[TUBII_LOAD_FIELDS];
+} tubii_config;
+
+static tubii_config config_cache[CONFIG_CACHE_SIZE];
+static uint64_t config_cache_clock = 0;
+
+static tubii_config *config_cache_get(uint32_t key)
+{
+    int i;
+
+    for (i = 0; i < CONFIG_CACHE_SIZE; i++) {
+        if (config_cache[i].used && config_cache[i].key == key) {
+            config_cache[i].used = ++config_cache_clock;
+            return &config_cache[i];
+        }
+    }
+
+    return NULL;
+}
+
+static void config_cache_put(const tubii_config *cfg)
+{
+    /* Add a configuration, replacing the least recently used one if the
+     * cache is full. */
+    tubii_config *slot = &config_cache[0];
+    int i;
+
+    if (cfg->key == 0) return;
+
+    for (i = 0; i < CONFIG_CACHE_SIZE; i++) {
+        if (config_cache[i].used && config_cache[i].key == cfg->key) {
+            slot = &config_cache[i];
+            break;
+        }
+        if (config_cache[i].used < slot->used) slot = &config_cache[i];
+    }
+
+    *slot = *cfg;
+    slot->used = ++config_cache_clock;
+}
+
+// Which field each column of a load result holds. Every load gets the same
+// columns back, so they're only looked up by name when that changes.
+#define COLUMN_SKIP -1
+#define COLUMN_UNKNOWN -2
+
+static struct {
+    int ncolumns;
+    sds *names;
+    int *field;
+} load_columns = {0, NULL, NULL};
+
+static void resolve_load_columns(PGresult *res)
+{
+    int i, j, n = PQnfields(res);
+    char *name;
+
+    if (n == load_columns.ncolumns) {
+        for (i = 0; i < n; i++)
+            if (strcmp(load_columns.names[i], PQfname(res, i))) break;
+        if (i == n) return;
+    }
+
+    for (i = 0; i < load_columns.ncolumns; i++)
+        sdsfree(load_columns.names[i]);
+    free(load_columns.names);
+    free(load_columns.field);
+
+    load_columns.ncolumns = n;
+    load_columns.names = malloc(sizeof(sds)*(n ? n : 1));
+    load_columns.field = malloc(sizeof(int)*(n ? n : 1));
+
+    for (i = 0; i < n; i++) {
+        name = PQfname(res, i);
+        load_columns.names[i] = sdsnew(name);
+
+        if (!strcmp(name, "key") || !strcmp(name, "timestamp")) {
+            load_columns.field[i] = COLUMN_SKIP;
+            continue;
+        }
+
+        load_columns.field[i] = COLUMN_UNKNOWN;
+        for (j = 0; j < TUBII_LOAD_FIELDS; j++) {
+            if (!strcmp(name, tubii_state_columns[j])) {
+                load_columns.field[i] = j;
+                break;
+            }
+        }
+    }
+}
+
+static int parse_tubii_config(client *c, PGresult *res, tubii_config *cfg)
+{
+    /* Read the configuration in the first row of a load result. Replies to
+     * the client and returns -1 on error. */
+    char *value_str;
+    uint32_t value;
+    int i, field;
+
+    resolve_load_columns(res);
+
+    cfg->present = 0;
+
+    for (i = 0; i < load_columns.ncolumns; i++) {
+        field = load_columns.field[i];
+
+        if (field == COLUMN_SKIP) continue;
+
+        if (field == COLUMN_UNKNOWN) {
+            addReplyErrorFormat(c, "got unknown field '%s'", load_columns.names[i]);
+            return -1;
+        }
+
+        if (PQgetisnull(res, 0, i)) {
+            addReplyErrorFormat(c, "column %s contains a NULL value", load_columns.names[i]);
+            return -1;
+        }
+
+        value_str = PQgetvalue(res, 0, i);
+
+        if (safe_strtoul(value_str, &value)) {
+            addReplyErrorFormat(c, "unable to convert value '%s' for field %s",
+                                value_str, load_columns.names[i]);
+            return -1;
+        }
+
+        cfg->value[field] = value;
+        cfg->present |= 1 << field;
+    }
+
+    return 0;
+}
+
+static int apply_tubii_config(client *c, const tubii_config *cfg)
+{
+    /* Set TUBii up from a configuration. Returns -1 and replies with the
+     * error if something couldn't be set, 0 if the client has to wait for
+     * the shift registers to be loaded, in which case load_shift_done()
+     * replies, or 1 if it's all done. */
+    uint32_t value;
+    int i, ret = 0;
+
+    for (i = 0; i < TUBII_LOAD_FIELDS; i++) {
+        if (!(cfg->present & (1 << i))) continue;
+
+        value = cfg->value[i];
+
+        switch (i) {
+        case FIELD_CONTROL_REG:
+        	ret= shift_stage_control(value);
+        	break;
+        case FIELD_TRIGGER_MASK:
+        	individualTriggerMask(value,"sync");
+        	break;
+        case FIELD_ASYNC_TRIGGER_MASK:
+        	individualTriggerMask(value,"async");
+        	break;
+        case FIELD_SPEAKER_MASK:
+            speakerMask(value);
+            break;
+        case FIELD_COUNTER_MASK:
+            counterMask(value);
+            break;
+        case FIELD_CAEN_GAIN_REG:
+        	ret= shift_stage_caen(value, shift_staged.caen_channel);
+        	break;
+        case FIELD_CAEN_CHANNEL_REG:
+        	ret= shift_stage_caen(shift_staged.caen_gain, value);
+        	break;
+        case FIELD_LOCKOUT_REG:
+        	ret= shift_stage_gt(value, shift_staged.dgt);
+        	break;
+        case FIELD_DGT_REG:
+        	ret= shift_stage_gt(shift_staged.lo, value);
+        	break;
+        case FIELD_DAC_REG:
+        	ret= shift_stage_dac(value);
+        	break;
+        case FIELD_COUNTER_MODE:
+        	counterMode(value);
+        	break;
+        case FIELD_CLOCK_STATUS:
+        	// Do Nowt
+        	break;
+        case FIELD_COMBO_ENABLE_MASK:
+        	sWriteReg((u32) MappedComboBaseAddress, RegOffset2, value);
+        	break;
+        case FIELD_COMBO_MASK:
+        	sWriteReg((u32) MappedComboBaseAddress, RegOffset3, value);
+        	break;
+        case FIELD_PRESCALE_VALUE:
+        	sWriteReg((u32) MappedPrescaleBaseAddress, RegOffset2, value);
+        	break;
+        case FIELD_PRESCALE_CHANNEL:
+        	sWriteReg((u32) MappedPrescaleBaseAddress, RegOffset3, value);
+        	break;
+        case FIELD_BURST_RATE:
+        	sWriteReg((u32) MappedBurstBaseAddress, RegOffset0, value);
+        	break;
+        case FIELD_BURST_CHANNEL:
+        	sWriteReg((u32) MappedBurstBaseAddress, RegOffset2, value);
+        	break;
+        case FIELD_BURST_SLAVE:
+        	sWriteReg((u32) MappedBurstBaseAddress, RegOffset3, value);
+        	break;
+        }
+
+        if (ret) {
+            shift_rollback();
+            addReplyError(c, tubii_err);
+            return -1;
+        }
+    }
+
+    // Shift out the chains which changed in one go, and reply once that's
+    // done
+    ret = shift_commit(load_shift_done, c);
+
+    save_tubii_state();
+
+    return ret == 0 ? 0 : 1;
+}
+
+void load_TUBii_command(client *c, int argc, sds *argv)
+{
+    /* Load TUBii hardware settings from the database. */
+	uint32_t key;
+    char command[3072];
+    tubii_config *cfg;
+
+    if (safe_strtoul(argv[1], &key)) {
+        addReplyErrorFormat(c, "'%s' is not a valid uint32_t", argv[1]);
+        return;
+    }
+
+    if ((cfg = config_cache_get(key))) {
+        switch (apply_tubii_config(c, cfg)) {
+        case 0:
+            blockClient(c, client_disconnect, c);
+            break;
+        case 1:
+            addReplyStatus(c, "OK");
+            break;
+        }
+        return;
     }
 
     sprintf(command, "select * from TUBii where key = %i", key);
@@ -1050,11 +2270,9 @@ void load_TUBii_command(client *c, int argc, sds *argv)
 
 static void load_db_callback(PGresult *res, PGconn *conn, void *data)
 {
-    int i;
-    char *name, *value_str;
-    uint32_t value;
     int rows;
     load_db_args *args;
+    tubii_config cfg;
 
     args = (load_db_args *) data;
 
@@ -1090,72 +2308,20 @@ static void load_db_callback(PGresult *res, PGconn *conn, void *data)
         goto err;
     }
 
-    for (i = 0; i < PQnfields(res); i++) {
-        name = PQfname(res, i);
-
-        if (!strcmp(name, "key") || !strcmp(name, "timestamp")) continue;
+    if (parse_tubii_config(c, res, &cfg)) goto err;
 
-        if (PQgetisnull(res, 0, i)) {
-            addReplyErrorFormat(c, "column %s contains a NULL value", name);
-            goto err;
-        }
+    cfg.key = args->key;
+    config_cache_put(&cfg);
 
-        value_str = PQgetvalue(res, 0, i);
-
-        if (safe_strtoul(value_str, &value)) {
-            addReplyErrorFormat(c, "unable to convert value '%s' for field %s",
-                                value_str, name);
-            goto err;
-        }
-
-        if (!strcmp(name, "control_reg")) {
-        	ControlReg(value);
-        } else if (!strcmp(name, "trigger_mask")) {
-        	individualTriggerMask(value,"sync");
-        } else if (!strcmp(name, "async_trigger_mask")) {
-        	individualTriggerMask(value,"async");
-        } else if (!strcmp(name, "speaker_mask")) {
-            speakerMask(value);
-        } else if (!strcmp(name, "counter_mask")) {
-            counterMask(value);
-        } else if (!strcmp(name, "caen_gain_reg")) {
-        	CAENWords(value, mReadReg((u32) MappedRegsBaseAddress, RegOffset12));
-        } else if (!strcmp(name, "caen_channel_reg")) {
-        	CAENWords(mReadReg((u32) MappedRegsBaseAddress, RegOffset11), value);
-        } else if (!strcmp(name, "lockout_reg")) {
-        	GTDelays(value, mReadReg((u32) MappedRegsBaseAddress, RegOffset15));
-        } else if (!strcmp(name, "dgt_reg")) {
-        	GTDelays(mReadReg((u32) MappedRegsBaseAddress, RegOffset14), value);
-        } else if (!strcmp(name, "dac_reg")) {
-        	DACThresholds(value);
-        } else if (!strcmp(name, "counter_mode")) {
-        	counterMode(value);
-        } else if (!strcmp(name, "clock_status")) {
-        	// Do Nowt
-        } else if (!strcmp(name, "combo_enable_mask")) {
-        	mWriteReg((u32) MappedComboBaseAddress, RegOffset2, value);
-        } else if (!strcmp(name, "combo_mask")) {
-        	mWriteReg((u32) MappedComboBaseAddress, RegOffset3, value);
-        } else if (!strcmp(name, "prescale_value")) {
-        	mWriteReg((u32) MappedPrescaleBaseAddress, RegOffset2, value);
-        } else if (!strcmp(name, "prescale_channel")) {
-        	mWriteReg((u32) MappedPrescaleBaseAddress, RegOffset3, value);
-        } else if (!strcmp(name, "burst_rate")) {
-        	mWriteReg((u32) MappedBurstBaseAddress, RegOffset0, value);
-        } else if (!strcmp(name, "burst_channel")) {
-        	mWriteReg((u32) MappedBurstBaseAddress, RegOffset2, value);
-        } else if (!strcmp(name, "burst_slave")) {
-        	mWriteReg((u32) MappedBurstBaseAddress, RegOffset3, value);
-        } else {
-            addReplyErrorFormat(c, "got unknown field '%s'", name);
-            goto err;
-        }
+    switch (apply_tubii_config(c, &cfg)) {
+    case 0:
+        free(args);
+        return;
+    case 1:
+        addReplyStatus(c, "OK");
+        break;
     }
 
-    save_tubii_state();
-
-    addReplyStatus(c, "OK");
-
     unblockClient(c);
     free(args);
 
@@ -1171,13 +2337,28 @@ static void save_db_client_callback(PGresult *res, PGconn *conn, void *data)
 {
     /* Get result of save command. */
     uint32_t key;
+    tubii_config cfg;
+    int i;
 
-    client *c = (client *) data;
+    save_db_args *args = (save_db_args *) data;
+    client *c = args->c;
+
+    if (res == NULL && journal_tubii(JOURNAL_SAVE, args->params) == 0) {
+        /* The database went away, so it'll be saved when it's back. */
+        Log(NOTICE, "TUBii: database disconnected, save journaled");
+        if (c) {
+            addReplyLongLong(c, -1);
+            unblockClient(c);
+        }
+        free(args);
+        return;
+    }
 
     if (c == NULL) {
         /* This should only happen if the client disconnects while a database
          * request was pending. */
         Log(WARNING, "TUBii: client got database response but is disconnected!");
+        free(args);
         return;
     }
 
@@ -1204,111 +2385,103 @@ static void save_db_client_callback(PGresult *res, PGconn *conn, void *data)
         goto err;
     }
 
+    // The row holds what was just saved, so a load of it can come straight
+    // from the cache
+    cfg.key = key;
+    cfg.present = (1 << TUBII_LOAD_FIELDS) - 1;
+    for (i = 0; i < TUBII_LOAD_FIELDS; i++)
+        cfg.value[i] = args->params[i].u;
+    config_cache_put(&cfg);
+
     addReplyLongLong(c, key);
     unblockClient(c);
+    free(args);
     return;
 
 err:
     unblockClient(c);
+    free(args);
     return;
 }
 
+static void load_shift_done(void *data)
+{
+    client *c = (client *) data;
+
+    addReplyStatus(c, "OK");
+    unblockClient(c);
+}
+
 static void client_disconnect(void *data)
 {
     /* Called when a client disconnects while they are blocked waiting
-     * for a response from the database. Need to clear all requests sent by
-     * this client. */
+     * for a response from the database or for the shift registers to be
+     * loaded. Need to clear all requests sent by this client. */
     client *c = (client *) data;
 
     clear_db_requests_from_client(detector_db, c);
+    shift_clear_client(c);
 }
 
 static int save_tubii(aeEventLoop *el, long long id, void *data)
 {
     /* Saves the TUBii hardware settings to the detector database. */
-    char command[3072];
+    dbParam params[TUBII_STATE_PARAMS];
+    dbParam changed[TUBII_STATE_PARAMS];
+    Oid types[TUBII_STATE_PARAMS];
+    sds command;
+    int i, n = 0;
+    int ret;
 
-    // Inserts the current state into row 0
-    sprintf(command, "INSERT INTO TUBii ("
-                     "key,control_reg, trigger_mask, async_trigger_mask,"
-                     "speaker_mask, counter_mask,"
-                     "caen_gain_reg, caen_channel_reg, lockout_reg, dgt_reg, dac_reg,"
-                     "combo_enable_mask, combo_mask, counter_mode, clock_status,"
-                     "prescale_value, prescale_channel,"
-                     "burst_rate, burst_channel, burst_slave, pgt_rate,"
-                     "smellie_pulse_rate, smellie_pulse_width, smellie_npulses, smellie_delay_length,"
-                     "tellie_pulse_rate, tellie_pulse_width, tellie_npulses, tellie_delay_length,"
-                     "pulse_rate, pulse_width, npulses, delay_length"
-                     ") "
-                     "VALUES (0, "
-                     "%u, %u, %u, %u, %u, %u, %u, %u, %u, %u, %u, %u, %u, %u, %u, %u, %u,"
-                     " %u, %u, %f, %f, %f, %u, %u, %f, %f, %u, %u, %f, %f, %u, %u)"
-                     " ON CONFLICT (key) DO UPDATE SET "
-                     "control_reg = EXCLUDED.control_reg,"
-                     "trigger_mask = EXCLUDED.trigger_mask,"
-                     "async_trigger_mask = EXCLUDED.async_trigger_mask,"
-                     "speaker_mask = EXCLUDED.speaker_mask,"
-                     "counter_mask = EXCLUDED.counter_mask,"
-                     "caen_gain_reg = EXCLUDED.caen_gain_reg,"
-                     "caen_channel_reg = EXCLUDED.caen_channel_reg,"
-                     "lockout_reg = EXCLUDED.lockout_reg,"
-                     "dgt_reg = EXCLUDED.dgt_reg,"
-                     "dac_reg = EXCLUDED.dac_reg,"
-                     "combo_enable_mask = EXCLUDED.combo_enable_mask,"
-                     "combo_mask = EXCLUDED.combo_mask,"
-                     "counter_mode = EXCLUDED.counter_mode,"
-                     "clock_status = EXCLUDED.clock_status,"
-                     "prescale_value = EXCLUDED.prescale_value,"
-                     "prescale_channel = EXCLUDED.prescale_channel,"
-                     "burst_rate = EXCLUDED.burst_rate,"
-                     "burst_channel = EXCLUDED.burst_channel,"
-                     "burst_slave = EXCLUDED.burst_slave,"
-                     "pgt_rate = EXCLUDED.pgt_rate,"
-                     "smellie_pulse_rate = EXCLUDED.smellie_pulse_rate,"
-                     "smellie_pulse_width = EXCLUDED.smellie_pulse_width,"
-                     "smellie_npulses = EXCLUDED.smellie_npulses,"
-                     "smellie_delay_length = EXCLUDED.smellie_delay_length,"
-                     "tellie_pulse_rate = EXCLUDED.tellie_pulse_rate,"
-                     "tellie_pulse_width = EXCLUDED.tellie_pulse_width,"
-                     "tellie_npulses = EXCLUDED.tellie_npulses,"
-                     "tellie_delay_length = EXCLUDED.tellie_delay_length,"
-                     "pulse_rate = EXCLUDED.pulse_rate,"
-                     "pulse_width = EXCLUDED.pulse_width,"
-                     "npulses = EXCLUDED.npulses,"
-                     "delay_length = EXCLUDED.delay_length"
-                     " RETURNING key;",
-                     mReadReg((u32) MappedRegsBaseAddress, RegOffset10),
-                     getSyncTriggerMask(), getAsyncTriggerMask(),
-                     getSpeakerMask(), getCounterMask(),
-                     mReadReg((u32) MappedRegsBaseAddress, RegOffset11),
-                     mReadReg((u32) MappedRegsBaseAddress, RegOffset12),
-                     mReadReg((u32) MappedRegsBaseAddress, RegOffset14),
-                     mReadReg((u32) MappedRegsBaseAddress, RegOffset15),
-                     mReadReg((u32) MappedRegsBaseAddress, RegOffset13),
-                     mReadReg((u32) MappedComboBaseAddress, RegOffset2),
-                     mReadReg((u32) MappedComboBaseAddress, RegOffset3),
-                     counter_mode, clockStatus(),
-                     mReadReg((u32) MappedPrescaleBaseAddress, RegOffset2),
-                     mReadReg((u32) MappedPrescaleBaseAddress, RegOffset3),
-                     mReadReg((u32) MappedBurstBaseAddress, RegOffset0),
-                     mReadReg((u32) MappedBurstBaseAddress, RegOffset2),
-                     mReadReg((u32) MappedBurstBaseAddress, RegOffset3),
-                     GetRate(MappedTUBiiPGTBaseAddress),
-                     GetRate(MappedSPulserBaseAddress),GetWidth(MappedSPulserBaseAddress),
-                     GetNPulses(MappedSPulserBaseAddress),GetDelayLength(MappedSDelayBaseAddress),
-                     GetRate(MappedTPulserBaseAddress),GetWidth(MappedTPulserBaseAddress),
-                     GetNPulses(MappedTPulserBaseAddress),GetDelayLength(MappedTDelayBaseAddress),
-                     GetRate(MappedPulserBaseAddress),GetWidth(MappedPulserBaseAddress),
-                     GetNPulses(MappedPulserBaseAddress),GetDelayLength(MappedDelayBaseAddress)
-                     );
-
-    if (db_exec_async(detector_db, command, save_db_callback, NULL)) {
-        Log(WARNING, "database isn't connected to save tubii state");
-        save_tubii_id = -1;
-        return AE_NOMORE;
+    save_tubii_id = -1;
+
+    tubii_state_params(params);
+
+    if (!saved_state_valid) {
+        // Inserts the current state into row 0
+        if (db_exec_prepared_async(detector_db, save_state_stmt, params, save_db_callback, NULL)) {
+            Log(WARNING, "database isn't connected to save tubii state");
+            journal_tubii(JOURNAL_STATE, params);
+            return AE_NOMORE;
+        }
+
+        saves_full++;
+    } else {
+        // Only update the columns which changed since the last save
+        command = sdsnew("UPDATE TUBii SET ");
+        for (i = 0; i < TUBII_STATE_PARAMS; i++) {
+            if (params[i].u == saved_state[i].u) continue;
+
+            command = sdscatprintf(command, "%s%s = $%i", n ? ", " : "",
+                                   tubii_state_columns[i], n+1);
+            changed[n] = params[i];
+            types[n] = tubii_state_types[i];
+            n++;
+        }
+        command = sdscat(command, " WHERE key = 0 RETURNING key");
+
+        if (n == 0) {
+            saves_skipped++;
+            sdsfree(command);
+            return AE_NOMORE;
+        }
+
+        ret = db_exec_params_async(detector_db, command, n, types, changed, save_db_callback, NULL);
+        sdsfree(command);
+
+        if (ret) {
+            Log(WARNING, "database isn't connected to save tubii state");
+            journal_tubii(JOURNAL_STATE, params);
+            saved_state_valid = 0;
+            return AE_NOMORE;
+        }
+
+        saves_partial++;
     }
 
-    save_tubii_id = -1;
+    memcpy(saved_state, params, sizeof(saved_state));
+    saved_state_valid = 1;
+
     return AE_NOMORE;
 }
 
@@ -1320,6 +2493,7 @@ static void save_db_callback(PGresult *res, PGconn *conn, void *data)
     if (res == NULL) {
         /* Request failed for some reason. */
         Log(WARNING, "failed to save tubii state: request timed out or database disconnected");
+        if (saved_state_valid) journal_tubii(JOURNAL_STATE, saved_state);
         goto err;
     }
 
@@ -1329,7 +2503,7 @@ static void save_db_callback(PGresult *res, PGconn *conn, void *data)
         goto err;
     }
 
-    if (PQnfields(res) != 1) {
+    if (PQnfields(res) != 1 || PQntuples(res) != 1) {
         Log(WARNING, "failed to save tubii state: failed to get key from insert");
         goto err;
     }
@@ -1343,9 +2517,24 @@ static void save_db_callback(PGresult *res, PGconn *conn, void *data)
     return;
 
 err:
+    /* We don't know what's in row 0 now, so write all of it next time. */
+    saved_state_valid = 0;
     return;
 }
 
+void GetSaveCounts(client *c, int argc, sds *argv)
+{
+    /* Number of saves of the TUBii state which wrote every column, only the
+     * columns which changed, or were skipped since nothing changed. */
+    addReplyMultiBulkLen(c, 6);
+    addReplyBulkCString(c, "full");
+    addReplyLongLong(c, saves_full);
+    addReplyBulkCString(c, "partial");
+    addReplyLongLong(c, saves_partial);
+    addReplyBulkCString(c, "skipped");
+    addReplyLongLong(c, saves_skipped);
+}
+
 void save_tubii_state()
 {
     /* Set up an event to save the current TUBii state to the database in
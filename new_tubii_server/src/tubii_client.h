@@ -3,11 +3,22 @@
 
 #include "server.h"
 #include "sds.h"
+#include "regsim.h"
+#include "db.h"
 
 int safe_strtoul(char *s, uint32_t *si);
 int safe_strtoull(char *s, uint64_t *si);
 int safe_strtof(char *s, float *f);
 
+// Where the AXI register window comes from
+#define REGS_DEVMEM 0 /* the hardware, through /dev/mem */
+#define REGS_ANON   1 /* anonymous memory, for running without the hardware */
+#define REGS_SIM    2 /* the register model in regsim.c */
+
+extern int register_backing;
+extern regBackend *reg_backend;
+int register_backing_from_string(const char *s);
+
 // Initialise
 int auto_init();
 void initialise(client *c, int argc, sds *argv);
@@ -109,13 +120,60 @@ void start_status_readout(client *c, int argc, sds *argv);
 void stop_status_readout(client *c, int argc, sds *argv);
 int tubii_status(aeEventLoop *el, long long id, void *data);
 int tubii_readout(aeEventLoop *el, long long id, void *data);
-int start_tubii_readout(long long milliseconds);
+int start_tubii_readout(int mode, const char *dev, double sim_rate, int rt_cpu, int rt_prio);
+void GetReadoutMode(client *c, int argc, sds *argv);
+void SetSimRate(client *c, int argc, sds *argv);
+void SetSimBurst(client *c, int argc, sds *argv);
+void GetSimCounts(client *c, int argc, sds *argv);
+void GetGapCounts(client *c, int argc, sds *argv);
+void GetReadoutLatency(client *c, int argc, sds *argv);
+void ResetReadoutLatency(client *c, int argc, sds *argv);
+void SetBundleSize(client *c, int argc, sds *argv);
+void SetBundleDeadline(client *c, int argc, sds *argv);
+void GetBundleHist(client *c, int argc, sds *argv);
+void ResetBundleHist(client *c, int argc, sds *argv);
+
+extern char tubii_err[256];
+
+// Register shadow
+// How often the shadow is checked against the hardware (ms)
+#define SHADOW_VERIFY_PERIOD 60000
+void VerifyShadow(client *c, int argc, sds *argv);
+int shadow_verify(aeEventLoop *el, long long id, void *data);
 
 // DB
 void save_TUBii_command(client *c, int argc, sds *argv);
+void GetSaveCounts(client *c, int argc, sds *argv);
+int prepare_tubii_statements(database *db);
+int open_tubii_journal(database *db, const char *path);
 void load_TUBii_command(client *c, int argc, sds *argv);
 void load_new_config(client *c, int argc, sds *argv);
 
+// MULTI/EXEC hooks
+void tubii_exec_begin(client *c);
+int tubii_exec_end(client *c, int failed);
+
+// Argument checks for MULTI
+const char *CheckDataReady(int argc, sds *argv);
+const char *CheckMuxEnable(int argc, sds *argv);
+const char *CheckMuxer(int argc, sds *argv);
+const char *CheckPulser(int argc, sds *argv);
+const char *CheckTUBiiPGT(int argc, sds *argv);
+const char *CheckControlReg(int argc, sds *argv);
+const char *CheckECalBit(int argc, sds *argv);
+const char *CheckCaenWords(int argc, sds *argv);
+const char *CheckDACThreshold(int argc, sds *argv);
+const char *CheckGTDelays(int argc, sds *argv);
+const char *CheckAllowableClockMisses(int argc, sds *argv);
+const char *CheckTriggerMask(int argc, sds *argv);
+const char *CheckBurstTrigger(int argc, sds *argv);
+const char *CheckComboTrigger(int argc, sds *argv);
+const char *CheckPrescaleTrigger(int argc, sds *argv);
+const char *CheckBundleSize(int argc, sds *argv);
+const char *CheckBundleDeadline(int argc, sds *argv);
+const char *CheckSimRate(int argc, sds *argv);
+const char *CheckSimBurst(int argc, sds *argv);
+
 extern struct DBconfig {
 	char user[255];
 	char password[255];